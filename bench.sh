@@ -0,0 +1,24 @@
+#!/bin/sh
+# Compare guest page sizes on the handout programs: resident guest memory,
+# page table overhead, host max RSS and, for erat, simulation speed. The
+# other programs run too few instructions for their speed to mean anything.
+# usage: ./bench.sh [page sizes...]   (default: 4k 64k 2m)
+SIM=./sim
+PROGS=testfiles/handoutTestPrograms
+SIZES=${*:-"4k 64k 2m"}
+
+run() {
+  name=$1; speed=$2; prog=$3; shift 3
+  for size in $SIZES; do
+    printf "%-8s %-5s " "$name" "$size"
+    $SIM $prog --page-size $size --mem-stats "$@" < /dev/null | awk -v speed=$speed '
+      /^Simulated/    { mips = speed ? $(NF-1) : "-"; sub(/\(/, "", mips) }
+      /^Guest memory/ { pages = $3; kib = $8; sub(/\(/, "", kib); tables = $12; rss = $17 }
+      END { printf "%6s pages %7s KiB  tables %4s KiB  rss %6s KiB  %8s MIPS\n", pages, kib, tables, rss, mips }'
+  done
+}
+
+run hello 0 $PROGS/hello.riscv
+run echo  0 $PROGS/echo.riscv
+run fib   0 $PROGS/fib.riscv -- 25
+run erat  1 $PROGS/erat.riscv
@@ -0,0 +1,382 @@
+#include "bpred.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define TAGE_TABLES 4
+#define TAGE_BITS 10        // log2 of the entries of each tagged table
+#define TAG_BITS 9
+#define USEFUL_RESET (1L << 18)     // branches between ageing the useful counters
+
+enum jump_kind {
+    KIND_BRANCH,        // conditional branches
+    KIND_JAL,           // direct jumps and calls
+    KIND_RETURN,        // jalr through a link register
+    KIND_JALR,          // other indirect jumps and calls
+    NUM_KINDS
+};
+
+struct tage_entry {
+    uint16_t tag;
+    int8_t counter;     // -4..3, taken if not negative
+    uint8_t useful;     // 0..3
+};
+
+// counts for one instruction of the text segment
+struct branch_counts {
+    long executed;
+    long taken;
+    long mispredicted;
+};
+
+struct bpred {
+    struct bpred_config config;
+    uint8_t* counters;      // 2 bit saturating, taken from 2 up
+    uint64_t history;       // outcomes of the latest conditional branches, newest in bit 0
+    struct tage_entry* tagged[TAGE_TABLES];
+    unsigned lengths[TAGE_TABLES];  // history used by each tagged table, shortest first
+    long until_reset;
+    uint32_t* btb_pc;
+    uint32_t* btb_target;
+    uint32_t* ras;
+    unsigned ras_top;       // next free entry, wrapping around and overwriting the oldest
+    unsigned ras_used;
+    uint32_t text_start;
+    uint32_t text_count;
+    struct branch_counts* slots;
+    struct branch_counts outside;
+    long executed[NUM_KINDS];
+    long mispredicted[NUM_KINDS];
+};
+
+static const char* kind_names[] = { "static", "bimodal", "gshare", "tage" };
+
+int bpred_parse_config(const char* text, struct bpred_config* config) {
+    size_t length = strcspn(text, ":");
+    int kind = -1;
+    for (int i = 0; i < 4; i++) {
+        if (strlen(kind_names[i]) == length && !strncmp(text, kind_names[i], length)) {
+            kind = i;
+        }
+    }
+    if (kind < 0) {
+        return -1;
+    }
+    config->kind = kind;
+    config->table_bits = 12;
+    config->history_bits = kind == BPRED_TAGE ? 64 : kind == BPRED_GSHARE ? 12 : 0;
+    config->btb_bits = 9;
+    config->ras_depth = 16;
+    text += length;
+    unsigned* fields[] = { &config->table_bits, &config->history_bits };
+    for (int i = 0; i < 2 && *text == ':'; i++) {
+        char* end;
+        *fields[i] = strtoul(text + 1, &end, 0);
+        if (end == text + 1) {
+            return -1;
+        }
+        text = end;
+    }
+    if (*text != 0 || config->table_bits < 1 || config->table_bits > 24 || config->history_bits > 64
+        || (kind == BPRED_TAGE && config->history_bits < (1u << (TAGE_TABLES - 1)))) {
+        return -1;
+    }
+    return 0;
+}
+
+struct bpred* bpred_create(const struct bpred_config* config, uint32_t text_start, uint32_t text_end) {
+    struct bpred* bpred = calloc(1, sizeof(struct bpred));
+    if (bpred == NULL) {
+        return NULL;
+    }
+    bpred->config = *config;
+    bpred->counters = malloc(1u << config->table_bits);
+    bpred->btb_pc = malloc(sizeof(uint32_t) << config->btb_bits);
+    bpred->btb_target = calloc(1u << config->btb_bits, sizeof(uint32_t));
+    bpred->ras = calloc(config->ras_depth, sizeof(uint32_t));
+    bpred->text_start = text_start;
+    bpred->text_count = text_end > text_start ? (text_end - text_start) / 4 : 0;
+    bpred->slots = calloc(bpred->text_count + 1, sizeof(struct branch_counts));
+    int failed = bpred->counters == NULL || bpred->btb_pc == NULL || bpred->btb_target == NULL
+                 || bpred->ras == NULL || bpred->slots == NULL;
+    if (config->kind == BPRED_TAGE) {
+        for (int i = 0; i < TAGE_TABLES; i++) {
+            bpred->tagged[i] = malloc(sizeof(struct tage_entry) << TAGE_BITS);
+            bpred->lengths[i] = config->history_bits >> (TAGE_TABLES - 1 - i);
+            failed |= bpred->tagged[i] == NULL;
+            for (unsigned j = 0; !failed && j < (1u << TAGE_BITS); j++) {
+                bpred->tagged[i][j] = (struct tage_entry) { 0xFFFF, 0, 0 };     // matches no tag
+            }
+        }
+        bpred->until_reset = USEFUL_RESET;
+    }
+    if (failed) {
+        bpred_delete(bpred);
+        return NULL;
+    }
+    memset(bpred->counters, 1, 1u << config->table_bits);     // weakly not taken
+    memset(bpred->btb_pc, 0xFF, sizeof(uint32_t) << config->btb_bits);    // no pc is odd
+    return bpred;
+}
+
+void bpred_delete(struct bpred* bpred) {
+    free(bpred->counters);
+    for (int i = 0; i < TAGE_TABLES; i++) {
+        free(bpred->tagged[i]);
+    }
+    free(bpred->btb_pc);
+    free(bpred->btb_target);
+    free(bpred->ras);
+    free(bpred->slots);
+    free(bpred);
+}
+
+static struct branch_counts* counts_at(struct bpred* bpred, uint32_t pc) {
+    uint32_t slot = (pc - bpred->text_start) >> 2;
+    return slot < bpred->text_count ? &bpred->slots[slot] : &bpred->outside;
+}
+
+static void count(struct bpred* bpred, enum jump_kind kind, uint32_t pc, int taken, int mispredicted) {
+    struct branch_counts* counts = counts_at(bpred, pc);
+    counts->executed++;
+    counts->taken += taken;
+    counts->mispredicted += mispredicted;
+    bpred->executed[kind]++;
+    bpred->mispredicted[kind] += mispredicted;
+}
+
+static void train_counter(uint8_t* counter, int taken) {
+    if (taken && *counter < 3) {
+        (*counter)++;
+    } else if (!taken && *counter > 0) {
+        (*counter)--;
+    }
+}
+
+// the newest length bits of history folded down to bits bits
+static uint32_t fold(uint64_t history, unsigned length, unsigned bits) {
+    if (length < 64) {
+        history &= (1ull << length) - 1;
+    }
+    uint32_t folded = 0;
+    for (; history; history >>= bits) {
+        folded ^= history & ((1u << bits) - 1);
+    }
+    return folded;
+}
+
+static int tage_predict_and_train(struct bpred* bpred, uint32_t pc, int taken) {
+    struct tage_entry* entries[TAGE_TABLES];
+    uint16_t tags[TAGE_TABLES];
+    int provider = -1;
+    int alternate = -1;
+    for (int i = TAGE_TABLES - 1; i >= 0; i--) {
+        unsigned length = bpred->lengths[i];
+        uint32_t index = ((pc >> 2) ^ fold(bpred->history, length, TAGE_BITS)) & ((1u << TAGE_BITS) - 1);
+        tags[i] = ((pc >> 2) ^ fold(bpred->history, length, TAG_BITS) ^ (fold(bpred->history, length, TAG_BITS - 1) << 1))
+                  & ((1u << TAG_BITS) - 1);
+        entries[i] = &bpred->tagged[i][index];
+        if (entries[i]->tag == tags[i]) {
+            if (provider < 0) {
+                provider = i;
+            } else if (alternate < 0) {
+                alternate = i;
+            }
+        }
+    }
+    uint8_t* base = &bpred->counters[(pc >> 2) & ((1u << bpred->config.table_bits) - 1)];
+    int base_prediction = *base >= 2;
+    int alternate_prediction = alternate >= 0 ? entries[alternate]->counter >= 0 : base_prediction;
+    int prediction = provider >= 0 ? entries[provider]->counter >= 0 : base_prediction;
+    // a new entry is not trusted over the alternate until it has been useful
+    int weak = provider >= 0 && entries[provider]->useful == 0
+               && (entries[provider]->counter == 0 || entries[provider]->counter == -1);
+    int provider_prediction = prediction;
+    if (weak) {
+        prediction = alternate_prediction;
+    }
+
+    if (provider >= 0) {
+        struct tage_entry* entry = entries[provider];
+        if (taken && entry->counter < 3) {
+            entry->counter++;
+        } else if (!taken && entry->counter > -4) {
+            entry->counter--;
+        }
+        if (provider_prediction != alternate_prediction) {
+            if (provider_prediction == taken && entry->useful < 3) {
+                entry->useful++;
+            } else if (provider_prediction != taken && entry->useful > 0) {
+                entry->useful--;
+            }
+        }
+    }
+    if (provider < 0 || weak) {
+        train_counter(base, taken);
+    }
+
+    // on a misprediction take an entry in a table with longer history
+    if (prediction != taken) {
+        int allocated = 0;
+        for (int i = provider + 1; i < TAGE_TABLES && !allocated; i++) {
+            if (entries[i]->useful == 0) {
+                entries[i]->tag = tags[i];
+                entries[i]->counter = taken ? 0 : -1;
+                allocated = 1;
+            }
+        }
+        for (int i = provider + 1; i < TAGE_TABLES && !allocated; i++) {
+            entries[i]->useful--;
+        }
+    }
+    if (--bpred->until_reset == 0) {
+        for (int i = 0; i < TAGE_TABLES; i++) {
+            for (unsigned j = 0; j < (1u << TAGE_BITS); j++) {
+                bpred->tagged[i][j].useful >>= 1;
+            }
+        }
+        bpred->until_reset = USEFUL_RESET;
+    }
+    return prediction;
+}
+
+int bpred_branch(struct bpred* bpred, uint32_t pc, uint32_t target, int taken) {
+    unsigned mask = (1u << bpred->config.table_bits) - 1;
+    int prediction;
+    switch (bpred->config.kind) {
+        case BPRED_STATIC:
+            prediction = target < pc;
+            break;
+        case BPRED_BIMODAL: {
+            uint8_t* counter = &bpred->counters[(pc >> 2) & mask];
+            prediction = *counter >= 2;
+            train_counter(counter, taken);
+            break;
+        }
+        case BPRED_GSHARE: {
+            uint32_t history = fold(bpred->history, bpred->config.history_bits, bpred->config.table_bits);
+            uint8_t* counter = &bpred->counters[((pc >> 2) ^ history) & mask];
+            prediction = *counter >= 2;
+            train_counter(counter, taken);
+            break;
+        }
+        default:
+            prediction = tage_predict_and_train(bpred, pc, taken);
+            break;
+    }
+    bpred->history = (bpred->history << 1) | (taken != 0);
+    count(bpred, KIND_BRANCH, pc, taken, prediction != taken);
+    return prediction != taken;
+}
+
+// x1 and x5 are link registers
+static int is_link(int reg) {
+    return reg == 1 || reg == 5;
+}
+
+int bpred_jump(struct bpred* bpred, uint32_t pc, uint32_t target, int rd, int rs1, int is_jalr) {
+    int mispredicted;
+    enum jump_kind kind;
+    if (is_jalr && is_link(rs1) && rs1 != rd) {
+        kind = KIND_RETURN;
+        uint32_t predicted = 0;
+        if (bpred->ras_used) {
+            bpred->ras_top = (bpred->ras_top + bpred->config.ras_depth - 1) % bpred->config.ras_depth;
+            bpred->ras_used--;
+            predicted = bpred->ras[bpred->ras_top];
+        }
+        mispredicted = predicted != target;
+    } else {
+        kind = is_jalr ? KIND_JALR : KIND_JAL;
+        uint32_t index = (pc >> 2) & ((1u << bpred->config.btb_bits) - 1);
+        mispredicted = bpred->btb_pc[index] != pc || bpred->btb_target[index] != target;
+        bpred->btb_pc[index] = pc;
+        bpred->btb_target[index] = target;
+    }
+    if (is_link(rd)) {
+        bpred->ras[bpred->ras_top] = pc + 4;
+        bpred->ras_top = (bpred->ras_top + 1) % bpred->config.ras_depth;
+        if (bpred->ras_used < bpred->config.ras_depth) {
+            bpred->ras_used++;
+        }
+    }
+    count(bpred, kind, pc, 1, mispredicted);
+    return mispredicted;
+}
+
+struct branch_line {
+    uint32_t pc;
+    const struct branch_counts* counts;
+};
+
+static int compare_branches(const void* a, const void* b) {
+    const struct branch_line* x = a;
+    const struct branch_line* y = b;
+    if (x->counts->mispredicted != y->counts->mispredicted) {
+        return x->counts->mispredicted > y->counts->mispredicted ? -1 : 1;
+    }
+    return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+#define REPORT_BRANCHES 20
+
+void bpred_report(struct bpred* bpred, FILE* out, struct symbols* symbols, long insns) {
+    static const char* names[] = { "conditional branches", "jal", "returns", "other jalr" };
+    const struct bpred_config* config = &bpred->config;
+    fprintf(out, "Branch prediction: %s", kind_names[config->kind]);
+    if (config->kind != BPRED_STATIC) {
+        fprintf(out, ", %u counters", 1u << config->table_bits);
+    }
+    if (config->kind == BPRED_TAGE) {
+        fprintf(out, " and %d tagged tables of %u entries with", TAGE_TABLES, 1u << TAGE_BITS);
+        for (int i = 0; i < TAGE_TABLES; i++) {
+            fprintf(out, "%s%u", i ? "/" : " ", bpred->lengths[i]);
+        }
+        fprintf(out, " bits of history");
+    } else if (config->kind == BPRED_GSHARE) {
+        fprintf(out, ", %u bits of history", config->history_bits);
+    }
+    fprintf(out, "; %u entry BTB, %u entry return address stack\n", 1u << config->btb_bits, config->ras_depth);
+    fprintf(out, "  %-22s %13s %13s %7s\n", "", "executed", "mispredicted", "%");
+    long executed = 0;
+    long mispredicted = 0;
+    for (int kind = 0; kind < NUM_KINDS; kind++) {
+        fprintf(out, "  %-22s %13ld %13ld %7.2f\n", names[kind], bpred->executed[kind], bpred->mispredicted[kind],
+                bpred->executed[kind] ? 100.0 * bpred->mispredicted[kind] / bpred->executed[kind] : 0.0);
+        executed += bpred->executed[kind];
+        mispredicted += bpred->mispredicted[kind];
+    }
+    fprintf(out, "  %-22s %13ld %13ld %7.2f  (%.2f per 1000 instructions)\n", "all", executed, mispredicted,
+            executed ? 100.0 * mispredicted / executed : 0.0, insns ? 1000.0 * mispredicted / insns : 0.0);
+
+    struct branch_line* lines = malloc((bpred->text_count + 1) * sizeof(struct branch_line));
+    if (lines == NULL) {
+        return;
+    }
+    int num_lines = 0;
+    for (uint32_t slot = 0; slot < bpred->text_count; slot++) {
+        if (bpred->slots[slot].mispredicted) {
+            lines[num_lines].pc = bpred->text_start + 4 * slot;
+            lines[num_lines++].counts = &bpred->slots[slot];
+        }
+    }
+    qsort(lines, num_lines, sizeof(struct branch_line), compare_branches);
+    if (num_lines) {
+        fprintf(out, "Most mispredicted branches and jumps:\n  %13s %7s %13s %7s  %-8s  %s\n", "mispredicted", "%",
+                "executed", "taken%", "pc", "function");
+    }
+    for (int i = 0; i < num_lines && i < REPORT_BRANCHES; i++) {
+        const struct branch_counts* counts = lines[i].counts;
+        fprintf(out, "  %13ld %7.2f %13ld %7.2f  %08x", counts->mispredicted, 100.0 * counts->mispredicted / counts->executed,
+                counts->executed, 100.0 * counts->taken / counts->executed, lines[i].pc);
+        unsigned int offset;
+        const char* name = symbols ? symbols_enclosing(symbols, lines[i].pc, &offset) : NULL;
+        if (name) {
+            fprintf(out, "  %s+0x%x", name, offset);
+        }
+        fprintf(out, "\n");
+    }
+    if (bpred->outside.mispredicted) {
+        fprintf(out, "  %13ld mispredicted outside the text segment\n", bpred->outside.mispredicted);
+    }
+    free(lines);
+}
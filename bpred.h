@@ -0,0 +1,53 @@
+#ifndef __BPRED_H__
+#define __BPRED_H__
+
+#include "read_elf.h"
+#include <stdio.h>
+#include <stdint.h>
+
+enum bpred_kind {
+    BPRED_STATIC,       // backward taken, forward not taken
+    BPRED_BIMODAL,      // 2 bit counters indexed by pc
+    BPRED_GSHARE,       // 2 bit counters indexed by pc xor global history
+    BPRED_TAGE          // bimodal base and 4 tagged tables of geometric history lengths
+};
+
+struct bpred_config {
+    enum bpred_kind kind;
+    unsigned table_bits;    // log2 of the counters (tage: of the base table)
+    unsigned history_bits;  // global history used (tage: by the longest table, at most 64)
+    unsigned btb_bits;      // log2 of the branch target buffer entries
+    unsigned ras_depth;     // return address stack entries
+};
+
+// parse "static|bimodal|gshare|tage[:table_bits[:history_bits]]", with a
+// 512 entry BTB and a 16 entry return address stack (return -1 if invalid)
+int bpred_parse_config(const char* text, struct bpred_config* config);
+
+// Direction predictor for conditional branches together with a BTB and a
+// return address stack for jal and jalr. Branch targets are known from
+// decode, so a conditional branch is mispredicted only if its direction
+// is. Jumps are mispredicted when the BTB (or for returns the return
+// address stack) does not give the right target.
+struct bpred;
+
+// predictor with statistics per instruction of [text_start,text_end)
+// (return NULL if out of host memory)
+struct bpred* bpred_create(const struct bpred_config* config, uint32_t text_start, uint32_t text_end);
+
+void bpred_delete(struct bpred* bpred);
+
+// predict and then train on the conditional branch at pc (return 1 if it
+// was mispredicted)
+int bpred_branch(struct bpred* bpred, uint32_t pc, uint32_t target, int taken);
+
+// predict and then train on the jal or jalr at pc, which wrote rd and for
+// jalr jumped through rs1 (return 1 if it was mispredicted)
+int bpred_jump(struct bpred* bpred, uint32_t pc, uint32_t target, int rd, int rs1, int is_jalr);
+
+// write misprediction rates overall and per kind of jump, mispredictions
+// per thousand of insns instructions and the branches mispredicted most,
+// with their function if symbols is not NULL
+void bpred_report(struct bpred* bpred, FILE* out, struct symbols* symbols, long insns);
+
+#endif
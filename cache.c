@@ -0,0 +1,419 @@
+#include "cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define LINE_VALID 1
+#define LINE_DIRTY 2
+
+enum { LEVEL_L1I, LEVEL_L1D, LEVEL_L2, NUM_LEVELS };
+
+struct cache {
+    const char* name;
+    int level;
+    struct cache_config config;
+    unsigned sets;
+    unsigned line_bits;
+    uint32_t* tags;         // line address of each way, set by set
+    uint8_t* state;
+    uint64_t* stamps;       // LRU: time of last use
+    uint64_t* plru;         // PLRU: tree bits of each set, node i at bit i
+    uint64_t clock;
+    uint32_t random;
+    struct cache* next;     // NULL is memory
+    long accesses;
+    long misses;
+    long writebacks;
+};
+
+// counts for one instruction of the text segment
+struct slot_counts {
+    long accesses[NUM_LEVELS];
+    long misses[NUM_LEVELS];
+};
+
+struct caches {
+    struct cache* levels[NUM_LEVELS];
+    uint32_t text_start;
+    uint32_t text_count;
+    struct slot_counts* slots;
+    struct slot_counts* current;    // slot of the running instruction, NULL outside text
+    struct slot_counts outside;
+    long memory_reads;      // lines read from memory
+    long memory_writes;     // lines or (write through) stores written to memory
+};
+
+static int is_power_of_two(unsigned x) {
+    return x && !(x & (x - 1));
+}
+
+static int parse_number(const char** text, unsigned* value) {
+    char* end;
+    unsigned long number = strtoul(*text, &end, 0);
+    if (end == *text) {
+        return -1;
+    }
+    if (*end == 'k' || *end == 'K') {
+        number <<= 10;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        number <<= 20;
+        end++;
+    }
+    if (number == 0 || number > 0x80000000UL) {
+        return -1;
+    }
+    *value = number;
+    *text = end;
+    return 0;
+}
+
+int cache_parse_config(const char* text, struct cache_config* config) {
+    config->replacement = CACHE_LRU;
+    config->write = CACHE_WRITE_BACK;
+    if (parse_number(&text, &config->size) || *text++ != ':'
+        || parse_number(&text, &config->ways) || *text++ != ':'
+        || parse_number(&text, &config->line_size)) {
+        return -1;
+    }
+    if (*text == ':') {
+        text++;
+        size_t length = strcspn(text, ":");
+        if (length == 3 && !strncmp(text, "lru", 3)) {
+            config->replacement = CACHE_LRU;
+        } else if (length == 4 && !strncmp(text, "plru", 4)) {
+            config->replacement = CACHE_PLRU;
+        } else if (length == 6 && !strncmp(text, "random", 6)) {
+            config->replacement = CACHE_RANDOM;
+        } else {
+            return -1;
+        }
+        text += length;
+        if (*text == ':') {
+            text++;
+            if (!strcmp(text, "wb")) {
+                config->write = CACHE_WRITE_BACK;
+            } else if (!strcmp(text, "wt")) {
+                config->write = CACHE_WRITE_THROUGH;
+            } else {
+                return -1;
+            }
+            text += 2;
+        }
+    }
+    if (*text != 0 || !is_power_of_two(config->size) || !is_power_of_two(config->ways)
+        || !is_power_of_two(config->line_size) || config->line_size < 4 || config->ways > 64
+        || config->size < config->ways * config->line_size) {
+        return -1;
+    }
+    return 0;
+}
+
+static void cache_delete(struct cache* cache) {
+    if (cache) {
+        free(cache->tags);
+        free(cache->state);
+        free(cache->stamps);
+        free(cache->plru);
+        free(cache);
+    }
+}
+
+static struct cache* cache_create(const char* name, int level, const struct cache_config* config) {
+    struct cache* cache = calloc(1, sizeof(struct cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->name = name;
+    cache->level = level;
+    cache->config = *config;
+    cache->sets = config->size / (config->ways * config->line_size);
+    while ((1u << cache->line_bits) < config->line_size) {
+        cache->line_bits++;
+    }
+    unsigned lines = cache->sets * config->ways;
+    cache->tags = calloc(lines, sizeof(uint32_t));
+    cache->state = calloc(lines, sizeof(uint8_t));
+    cache->stamps = calloc(lines, sizeof(uint64_t));
+    cache->plru = calloc(cache->sets, sizeof(uint64_t));
+    cache->random = 0x2545F491;     // fixed seed, so runs repeat exactly
+    if (cache->tags == NULL || cache->state == NULL || cache->stamps == NULL || cache->plru == NULL) {
+        cache_delete(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+struct caches* caches_create(const struct cache_config* l1i, const struct cache_config* l1d,
+                             const struct cache_config* l2, uint32_t text_start, uint32_t text_end) {
+    struct caches* caches = calloc(1, sizeof(struct caches));
+    if (caches == NULL) {
+        return NULL;
+    }
+    caches->text_start = text_start;
+    caches->text_count = text_end > text_start ? (text_end - text_start) / 4 : 0;
+    caches->slots = calloc(caches->text_count + 1, sizeof(struct slot_counts));
+    int failed = caches->slots == NULL;
+    if (l1i && !failed) {
+        failed = (caches->levels[LEVEL_L1I] = cache_create("L1I", LEVEL_L1I, l1i)) == NULL;
+    }
+    if (l1d && !failed) {
+        failed = (caches->levels[LEVEL_L1D] = cache_create("L1D", LEVEL_L1D, l1d)) == NULL;
+    }
+    if (l2 && !failed) {
+        failed = (caches->levels[LEVEL_L2] = cache_create("L2", LEVEL_L2, l2)) == NULL;
+    }
+    if (failed) {
+        caches_delete(caches);
+        return NULL;
+    }
+    if (caches->levels[LEVEL_L1I]) {
+        caches->levels[LEVEL_L1I]->next = caches->levels[LEVEL_L2];
+    }
+    if (caches->levels[LEVEL_L1D]) {
+        caches->levels[LEVEL_L1D]->next = caches->levels[LEVEL_L2];
+    }
+    caches->current = &caches->outside;
+    return caches;
+}
+
+void caches_delete(struct caches* caches) {
+    for (int level = 0; level < NUM_LEVELS; level++) {
+        cache_delete(caches->levels[level]);
+    }
+    free(caches->slots);
+    free(caches);
+}
+
+static void touch(struct cache* cache, unsigned set, unsigned way) {
+    if (cache->config.replacement == CACHE_LRU) {
+        cache->stamps[set * cache->config.ways + way] = ++cache->clock;
+    } else if (cache->config.replacement == CACHE_PLRU) {
+        // point every node on the path away from way
+        uint64_t bits = cache->plru[set];
+        unsigned node = 1;
+        for (unsigned half = cache->config.ways / 2; half; half /= 2) {
+            unsigned right = (way & half) != 0;
+            bits = right ? bits & ~(1ull << node) : bits | (1ull << node);
+            node = 2 * node + right;
+        }
+        cache->plru[set] = bits;
+    }
+}
+
+static unsigned victim(struct cache* cache, unsigned set) {
+    unsigned ways = cache->config.ways;
+    const uint8_t* state = &cache->state[set * ways];
+    for (unsigned way = 0; way < ways; way++) {
+        if (!(state[way] & LINE_VALID)) {
+            return way;
+        }
+    }
+    switch (cache->config.replacement) {
+        case CACHE_LRU: {
+            const uint64_t* stamps = &cache->stamps[set * ways];
+            unsigned oldest = 0;
+            for (unsigned way = 1; way < ways; way++) {
+                if (stamps[way] < stamps[oldest]) {
+                    oldest = way;
+                }
+            }
+            return oldest;
+        }
+        case CACHE_PLRU: {
+            unsigned node = 1;
+            unsigned way = 0;
+            for (unsigned half = ways / 2; half; half /= 2) {
+                unsigned right = (cache->plru[set] >> node) & 1;
+                way |= right ? half : 0;
+                node = 2 * node + right;
+            }
+            return way;
+        }
+        default: {
+            uint32_t x = cache->random;     // xorshift32
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            cache->random = x;
+            return x & (ways - 1);
+        }
+    }
+}
+
+// Access the line holding addr in cache, or in memory if cache is NULL,
+// and return which enum cache_served level had it
+static int access_line(struct caches* caches, struct cache* cache, uint32_t addr, int is_write) {
+    if (cache == NULL) {
+        if (is_write) {
+            caches->memory_writes++;
+        } else {
+            caches->memory_reads++;
+        }
+        return CACHE_SERVED_MEMORY;
+    }
+    uint32_t line_addr = addr & ~(cache->config.line_size - 1);
+    cache->accesses++;
+    caches->current->accesses[cache->level]++;
+    unsigned ways = cache->config.ways;
+    unsigned set = (line_addr >> cache->line_bits) & (cache->sets - 1);
+    uint32_t* tags = &cache->tags[set * ways];
+    uint8_t* state = &cache->state[set * ways];
+    int write_back = cache->config.write == CACHE_WRITE_BACK;
+    for (unsigned way = 0; way < ways; way++) {
+        if ((state[way] & LINE_VALID) && tags[way] == line_addr) {
+            touch(cache, set, way);
+            if (is_write) {
+                if (write_back) {
+                    state[way] |= LINE_DIRTY;
+                } else {
+                    access_line(caches, cache->next, line_addr, 1);
+                }
+            }
+            return cache->level == LEVEL_L2 ? CACHE_SERVED_L2 : CACHE_SERVED_L1;
+        }
+    }
+    cache->misses++;
+    caches->current->misses[cache->level]++;
+    if (is_write && !write_back) {
+        return access_line(caches, cache->next, line_addr, 1);
+    }
+    unsigned way = victim(cache, set);
+    if ((state[way] & (LINE_VALID | LINE_DIRTY)) == (LINE_VALID | LINE_DIRTY)) {
+        cache->writebacks++;
+        access_line(caches, cache->next, tags[way], 1);
+    }
+    int served = access_line(caches, cache->next, line_addr, 0);
+    tags[way] = line_addr;
+    state[way] = LINE_VALID | (is_write ? LINE_DIRTY : 0);
+    touch(cache, set, way);
+    return served;
+}
+
+// Access every line that [addr, addr + size) touches, starting with level,
+// and return the furthest level any of them came from
+static int access_range(struct caches* caches, int level, uint32_t addr, int size, int is_write) {
+    struct cache* cache = caches->levels[level] ? caches->levels[level] : caches->levels[LEVEL_L2];
+    unsigned line_size = cache ? cache->config.line_size : 4;
+    uint32_t first = addr & ~(line_size - 1);
+    uint32_t last = (addr + size - 1) & ~(line_size - 1);
+    int served = CACHE_SERVED_L1;
+    for (uint32_t line = first; ; line += line_size) {
+        int line_served = access_line(caches, cache, line, is_write);
+        served = line_served > served ? line_served : served;
+        if (line == last) {
+            return served;
+        }
+    }
+}
+
+int caches_fetch(struct caches* caches, uint32_t pc) {
+    uint32_t slot = (pc - caches->text_start) >> 2;
+    caches->current = slot < caches->text_count ? &caches->slots[slot] : &caches->outside;
+    return access_range(caches, LEVEL_L1I, pc, 4, 0);
+}
+
+int caches_data(struct caches* caches, uint32_t addr, int size, int is_write) {
+    return access_range(caches, LEVEL_L1D, addr, size, is_write);
+}
+
+struct function_counts {
+    const char* name;
+    struct slot_counts counts;
+    long total_misses;
+};
+
+static int compare_functions(const void* a, const void* b) {
+    const struct function_counts* x = a;
+    const struct function_counts* y = b;
+    if (x->total_misses != y->total_misses) {
+        return x->total_misses > y->total_misses ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+static void add_counts(struct function_counts* function, const struct slot_counts* counts) {
+    for (int level = 0; level < NUM_LEVELS; level++) {
+        function->counts.accesses[level] += counts->accesses[level];
+        function->counts.misses[level] += counts->misses[level];
+        function->total_misses += counts->misses[level];
+    }
+}
+
+#define REPORT_FUNCTIONS 20
+
+// bytes, or K or M when they divide evenly, as in the miss ratio curves
+static const char* format_size(char* buf, size_t size, uint32_t bytes) {
+    if (bytes >= (1u << 20) && bytes % (1u << 20) == 0) {
+        snprintf(buf, size, "%uM", bytes >> 20);
+    } else if (bytes >= 1024 && bytes % 1024 == 0) {
+        snprintf(buf, size, "%uK", bytes >> 10);
+    } else {
+        snprintf(buf, size, "%u", bytes);
+    }
+    return buf;
+}
+
+void caches_report(struct caches* caches, FILE* out, struct symbols* symbols) {
+    static const char* policies[] = { "lru", "plru", "random" };
+    fprintf(out, "Caches:\n  %-4s %8s %5s %5s  %-9s %12s %13s %7s %13s\n", "", "size", "ways", "line", "policy",
+            "accesses", "misses", "miss%", "writebacks");
+    for (int level = 0; level < NUM_LEVELS; level++) {
+        const struct cache* cache = caches->levels[level];
+        if (cache == NULL) {
+            continue;
+        }
+        char size[16];
+        fprintf(out, "  %-4s %8s %5u %5u  %-6s %-2s %12ld %13ld %7.2f %13ld\n", cache->name,
+                format_size(size, sizeof(size), cache->config.size),
+                cache->config.ways, cache->config.line_size, policies[cache->config.replacement],
+                cache->config.write == CACHE_WRITE_BACK ? "wb" : "wt", cache->accesses, cache->misses,
+                cache->accesses ? 100.0 * cache->misses / cache->accesses : 0.0, cache->writebacks);
+    }
+    fprintf(out, "  Memory: %ld reads, %ld writes\n", caches->memory_reads, caches->memory_writes);
+    if (symbols == NULL) {
+        return;
+    }
+
+    // consecutive instructions of the same function share one entry
+    struct function_counts* functions = calloc(caches->text_count + 1, sizeof(struct function_counts));
+    if (functions == NULL) {
+        return;
+    }
+    int num_functions = 0;
+    const char* previous = NULL;
+    for (uint32_t slot = 0; slot < caches->text_count; slot++) {
+        unsigned int offset;
+        const char* name = symbols_enclosing(symbols, caches->text_start + 4 * slot, &offset);
+        name = name ? name : "<unknown>";
+        if (num_functions == 0 || name != previous || offset == 0) {
+            functions[num_functions++].name = name;
+        }
+        add_counts(&functions[num_functions - 1], &caches->slots[slot]);
+        previous = name;
+    }
+    functions[num_functions].name = "<outside text>";
+    add_counts(&functions[num_functions++], &caches->outside);
+    qsort(functions, num_functions, sizeof(struct function_counts), compare_functions);
+
+    fprintf(out, "Cache misses per function (miss%% of that function's accesses):\n");
+    fprintf(out, " ");
+    for (int level = 0; level < NUM_LEVELS; level++) {
+        if (caches->levels[level]) {
+            fprintf(out, " %5s misses %7s", caches->levels[level]->name, "%");
+        }
+    }
+    fprintf(out, "  function\n");
+    for (int i = 0; i < num_functions && i < REPORT_FUNCTIONS && functions[i].total_misses; i++) {
+        fprintf(out, " ");
+        for (int level = 0; level < NUM_LEVELS; level++) {
+            if (caches->levels[level] == NULL) {
+                continue;
+            }
+            long accesses = functions[i].counts.accesses[level];
+            long misses = functions[i].counts.misses[level];
+            fprintf(out, " %12ld %7.2f", misses, accesses ? 100.0 * misses / accesses : 0.0);
+        }
+        fprintf(out, "  %s\n", functions[i].name);
+    }
+    free(functions);
+}
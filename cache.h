@@ -0,0 +1,54 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "read_elf.h"
+#include <stdio.h>
+#include <stdint.h>
+
+enum cache_replacement { CACHE_LRU, CACHE_PLRU, CACHE_RANDOM };
+
+enum cache_write {
+    CACHE_WRITE_BACK,       // write allocate, dirty lines written on eviction
+    CACHE_WRITE_THROUGH     // no write allocate, every store goes to the next level
+};
+
+struct cache_config {
+    unsigned size;          // bytes
+    unsigned ways;
+    unsigned line_size;     // bytes
+    enum cache_replacement replacement;
+    enum cache_write write;
+};
+
+// parse "size:ways:line[:lru|plru|random[:wb|wt]]", sizes may end in k or m.
+// Sizes must be powers of two and ways at most 64 (return -1 if invalid).
+int cache_parse_config(const char* text, struct cache_config* config);
+
+// L1 instruction and data caches backed by a shared L2, fed with the
+// fetches and data accesses of a guest. Any level may be left out by
+// passing NULL; accesses then go to the next level or to memory.
+struct caches;
+
+// misses are also counted per instruction of [text_start,text_end)
+// (return NULL if out of host memory)
+struct caches* caches_create(const struct cache_config* l1i, const struct cache_config* l1d,
+                             const struct cache_config* l2, uint32_t text_start, uint32_t text_end);
+
+void caches_delete(struct caches* caches);
+
+// Where an access found its data, for timing models. A level that was
+// left out counts as the next one, so with no L1 a hit in L2 is L2.
+enum cache_served { CACHE_SERVED_L1, CACHE_SERVED_L2, CACHE_SERVED_MEMORY };
+
+// fetch of the instruction at pc, which the following data accesses belong
+// to (return enum cache_served)
+int caches_fetch(struct caches* caches, uint32_t pc);
+
+// load or store of size bytes at addr (return enum cache_served)
+int caches_data(struct caches* caches, uint32_t addr, int size, int is_write);
+
+// write hit and miss rates per level, and misses per function if symbols
+// is not NULL
+void caches_report(struct caches* caches, FILE* out, struct symbols* symbols);
+
+#endif
@@ -0,0 +1,438 @@
+#include "callgraph.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_RETURN 1     // return address of the first frame; jumps never go to odd addresses
+
+struct function {
+    const char* name;
+    long calls;         // calls to it over all edges
+    long inclusive;     // instructions in it and what it called, outermost activations only
+    long self;          // filled in by callgraph_report
+    int active;         // frames of it on the stack
+    int index;          // position in the call graph listing
+};
+
+struct edge {
+    int caller;
+    int callee;
+    long calls;
+    long inclusive;     // instructions spent in the callee when called this way
+};
+
+struct frame {
+    uint32_t return_addr;
+    int function;
+    int edge;           // -1 for the first frame of a run
+    long entry;         // instruction count at the call
+};
+
+// Node of the calling context tree built from samples: one per distinct
+// call path, identified by the path to its parent and its own function
+struct context {
+    int parent;         // -1 for the outermost function
+    int function;
+    long samples;       // samples with exactly this path
+};
+
+// Hash map from a pair of ints to an index, open addressing
+struct pair_slot {
+    int a;
+    int b;
+    int value;          // -1 marks a free slot
+};
+
+struct pair_map {
+    struct pair_slot* slots;
+    unsigned size;      // power of two
+    unsigned used;
+};
+
+struct callgraph {
+    uint32_t start;
+    uint32_t count;
+    int* function_of;   // function of every instruction slot
+    struct function* functions;
+    int num_functions;
+    struct edge* edges;
+    int num_edges;
+    int max_edges;
+    struct pair_map edge_map;   // (caller, callee) -> edge
+    struct context* contexts;   // call paths seen when sampling
+    int num_contexts;
+    int max_contexts;
+    struct pair_map context_map;    // (parent context, function) -> context
+    struct frame* stack;
+    int depth;
+    int max_depth;
+};
+
+// Function 0 stands for everything outside the text segment or before
+// the first function symbol
+struct callgraph* callgraph_create(uint32_t start, uint32_t end, struct symbols* symbols) {
+    struct callgraph* graph = calloc(1, sizeof(struct callgraph));
+    if (graph == NULL) {
+        return NULL;
+    }
+    graph->start = start;
+    graph->count = end > start ? (end - start) / 4 : 0;
+    graph->function_of = malloc((graph->count + 1) * sizeof(int));
+    graph->functions = malloc((graph->count + 1) * sizeof(struct function));
+    if (graph->function_of == NULL || graph->functions == NULL) {
+        callgraph_delete(graph);
+        return NULL;
+    }
+    memset(&graph->functions[0], 0, sizeof(struct function));
+    graph->functions[0].name = "<unknown>";
+    graph->num_functions = 1;
+    const char* previous = NULL;
+    for (uint32_t i = 0; i < graph->count; i++) {
+        unsigned int offset;
+        const char* name = symbols ? symbols_enclosing(symbols, start + 4 * i, &offset) : NULL;
+        if (name && (name != previous || offset == 0)) {
+            struct function* function = &graph->functions[graph->num_functions++];
+            memset(function, 0, sizeof(struct function));
+            function->name = name;
+        }
+        graph->function_of[i] = name ? graph->num_functions - 1 : 0;
+        previous = name;
+    }
+    return graph;
+}
+
+void callgraph_delete(struct callgraph* graph) {
+    free(graph->function_of);
+    free(graph->functions);
+    free(graph->edges);
+    free(graph->edge_map.slots);
+    free(graph->contexts);
+    free(graph->context_map.slots);
+    free(graph->stack);
+    free(graph);
+}
+
+static int function_at(struct callgraph* graph, uint32_t addr) {
+    uint32_t i = (addr - graph->start) >> 2;
+    return i < graph->count ? graph->function_of[i] : 0;
+}
+
+static struct pair_slot* pair_slot(struct pair_slot* slots, unsigned size, int a, int b) {
+    unsigned at = ((unsigned)a * 40503u + (unsigned)b) & (size - 1);
+    while (slots[at].value >= 0 && (slots[at].a != a || slots[at].b != b)) {
+        at = (at + 1) & (size - 1);
+    }
+    return &slots[at];
+}
+
+// value stored for (a, b), -1 if there is none
+static int pair_find(struct pair_map* map, int a, int b) {
+    return map->size ? pair_slot(map->slots, map->size, a, b)->value : -1;
+}
+
+// store value for a new pair (return -1 if out of host memory)
+static int pair_add(struct pair_map* map, int a, int b, int value) {
+    if (2 * (map->used + 1) > map->size) {
+        // keep the table at most half full
+        unsigned size = map->size ? 2 * map->size : 64;
+        struct pair_slot* slots = malloc(size * sizeof(struct pair_slot));
+        if (slots == NULL) {
+            return -1;
+        }
+        for (unsigned i = 0; i < size; i++) {
+            slots[i].value = -1;
+        }
+        for (unsigned i = 0; i < map->size; i++) {
+            if (map->slots[i].value >= 0) {
+                *pair_slot(slots, size, map->slots[i].a, map->slots[i].b) = map->slots[i];
+            }
+        }
+        free(map->slots);
+        map->slots = slots;
+        map->size = size;
+    }
+    struct pair_slot* slot = pair_slot(map->slots, map->size, a, b);
+    slot->a = a;
+    slot->b = b;
+    slot->value = value;
+    map->used++;
+    return 0;
+}
+
+// Index of the edge caller -> callee, added if new (-1 if out of host memory)
+static int find_edge(struct callgraph* graph, int caller, int callee) {
+    int found = pair_find(&graph->edge_map, caller, callee);
+    if (found >= 0) {
+        return found;
+    }
+    if (graph->num_edges == graph->max_edges) {
+        int max_edges = graph->max_edges ? 2 * graph->max_edges : 64;
+        struct edge* edges = realloc(graph->edges, max_edges * sizeof(struct edge));
+        if (edges == NULL) {
+            return -1;
+        }
+        graph->edges = edges;
+        graph->max_edges = max_edges;
+    }
+    if (pair_add(&graph->edge_map, caller, callee, graph->num_edges)) {
+        return -1;
+    }
+    struct edge* edge = &graph->edges[graph->num_edges];
+    edge->caller = caller;
+    edge->callee = callee;
+    edge->calls = 0;
+    edge->inclusive = 0;
+    return graph->num_edges++;
+}
+
+static void push(struct callgraph* graph, uint32_t return_addr, int function, int edge, long insns) {
+    if (graph->depth == graph->max_depth) {
+        int max_depth = graph->max_depth ? 2 * graph->max_depth : 256;
+        struct frame* stack = realloc(graph->stack, max_depth * sizeof(struct frame));
+        if (stack == NULL) {
+            return;     // the matching return finds no frame and is ignored
+        }
+        graph->stack = stack;
+        graph->max_depth = max_depth;
+    }
+    struct frame* frame = &graph->stack[graph->depth++];
+    frame->return_addr = return_addr;
+    frame->function = function;
+    frame->edge = edge;
+    frame->entry = insns;
+    graph->functions[function].active++;
+}
+
+// Recursive activations are already counted by the outermost one
+static void pop(struct callgraph* graph, long insns) {
+    struct frame* frame = &graph->stack[--graph->depth];
+    struct function* function = &graph->functions[frame->function];
+    if (--function->active == 0) {
+        function->inclusive += insns - frame->entry;
+        if (frame->edge >= 0) {
+            graph->edges[frame->edge].inclusive += insns - frame->entry;
+        }
+    }
+}
+
+void callgraph_start(struct callgraph* graph, uint32_t pc, long insns) {
+    push(graph, NO_RETURN, function_at(graph, pc), -1, insns);
+}
+
+void callgraph_call(struct callgraph* graph, uint32_t pc, uint32_t target, long insns) {
+    int callee = function_at(graph, target);
+    int edge = find_edge(graph, function_at(graph, pc), callee);
+    if (edge >= 0) {
+        graph->edges[edge].calls++;
+    }
+    graph->functions[callee].calls++;
+    push(graph, pc + 4, callee, edge, insns);
+}
+
+void callgraph_return(struct callgraph* graph, uint32_t target, long insns) {
+    // frames above the one returned to were left some other way
+    for (int i = graph->depth - 1; i >= 0; i--) {
+        if (graph->stack[i].return_addr == target) {
+            while (graph->depth > i) {
+                pop(graph, insns);
+            }
+            return;
+        }
+    }
+}
+
+void callgraph_stop(struct callgraph* graph, long insns) {
+    while (graph->depth > 0) {
+        pop(graph, insns);
+    }
+}
+
+// Context for function called from parent, added if new (-1 if out of host memory)
+static int find_context(struct callgraph* graph, int parent, int function) {
+    int found = pair_find(&graph->context_map, parent, function);
+    if (found >= 0) {
+        return found;
+    }
+    if (graph->num_contexts == graph->max_contexts) {
+        int max_contexts = graph->max_contexts ? 2 * graph->max_contexts : 256;
+        struct context* contexts = realloc(graph->contexts, max_contexts * sizeof(struct context));
+        if (contexts == NULL) {
+            return -1;
+        }
+        graph->contexts = contexts;
+        graph->max_contexts = max_contexts;
+    }
+    if (pair_add(&graph->context_map, parent, function, graph->num_contexts)) {
+        return -1;
+    }
+    struct context* context = &graph->contexts[graph->num_contexts];
+    context->parent = parent;
+    context->function = function;
+    context->samples = 0;
+    return graph->num_contexts++;
+}
+
+void callgraph_sample(struct callgraph* graph, uint32_t pc) {
+    int context = -1;
+    int function = -1;
+    for (int i = 0; i < graph->depth && (context >= 0 || i == 0); i++) {
+        function = graph->stack[i].function;
+        context = find_context(graph, context, function);
+    }
+    // the function at pc was jumped to rather than called
+    int leaf = function_at(graph, pc);
+    if (leaf != function && (context >= 0 || graph->depth == 0)) {
+        context = find_context(graph, context, leaf);
+    }
+    if (context >= 0) {
+        graph->contexts[context].samples++;
+    }
+}
+
+void callgraph_write_folded(struct callgraph* graph, FILE* out) {
+    int* path = malloc((graph->num_contexts + 1) * sizeof(int));
+    if (path == NULL) {
+        fprintf(stderr, "Out of host memory for folded stacks\n");
+        return;
+    }
+    for (int c = 0; c < graph->num_contexts; c++) {
+        if (graph->contexts[c].samples == 0) {
+            continue;
+        }
+        int depth = 0;
+        for (int at = c; at >= 0; at = graph->contexts[at].parent) {
+            path[depth++] = graph->contexts[at].function;
+        }
+        while (depth-- > 0) {
+            fprintf(out, "%s%c", graph->functions[path[depth]].name, depth ? ';' : ' ');
+        }
+        fprintf(out, "%ld\n", graph->contexts[c].samples);
+    }
+    free(path);
+}
+
+static int compare_self(const void* a, const void* b) {
+    const struct function* x = *(const struct function* const*)a;
+    const struct function* y = *(const struct function* const*)b;
+    if (x->self != y->self) {
+        return x->self > y->self ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+static int compare_inclusive(const void* a, const void* b) {
+    const struct function* x = *(const struct function* const*)a;
+    const struct function* y = *(const struct function* const*)b;
+    if (x->inclusive != y->inclusive) {
+        return x->inclusive > y->inclusive ? -1 : 1;
+    }
+    return compare_self(a, b);
+}
+
+static int compare_edges(const void* a, const void* b) {
+    const struct edge* x = *(const struct edge* const*)a;
+    const struct edge* y = *(const struct edge* const*)b;
+    if (x->inclusive != y->inclusive) {
+        return x->inclusive > y->inclusive ? -1 : 1;
+    }
+    return x->calls > y->calls ? -1 : x->calls < y->calls;
+}
+
+// calls along one edge out of all calls to the callee, as gprof writes it
+static const char* ratio(char* buf, size_t size, long calls, long total) {
+    snprintf(buf, size, "%ld/%ld", calls, total);
+    return buf;
+}
+
+void callgraph_report(struct callgraph* graph, struct profile* profile, FILE* out) {
+    long total = profile->outside;
+    for (int f = 0; f < graph->num_functions; f++) {
+        graph->functions[f].self = 0;
+        graph->functions[f].index = 0;
+    }
+    graph->functions[0].self = profile->outside;
+    for (uint32_t i = 0; i < graph->count && i < profile->count; i++) {
+        graph->functions[graph->function_of[i]].self += profile->hits[i];
+        total += profile->hits[i];
+    }
+    const struct function** listed = malloc(graph->num_functions * sizeof(struct function*));
+    const struct edge** edges = malloc((graph->num_edges + 1) * sizeof(struct edge*));
+    if (listed == NULL || edges == NULL) {
+        fprintf(out, "Out of host memory for the call graph\n");
+        free(listed);
+        free(edges);
+        return;
+    }
+    int num_listed = 0;
+    for (int f = 0; f < graph->num_functions; f++) {
+        struct function* function = &graph->functions[f];
+        if (function->self || function->calls || function->inclusive) {
+            // a function only ever jumped to has no frames of its own
+            if (function->inclusive < function->self) {
+                function->inclusive = function->self;
+            }
+            listed[num_listed++] = function;
+        }
+    }
+    double percent = total ? 100.0 / total : 0.0;
+
+    qsort(listed, num_listed, sizeof(struct function*), compare_self);
+    fprintf(out, "\nFlat profile (instructions):\n\n");
+    fprintf(out, "%7s %12s %12s %10s %12s %12s  %s\n", "%self", "cumulative", "self", "calls", "self/call", "total/call", "name");
+    long cumulative = 0;
+    for (int n = 0; n < num_listed; n++) {
+        const struct function* function = listed[n];
+        cumulative += function->self;
+        fprintf(out, "%7.2f %12ld %12ld", percent * function->self, cumulative, function->self);
+        if (function->calls) {
+            fprintf(out, " %10ld %12.1f %12.1f", function->calls, (double)function->self / function->calls,
+                    (double)function->inclusive / function->calls);
+        } else {
+            fprintf(out, " %10s %12s %12s", "", "", "");
+        }
+        fprintf(out, "  %s\n", function->name);
+    }
+
+    qsort(listed, num_listed, sizeof(struct function*), compare_inclusive);
+    for (int n = 0; n < num_listed; n++) {
+        graph->functions[listed[n] - graph->functions].index = n + 1;
+    }
+    fprintf(out, "\nCall graph (instructions; callers above and callees below each function,\n"
+                 "with the total spent in the callee through that call):\n\n");
+    fprintf(out, "%-7s %6s %12s %12s %12s  %s\n", "index", "%total", "total", "self", "called", "name");
+    char calls[48];
+    for (int n = 0; n < num_listed; n++) {
+        const struct function* function = listed[n];
+        int f = function - graph->functions;
+        int num_callers = 0;
+        for (int e = 0; e < graph->num_edges; e++) {
+            if (graph->edges[e].callee == f) {
+                edges[num_callers++] = &graph->edges[e];
+            }
+        }
+        qsort(edges, num_callers, sizeof(struct edge*), compare_edges);
+        for (int e = 0; e < num_callers; e++) {
+            const struct function* caller = &graph->functions[edges[e]->caller];
+            fprintf(out, "%-7s %6s %12ld %12s %12s      %s [%d]\n", "", "", edges[e]->inclusive, "",
+                    ratio(calls, sizeof(calls), edges[e]->calls, function->calls), caller->name, caller->index);
+        }
+        char index[16];
+        snprintf(index, sizeof(index), "[%d]", n + 1);
+        fprintf(out, "%-7s %6.1f %12ld %12ld %12ld  %s %s\n", index, percent * function->inclusive, function->inclusive,
+                function->self, function->calls, function->name, index);
+        int num_callees = 0;
+        for (int e = 0; e < graph->num_edges; e++) {
+            if (graph->edges[e].caller == f) {
+                edges[num_callees++] = &graph->edges[e];
+            }
+        }
+        qsort(edges, num_callees, sizeof(struct edge*), compare_edges);
+        for (int e = 0; e < num_callees; e++) {
+            const struct function* callee = &graph->functions[edges[e]->callee];
+            fprintf(out, "%-7s %6s %12ld %12s %12s      %s [%d]\n", "", "", edges[e]->inclusive, "",
+                    ratio(calls, sizeof(calls), edges[e]->calls, callee->calls), callee->name, callee->index);
+        }
+        fprintf(out, "-----------------------------------------------\n");
+    }
+    free(listed);
+    free(edges);
+}
@@ -0,0 +1,42 @@
+#ifndef __CALLGRAPH_H__
+#define __CALLGRAPH_H__
+
+#include "profile.h"
+#include "read_elf.h"
+#include <stdio.h>
+#include <stdint.h>
+
+// Calls between functions of the text segment, tracked on a shadow call
+// stack: jal/jalr writing ra is a call, jalr zero,0(ra) a return
+struct callgraph;
+
+// call graph over the functions in [start,end) as found in the symbol
+// table (NULL if out of host memory)
+struct callgraph* callgraph_create(uint32_t start, uint32_t end, struct symbols* symbols);
+
+void callgraph_delete(struct callgraph* graph);
+
+// a run starts at pc with insns instructions already executed
+void callgraph_start(struct callgraph* graph, uint32_t pc, long insns);
+
+// the call at pc went to target; insns counts the call itself
+void callgraph_call(struct callgraph* graph, uint32_t pc, uint32_t target, long insns);
+
+// a return went to target; insns counts the return itself
+void callgraph_return(struct callgraph* graph, uint32_t target, long insns);
+
+// the run stopped after insns instructions: return from everything left
+void callgraph_stop(struct callgraph* graph, long insns);
+
+// record a sample of the call stack, with the instruction at pc running
+void callgraph_sample(struct callgraph* graph, uint32_t pc);
+
+// write the samples as folded stacks, "outer;...;inner count" per line,
+// the input format of flame graph tools
+void callgraph_write_folded(struct callgraph* graph, FILE* out);
+
+// write a gprof style flat profile and call graph. Self counts come from
+// the per instruction counts in profile.
+void callgraph_report(struct callgraph* graph, struct profile* profile, FILE* out);
+
+#endif
@@ -0,0 +1,449 @@
+#include "debug_line.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Every line program in .debug_line is run through the DWARF state machine
+// and the rows it emits are collected in one array, sorted by address.
+// A row with 'end' set marks the first address after a sequence, so
+// addresses between sequences map to nothing.
+
+struct line_row {
+    uint32_t addr;
+    uint32_t line;
+    uint32_t file;      // index into line_table.files
+    uint32_t order;     // position in the programs, keeps sorting stable
+    int end;
+};
+
+struct line_table {
+    struct line_row* rows;
+    int num_rows;
+    int max_rows;
+    const char** files;
+    int num_files;
+    int max_files;
+};
+
+// Reads from a section with bounds checking. After running past the end
+// every read returns 0 and 'bad' is set.
+struct cursor {
+    const unsigned char* p;
+    const unsigned char* end;
+    int bad;
+};
+
+static int have(struct cursor* c, size_t n) {
+    if (c->bad || (size_t)(c->end - c->p) < n) {
+        c->bad = 1;
+        return 0;
+    }
+    return 1;
+}
+
+static uint64_t read_fixed(struct cursor* c, int n) {
+    if (!have(c, n)) {
+        return 0;
+    }
+    uint64_t value = 0;
+    for (int i = 0; i < n; i++) {
+        value |= (uint64_t)c->p[i] << (8 * i);
+    }
+    c->p += n;
+    return value;
+}
+
+static uint64_t read_uleb(struct cursor* c) {
+    uint64_t value = 0;
+    int shift = 0;
+    while (have(c, 1)) {
+        unsigned char byte = *c->p++;
+        if (shift < 64) {
+            value |= (uint64_t)(byte & 0x7f) << shift;
+        }
+        shift += 7;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    return value;
+}
+
+static int64_t read_sleb(struct cursor* c) {
+    int64_t value = 0;
+    int shift = 0;
+    unsigned char byte = 0;
+    while (have(c, 1)) {
+        byte = *c->p++;
+        if (shift < 64) {
+            value |= (int64_t)(byte & 0x7f) << shift;
+        }
+        shift += 7;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    if (shift < 64 && (byte & 0x40)) {
+        value |= -((int64_t)1 << shift);
+    }
+    return value;
+}
+
+static const char* read_string(struct cursor* c) {
+    const unsigned char* nul = c->bad ? NULL : memchr(c->p, 0, c->end - c->p);
+    if (!nul) {
+        c->bad = 1;
+        return NULL;
+    }
+    const char* s = (const char*)c->p;
+    c->p = nul + 1;
+    return s;
+}
+
+// A string at offset in a string section, NULL if out of range
+static const char* section_string(const char* section, size_t size, uint64_t offset) {
+    if (!section || offset >= size || !memchr(section + offset, 0, size - offset)) {
+        return NULL;
+    }
+    return section + offset;
+}
+
+static int add_file(struct line_table* table, const char* name) {
+    if (table->num_files == table->max_files) {
+        int max_files = table->max_files ? 2 * table->max_files : 16;
+        const char** files = realloc(table->files, max_files * sizeof(const char*));
+        if (!files) {
+            return -1;
+        }
+        table->files = files;
+        table->max_files = max_files;
+    }
+    table->files[table->num_files++] = name ? name : "??";
+    return 0;
+}
+
+static int add_row(struct line_table* table, uint32_t addr, uint32_t line, uint32_t file, int end) {
+    if (table->num_rows == table->max_rows) {
+        int max_rows = table->max_rows ? 2 * table->max_rows : 256;
+        struct line_row* rows = realloc(table->rows, max_rows * sizeof(struct line_row));
+        if (!rows) {
+            return -1;
+        }
+        table->rows = rows;
+        table->max_rows = max_rows;
+    }
+    struct line_row* row = &table->rows[table->num_rows];
+    row->addr = addr;
+    row->line = line;
+    row->file = file;
+    row->order = table->num_rows++;
+    row->end = end;
+    return 0;
+}
+
+// DW_FORM values that can appear in DWARF 5 directory and file entries
+#define DW_FORM_block      0x09
+#define DW_FORM_block1     0x0a
+#define DW_FORM_data1      0x0b
+#define DW_FORM_data2      0x05
+#define DW_FORM_data4      0x06
+#define DW_FORM_data8      0x07
+#define DW_FORM_data16     0x1e
+#define DW_FORM_string     0x08
+#define DW_FORM_strp       0x0e
+#define DW_FORM_udata      0x0f
+#define DW_FORM_line_strp  0x1f
+
+#define DW_LNCT_path       0x1
+
+// Read one attribute of a DWARF 5 entry. Returns the string for string
+// forms (NULL otherwise); clears *ok for a form this reader doesn't know.
+static const char* read_form(struct cursor* c, uint64_t form, int offset_size,
+                             const struct debug_sections* sections, int* ok) {
+    switch (form) {
+        case DW_FORM_string:
+            return read_string(c);
+        case DW_FORM_line_strp:
+            return section_string(sections->line_str, sections->line_str_size, read_fixed(c, offset_size));
+        case DW_FORM_strp:
+            return section_string(sections->str, sections->str_size, read_fixed(c, offset_size));
+        case DW_FORM_udata:
+            read_uleb(c);
+            return NULL;
+        case DW_FORM_data1:
+            read_fixed(c, 1);
+            return NULL;
+        case DW_FORM_data2:
+            read_fixed(c, 2);
+            return NULL;
+        case DW_FORM_data4:
+            read_fixed(c, 4);
+            return NULL;
+        case DW_FORM_data8:
+            read_fixed(c, 8);
+            return NULL;
+        case DW_FORM_data16:
+            if (have(c, 16)) {
+                c->p += 16;
+            }
+            return NULL;
+        case DW_FORM_block:
+        case DW_FORM_block1: {
+            uint64_t len = form == DW_FORM_block ? read_uleb(c) : read_fixed(c, 1);
+            if (have(c, len)) {
+                c->p += len;
+            }
+            return NULL;
+        }
+        default:
+            *ok = 0;
+            return NULL;
+    }
+}
+
+// DWARF 5 directory or file name table; adds the paths to table->files
+// when files is set, otherwise just skips the entries
+static int read_entries(struct cursor* c, int offset_size, const struct debug_sections* sections,
+                        struct line_table* table, int files) {
+    uint64_t formats[2 * 16];
+    int num_formats = read_fixed(c, 1);
+    if (num_formats > 16) {
+        return -1;
+    }
+    for (int i = 0; i < 2 * num_formats; i++) {
+        formats[i] = read_uleb(c);
+    }
+    uint64_t count = read_uleb(c);
+    for (uint64_t n = 0; n < count && !c->bad; n++) {
+        const char* path = NULL;
+        int ok = 1;
+        for (int i = 0; i < num_formats; i++) {
+            const char* s = read_form(c, formats[2 * i + 1], offset_size, sections, &ok);
+            if (formats[2 * i] == DW_LNCT_path) {
+                path = s;
+            }
+        }
+        if (!ok || (files && add_file(table, path))) {
+            return -1;
+        }
+    }
+    return c->bad ? -1 : 0;
+}
+
+// Run one line program; c covers exactly this unit
+static int parse_unit(struct cursor* c, int offset_size, const struct debug_sections* sections,
+                      struct line_table* table) {
+    int version = read_fixed(c, 2);
+    if (version < 2 || version > 5) {
+        return -1;
+    }
+    if (version >= 5) {
+        read_fixed(c, 1);   // address_size
+        read_fixed(c, 1);   // segment_selector_size
+    }
+    uint64_t header_length = read_fixed(c, offset_size);
+    if (!have(c, header_length)) {
+        return -1;
+    }
+    struct cursor program = { c->p + header_length, c->end, 0 };
+    unsigned min_inst_length = read_fixed(c, 1);
+    if (version >= 4) {
+        read_fixed(c, 1);   // maximum_operations_per_instruction, 1 for RISC-V
+    }
+    read_fixed(c, 1);       // default_is_stmt, all rows are kept
+    int line_base = (signed char)read_fixed(c, 1);
+    int line_range = read_fixed(c, 1);
+    int opcode_base = read_fixed(c, 1);
+    if (line_range == 0 || opcode_base == 0) {
+        return -1;
+    }
+    unsigned char opcode_lengths[256];
+    for (int i = 1; i < opcode_base; i++) {
+        opcode_lengths[i] = read_fixed(c, 1);
+    }
+
+    // DWARF 5 file numbers start at 0, earlier versions at 1
+    uint32_t first_file = table->num_files;
+    if (version >= 5) {
+        if (read_entries(c, offset_size, sections, table, 0)
+            || read_entries(c, offset_size, sections, table, 1)) {
+            return -1;
+        }
+    } else {
+        while (have(c, 1) && *c->p) {
+            read_string(c);     // include directory
+        }
+        read_fixed(c, 1);
+        if (add_file(table, NULL)) {
+            return -1;
+        }
+        while (have(c, 1) && *c->p) {
+            if (add_file(table, read_string(c))) {
+                return -1;
+            }
+            read_uleb(c);   // directory
+            read_uleb(c);   // modification time
+            read_uleb(c);   // length
+        }
+    }
+    if (c->bad) {
+        return -1;
+    }
+
+    uint32_t addr = 0;
+    uint32_t file = 1;
+    int64_t line = 1;
+    c = &program;
+    while (c->p < c->end) {
+        int opcode = *c->p++;
+        int emit = 0;
+        if (opcode >= opcode_base) {
+            int adjusted = opcode - opcode_base;
+            addr += (adjusted / line_range) * min_inst_length;
+            line += line_base + adjusted % line_range;
+            emit = 1;
+        } else if (opcode == 0) {
+            uint64_t len = read_uleb(c);
+            if (len == 0 || !have(c, len)) {
+                return -1;
+            }
+            const unsigned char* next = c->p + len;
+            int sub = *c->p++;
+            switch (sub) {
+                case 1: // DW_LNE_end_sequence
+                    if (add_row(table, addr, 0, 0, 1)) {
+                        return -1;
+                    }
+                    addr = 0;
+                    file = 1;
+                    line = 1;
+                    break;
+                case 2: // DW_LNE_set_address
+                    addr = read_fixed(c, len - 1 > 8 ? 8 : len - 1);
+                    break;
+                case 3: // DW_LNE_define_file
+                    if (add_file(table, read_string(c))) {
+                        return -1;
+                    }
+                    break;
+                default: // DW_LNE_set_discriminator and vendor extensions
+                    break;
+            }
+            c->p = next;
+        } else {
+            switch (opcode) {
+                case 1: // DW_LNS_copy
+                    emit = 1;
+                    break;
+                case 2: // DW_LNS_advance_pc
+                    addr += read_uleb(c) * min_inst_length;
+                    break;
+                case 3: // DW_LNS_advance_line
+                    line += read_sleb(c);
+                    break;
+                case 4: // DW_LNS_set_file
+                    file = read_uleb(c);
+                    break;
+                case 8: // DW_LNS_const_add_pc
+                    addr += ((255 - opcode_base) / line_range) * min_inst_length;
+                    break;
+                case 9: // DW_LNS_fixed_advance_pc
+                    addr += read_fixed(c, 2);
+                    break;
+                default: // skip the operands of the rest
+                    for (int i = 0; i < opcode_lengths[opcode]; i++) {
+                        read_uleb(c);
+                    }
+                    break;
+            }
+        }
+        if (emit) {
+            uint32_t index = first_file + file;
+            if (index >= (uint32_t)table->num_files) {
+                index = first_file;
+            }
+            if (add_row(table, addr, line, index, 0)) {
+                return -1;
+            }
+        }
+    }
+    return c->bad ? -1 : 0;
+}
+
+// By address; at the same address an end of sequence comes first, since a
+// following sequence may start right there
+static int compare_rows(const void* a, const void* b) {
+    const struct line_row* x = a;
+    const struct line_row* y = b;
+    if (x->addr != y->addr) {
+        return x->addr < y->addr ? -1 : 1;
+    }
+    if (x->end != y->end) {
+        return y->end - x->end;
+    }
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+struct line_table* line_table_parse(const struct debug_sections* sections) {
+    if (!sections->line || sections->line_size == 0) {
+        return NULL;
+    }
+    struct line_table* table = calloc(1, sizeof(struct line_table));
+    if (!table) {
+        return NULL;
+    }
+    struct cursor section = { sections->line, sections->line + sections->line_size, 0 };
+    while (section.end - section.p >= 4) {
+        int offset_size = 4;
+        uint64_t length = read_fixed(&section, 4);
+        if (length == 0xffffffff) {
+            offset_size = 8;
+            length = read_fixed(&section, 8);
+        }
+        if (!have(&section, length)) {
+            break;
+        }
+        struct cursor unit = { section.p, section.p + length, 0 };
+        int num_rows = table->num_rows;
+        int num_files = table->num_files;
+        if (parse_unit(&unit, offset_size, sections, table)) {
+            // drop what the broken unit added, keep the others
+            table->num_rows = num_rows;
+            table->num_files = num_files;
+        }
+        section.p += length;
+    }
+    if (table->num_rows == 0) {
+        line_table_delete(table);
+        return NULL;
+    }
+    qsort(table->rows, table->num_rows, sizeof(struct line_row), compare_rows);
+    return table;
+}
+
+void line_table_delete(struct line_table* table) {
+    free(table->rows);
+    free(table->files);
+    free(table);
+}
+
+int line_table_lookup(struct line_table* table, unsigned int addr, const char** file, unsigned int* line) {
+    // last row at or below addr
+    int low = 0;
+    int high = table->num_rows;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (table->rows[mid].addr <= addr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0 || table->rows[low - 1].end) {
+        return -1;
+    }
+    *file = table->files[table->rows[low - 1].file];
+    *line = table->rows[low - 1].line;
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef __DEBUG_LINE_H__
+#define __DEBUG_LINE_H__
+
+#include <stddef.h>
+
+struct line_table;
+
+// sections a line table is built from; line_str and str may be NULL
+struct debug_sections {
+    const unsigned char* line;      // .debug_line
+    size_t line_size;
+    const char* line_str;           // .debug_line_str (DWARF 5)
+    size_t line_str_size;
+    const char* str;                // .debug_str
+    size_t str_size;
+};
+
+// parse all DWARF 2-5 line programs into one table sorted by address.
+// File names point into the sections, which must outlive the table.
+// Units that can't be parsed are skipped; NULL if nothing was found.
+struct line_table* line_table_parse(const struct debug_sections* sections);
+
+void line_table_delete(struct line_table* table);
+
+// map an address to a source file and line (return -1 if not covered)
+int line_table_lookup(struct line_table* table, unsigned int addr, const char** file, unsigned int* line);
+
+#endif
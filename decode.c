@@ -0,0 +1,344 @@
+#include "decode.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define R_MASK  0xFE00707F  // opcode, funct3 and funct7
+#define I_MASK  0x0000707F  // opcode and funct3
+#define U_MASK  0x0000007F  // opcode only
+
+const struct insn_desc decode_table[NUM_OPS] = {
+    { 0,           1,           FMT_NONE,   OP_ILLEGAL,  CLASS_NONE,    0, "unknown" },  // never matches
+    { U_MASK,      0x00000037,  FMT_U,      OP_LUI,      CLASS_ALU,     0, "lui" },
+    { U_MASK,      0x00000017,  FMT_U,      OP_AUIPC,    CLASS_ALU,     0, "auipc" },
+    { U_MASK,      0x0000006F,  FMT_J,      OP_JAL,      CLASS_JAL,     0, "jal" },
+    { I_MASK,      0x00000067,  FMT_I,      OP_JALR,     CLASS_JALR,    0, "jalr" },
+    { I_MASK,      0x00000063,  FMT_B,      OP_BEQ,      CLASS_BRANCH,  0, "beq" },
+    { I_MASK,      0x00001063,  FMT_B,      OP_BNE,      CLASS_BRANCH,  0, "bne" },
+    { I_MASK,      0x00004063,  FMT_B,      OP_BLT,      CLASS_BRANCH,  0, "blt" },
+    { I_MASK,      0x00005063,  FMT_B,      OP_BGE,      CLASS_BRANCH,  0, "bge" },
+    { I_MASK,      0x00006063,  FMT_B,      OP_BLTU,     CLASS_BRANCH,  0, "bltu" },
+    { I_MASK,      0x00007063,  FMT_B,      OP_BGEU,     CLASS_BRANCH,  0, "bgeu" },
+    { I_MASK,      0x00000003,  FMT_LOAD,   OP_LB,       CLASS_LOAD,    1, "lb" },
+    { I_MASK,      0x00001003,  FMT_LOAD,   OP_LH,       CLASS_LOAD,    2, "lh" },
+    { I_MASK,      0x00002003,  FMT_LOAD,   OP_LW,       CLASS_LOAD,    4, "lw" },
+    { I_MASK,      0x00004003,  FMT_LOAD,   OP_LBU,      CLASS_LOAD,    1, "lbu" },
+    { I_MASK,      0x00005003,  FMT_LOAD,   OP_LHU,      CLASS_LOAD,    2, "lhu" },
+    { I_MASK,      0x00000023,  FMT_S,      OP_SB,       CLASS_STORE,   1, "sb" },
+    { I_MASK,      0x00001023,  FMT_S,      OP_SH,       CLASS_STORE,   2, "sh" },
+    { I_MASK,      0x00002023,  FMT_S,      OP_SW,       CLASS_STORE,   4, "sw" },
+    { I_MASK,      0x00000013,  FMT_I,      OP_ADDI,     CLASS_ALU,     0, "addi" },
+    { I_MASK,      0x00002013,  FMT_I,      OP_SLTI,     CLASS_ALU,     0, "slti" },
+    { I_MASK,      0x00003013,  FMT_I,      OP_SLTIU,    CLASS_ALU,     0, "sltiu" },
+    { I_MASK,      0x00004013,  FMT_I,      OP_XORI,     CLASS_ALU,     0, "xori" },
+    { I_MASK,      0x00006013,  FMT_I,      OP_ORI,      CLASS_ALU,     0, "ori" },
+    { I_MASK,      0x00007013,  FMT_I,      OP_ANDI,     CLASS_ALU,     0, "andi" },
+    { R_MASK,      0x00001013,  FMT_SHIFT,  OP_SLLI,     CLASS_ALU,     0, "slli" },
+    { R_MASK,      0x00005013,  FMT_SHIFT,  OP_SRLI,     CLASS_ALU,     0, "srli" },
+    { R_MASK,      0x40005013,  FMT_SHIFT,  OP_SRAI,     CLASS_ALU,     0, "srai" },
+    { R_MASK,      0x00000033,  FMT_R,      OP_ADD,      CLASS_ALU,     0, "add" },
+    { R_MASK,      0x40000033,  FMT_R,      OP_SUB,      CLASS_ALU,     0, "sub" },
+    { R_MASK,      0x00001033,  FMT_R,      OP_SLL,      CLASS_ALU,     0, "sll" },
+    { R_MASK,      0x00002033,  FMT_R,      OP_SLT,      CLASS_ALU,     0, "slt" },
+    { R_MASK,      0x00003033,  FMT_R,      OP_SLTU,     CLASS_ALU,     0, "sltu" },
+    { R_MASK,      0x00004033,  FMT_R,      OP_XOR,      CLASS_ALU,     0, "xor" },
+    { R_MASK,      0x00005033,  FMT_R,      OP_SRL,      CLASS_ALU,     0, "srl" },
+    { R_MASK,      0x40005033,  FMT_R,      OP_SRA,      CLASS_ALU,     0, "sra" },
+    { R_MASK,      0x00006033,  FMT_R,      OP_OR,       CLASS_ALU,     0, "or" },
+    { R_MASK,      0x00007033,  FMT_R,      OP_AND,      CLASS_ALU,     0, "and" },
+    { R_MASK,      0x02000033,  FMT_R,      OP_MUL,      CLASS_MULDIV,  0, "mul" },
+    { R_MASK,      0x02001033,  FMT_R,      OP_MULH,     CLASS_MULDIV,  0, "mulh" },
+    { R_MASK,      0x02002033,  FMT_R,      OP_MULHSU,   CLASS_MULDIV,  0, "mulhsu" },
+    { R_MASK,      0x02003033,  FMT_R,      OP_MULHU,    CLASS_MULDIV,  0, "mulhu" },
+    { R_MASK,      0x02004033,  FMT_R,      OP_DIV,      CLASS_MULDIV,  0, "div" },
+    { R_MASK,      0x02005033,  FMT_R,      OP_DIVU,     CLASS_MULDIV,  0, "divu" },
+    { R_MASK,      0x02006033,  FMT_R,      OP_REM,      CLASS_MULDIV,  0, "rem" },
+    { R_MASK,      0x02007033,  FMT_R,      OP_REMU,     CLASS_MULDIV,  0, "remu" },
+    { 0xFFFFFFFF,  0x00000073,  FMT_NONE,   OP_ECALL,    CLASS_SYSTEM,  0, "ecall" },
+};
+
+// Candidates for each combination of opcode and funct3, so a lookup
+// only checks the few entries that differ in funct7 or the full word.
+// Unused slots hold the OP_ILLEGAL entry, which never matches, so every
+// slot can be checked without branching. Filled from decode_table on
+// first use; BUCKET_SIZE must be at least the most entries sharing one
+// opcode and funct3, which fill_buckets checks.
+#define BUCKET_SIZE 3
+static const struct insn_desc* buckets[1024][BUCKET_SIZE];
+static int buckets_ready;
+
+static unsigned bucket_of(uint32_t instruction) {
+    return (instruction & 0x7F) | ((instruction >> 12) & 0x7) << 7;
+}
+
+static void fill_buckets(void) {
+    for (unsigned key = 0; key < 1024; key++) {
+        uint32_t word = (key & 0x7F) | (key >> 7) << 12;
+        int n = 0;
+        for (int op = 1; op < NUM_OPS; op++) {
+            uint32_t common = decode_table[op].mask & 0x707F;
+            if ((word & common) == (decode_table[op].match & common)) {
+                if (n == BUCKET_SIZE) {
+                    // the entry could never be decoded
+                    fprintf(stderr, "decode: more than %d entries for opcode %02x funct3 %x, raise BUCKET_SIZE\n",
+                            BUCKET_SIZE, key & 0x7F, key >> 7);
+                    abort();
+                }
+                buckets[key][n++] = &decode_table[op];
+            }
+        }
+        while (n < BUCKET_SIZE) {
+            buckets[key][n++] = &decode_table[OP_ILLEGAL];
+        }
+    }
+    buckets_ready = 1;
+}
+
+// entries in a bucket exclude each other, so at most one slot matches
+static const struct insn_desc* find(uint32_t instruction, unsigned key) {
+    const struct insn_desc* found = &decode_table[OP_ILLEGAL];
+    for (int i = 0; i < BUCKET_SIZE; i++) {
+        const struct insn_desc* desc = buckets[key][i];
+        found = (instruction & desc->mask) == desc->match ? desc : found;
+    }
+    return found;
+}
+
+const struct insn_desc* decode_lookup(uint32_t instruction) {
+    if (!buckets_ready) {
+        fill_buckets();
+    }
+    const struct insn_desc* desc = find(instruction, bucket_of(instruction));
+    return desc->op == OP_ILLEGAL ? NULL : desc;
+}
+
+// Immediates of the different instruction formats
+static int32_t get_i_imm(uint32_t inst) {
+    return sign_extend(inst >> 20, 12);
+}
+
+static int32_t get_s_imm(uint32_t inst) {
+    return sign_extend(((inst >> 25) << 5) | ((inst >> 7) & 0x1F), 12);
+}
+
+static int32_t get_b_imm(uint32_t inst) {
+    return sign_extend(
+        ((inst >> 31) << 12) |
+        ((inst >> 7) & 0x1) << 11 |
+        ((inst >> 25) & 0x3F) << 5 |
+        ((inst >> 8) & 0xF) << 1,
+        13);
+}
+
+static int32_t get_u_imm(uint32_t inst) {
+    return inst & 0xFFFFF000;
+}
+
+static int32_t get_j_imm(uint32_t inst) {
+    return sign_extend(
+        ((inst >> 31) << 20) |
+        ((inst >> 12) & 0xFF) << 12 |
+        ((inst >> 20) & 0x1) << 11 |
+        ((inst >> 21) & 0x3FF) << 1,
+        21);
+}
+
+void decode(uint32_t instruction, struct decoded* d) {
+    const struct insn_desc* desc = decode_lookup(instruction);
+    d->op = desc ? desc->op : OP_ILLEGAL;
+    d->rd = (instruction >> 7) & 0x1F;
+    d->rs1 = (instruction >> 15) & 0x1F;
+    d->rs2 = (instruction >> 20) & 0x1F;
+    switch (desc ? desc->format : FMT_NONE) {
+        case FMT_I:
+        case FMT_LOAD:
+            d->imm = get_i_imm(instruction);
+            break;
+        case FMT_SHIFT:
+            d->imm = d->rs2;
+            break;
+        case FMT_S:
+            d->imm = get_s_imm(instruction);
+            break;
+        case FMT_B:
+            d->imm = get_b_imm(instruction);
+            break;
+        case FMT_U:
+            d->imm = get_u_imm(instruction);
+            break;
+        case FMT_J:
+            d->imm = get_j_imm(instruction);
+            break;
+        default:
+            d->imm = 0;
+            break;
+    }
+}
+
+// Everything the op lookup needs and every immediate a word could have,
+// for a block of words. decode_bulk picks the immediate once the format
+// is known.
+#define BLOCK 256
+struct fields {
+    uint32_t key[BLOCK];    // bucket index (opcode and funct3)
+    uint32_t rd[BLOCK];
+    uint32_t rs1[BLOCK];
+    uint32_t rs2[BLOCK];
+    int32_t imm_i[BLOCK];
+    int32_t imm_s[BLOCK];
+    int32_t imm_b[BLOCK];
+    int32_t imm_u[BLOCK];
+    int32_t imm_j[BLOCK];
+    int32_t shamt[BLOCK];
+    int32_t none[BLOCK];    // always 0
+};
+
+static void fields_scalar(const uint32_t* words, struct fields* f, uint32_t from, uint32_t to) {
+    for (uint32_t i = from; i < to; i++) {
+        uint32_t w = words[i];
+        f->key[i] = bucket_of(w);
+        f->rd[i] = (w >> 7) & 0x1F;
+        f->rs1[i] = (w >> 15) & 0x1F;
+        f->rs2[i] = (w >> 20) & 0x1F;
+        f->imm_i[i] = get_i_imm(w);
+        f->imm_s[i] = get_s_imm(w);
+        f->imm_b[i] = get_b_imm(w);
+        f->imm_u[i] = get_u_imm(w);
+        f->imm_j[i] = get_j_imm(w);
+        f->shamt[i] = f->rs2[i];
+    }
+}
+
+// The same extraction on 8 words at once. Written with GCC vector types so
+// one body serves both the AVX2 function and the baseline one, where the
+// compiler splits it into SSE2 (or NEON) halves.
+typedef uint32_t v8u __attribute__((vector_size(32)));
+typedef int32_t v8i __attribute__((vector_size(32)));
+
+static inline __attribute__((always_inline)) void fields8(const uint32_t* words, struct fields* f, uint32_t i) {
+    v8u w;
+    memcpy(&w, words + i, sizeof(w));
+    v8i sign = (v8i)w >> 31;    // all ones where bit 31 is set
+    v8u key = (w & 0x7F) | ((w >> 5) & 0x380);
+    v8u rd = (w >> 7) & 0x1F;
+    v8u rs1 = (w >> 15) & 0x1F;
+    v8u rs2 = (w >> 20) & 0x1F;
+    v8i imm_i = (v8i)w >> 20;
+    v8i imm_s = (v8i)((v8u)((v8i)w >> 25) << 5 | rd);
+    v8i imm_b = (v8i)(((v8u)sign << 12) | (w & 0x80) << 4 | ((w >> 20) & 0x7E0) | ((w >> 7) & 0x1E));
+    v8i imm_u = (v8i)(w & 0xFFFFF000);
+    v8i imm_j = (v8i)(((v8u)sign << 20) | (w & 0xFF000) | ((w >> 9) & 0x800) | ((w >> 20) & 0x7FE));
+    memcpy(f->key + i, &key, sizeof(key));
+    memcpy(f->rd + i, &rd, sizeof(rd));
+    memcpy(f->rs1 + i, &rs1, sizeof(rs1));
+    memcpy(f->rs2 + i, &rs2, sizeof(rs2));
+    memcpy(f->imm_i + i, &imm_i, sizeof(imm_i));
+    memcpy(f->imm_s + i, &imm_s, sizeof(imm_s));
+    memcpy(f->imm_b + i, &imm_b, sizeof(imm_b));
+    memcpy(f->imm_u + i, &imm_u, sizeof(imm_u));
+    memcpy(f->imm_j + i, &imm_j, sizeof(imm_j));
+    memcpy(f->shamt + i, &rs2, sizeof(rs2));
+}
+
+static uint32_t fields_vector(const uint32_t* words, struct fields* f, uint32_t n) {
+    uint32_t i;
+    for (i = 0; i + 8 <= n; i += 8) {
+        fields8(words, f, i);
+    }
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static uint32_t fields_avx2(const uint32_t* words, struct fields* f, uint32_t n) {
+    uint32_t i;
+    for (i = 0; i + 8 <= n; i += 8) {
+        fields8(words, f, i);
+    }
+    return i;
+}
+
+static int have_avx2(void) {
+    static int have = -1;
+    if (have < 0) {
+        __builtin_cpu_init();
+        have = __builtin_cpu_supports("avx2") != 0;
+    }
+    return have;
+}
+#endif
+
+void decode_bulk(struct decode_cache* cache, uint32_t first, const uint32_t* words, uint32_t n) {
+    struct fields f;
+    // which immediate each format uses, so picking one doesn't branch
+    const int32_t* imm[] = {
+        [FMT_NONE] = f.none, [FMT_R] = f.none, [FMT_I] = f.imm_i, [FMT_SHIFT] = f.shamt,
+        [FMT_LOAD] = f.imm_i, [FMT_S] = f.imm_s, [FMT_B] = f.imm_b, [FMT_U] = f.imm_u, [FMT_J] = f.imm_j
+    };
+    memset(f.none, 0, sizeof(f.none));
+    if (!buckets_ready) {
+        fill_buckets();
+    }
+    for (uint32_t done = 0; done < n; done += BLOCK) {
+        const uint32_t* w = words + done;
+        uint32_t len = n - done < BLOCK ? n - done : BLOCK;
+        uint32_t vectored;
+#if defined(__x86_64__) || defined(__i386__)
+        if (have_avx2()) {
+            vectored = fields_avx2(w, &f, len);
+        } else
+#endif
+        vectored = fields_vector(w, &f, len);
+        fields_scalar(w, &f, vectored, len);
+
+        // local pointers, or the compiler reloads them after every store
+        uint32_t at = first + done;
+        uint32_t* restrict word = cache->word + at;
+        uint8_t* restrict op = cache->op + at;
+        uint8_t* restrict rd = cache->rd + at;
+        uint8_t* restrict rs1 = cache->rs1 + at;
+        uint8_t* restrict rs2 = cache->rs2 + at;
+        int32_t* restrict imm_out = cache->imm + at;
+        for (uint32_t i = 0; i < len; i++) {
+            const struct insn_desc* desc = find(w[i], f.key[i]);
+            word[i] = w[i];
+            op[i] = desc->op;
+            rd[i] = f.rd[i];
+            rs1[i] = f.rs1[i];
+            rs2[i] = f.rs2[i];
+            imm_out[i] = imm[desc->format][i];
+        }
+    }
+}
+
+struct decode_cache* decode_cache_create(uint32_t start, const uint32_t* words, uint32_t count) {
+    struct decode_cache* cache = malloc(sizeof(struct decode_cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->start = start;
+    cache->count = count;
+    cache->word = malloc(count * sizeof(uint32_t) + 1);
+    cache->imm = malloc(count * sizeof(int32_t) + 1);
+    cache->op = malloc(4 * count + 1);
+    if (cache->word == NULL || cache->imm == NULL || cache->op == NULL) {
+        free(cache->word);
+        free(cache->imm);
+        free(cache->op);
+        free(cache);
+        return NULL;
+    }
+    cache->rd = cache->op + count;
+    cache->rs1 = cache->rd + count;
+    cache->rs2 = cache->rs1 + count;
+    decode_bulk(cache, 0, words, count);
+    return cache;
+}
+
+void decode_cache_delete(struct decode_cache* cache) {
+    free(cache->word);
+    free(cache->imm);
+    free(cache->op);
+    free(cache);
+}
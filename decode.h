@@ -0,0 +1,119 @@
+#ifndef __DECODE_H__
+#define __DECODE_H__
+
+#include <stdint.h>
+
+// RV32IM instructions known to the decoder. The order matches decode_table.
+enum rv_op {
+    OP_ILLEGAL,
+    OP_LUI, OP_AUIPC, OP_JAL, OP_JALR,
+    OP_BEQ, OP_BNE, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU,
+    OP_LB, OP_LH, OP_LW, OP_LBU, OP_LHU,
+    OP_SB, OP_SH, OP_SW,
+    OP_ADDI, OP_SLTI, OP_SLTIU, OP_XORI, OP_ORI, OP_ANDI,
+    OP_SLLI, OP_SRLI, OP_SRAI,
+    OP_ADD, OP_SUB, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_SRA, OP_OR, OP_AND,
+    OP_MUL, OP_MULH, OP_MULHSU, OP_MULHU, OP_DIV, OP_DIVU, OP_REM, OP_REMU,
+    OP_ECALL,
+    NUM_OPS
+};
+
+// Operand layout, which also decides how the disassembler prints them
+enum rv_format {
+    FMT_NONE,   // no operands
+    FMT_R,      // rd,rs1,rs2
+    FMT_I,      // rd,rs1,imm
+    FMT_SHIFT,  // rd,rs1,shamt
+    FMT_LOAD,   // rd,imm(rs1)
+    FMT_S,      // rs2,imm(rs1)
+    FMT_B,      // rs1,rs2,pc+imm
+    FMT_U,      // rd,imm>>12
+    FMT_J       // rd,pc+imm
+};
+
+// What kind of work an instruction does, for statistics and timing models
+enum rv_class {
+    CLASS_NONE,     // illegal instructions
+    CLASS_ALU,      // integer arithmetic, logic, shifts, lui, auipc
+    CLASS_MULDIV,
+    CLASS_LOAD,
+    CLASS_STORE,
+    CLASS_BRANCH,
+    CLASS_JAL,
+    CLASS_JALR,
+    CLASS_SYSTEM,   // ecall
+    NUM_CLASSES
+};
+
+// One line of the instruction description: instruction words w with
+// (w & mask) == match are this instruction
+struct insn_desc {
+    uint32_t mask;
+    uint32_t match;
+    enum rv_format format;
+    enum rv_op op;
+    enum rv_class cls;
+    uint8_t size;       // bytes accessed by loads and stores
+    const char* mnemonic;
+};
+
+extern const struct insn_desc decode_table[NUM_OPS];
+
+// An instruction word split into its operation and operands. imm is
+// already sign extended and scaled for the format (shamt for shifts).
+struct decoded {
+    uint8_t op;     // enum rv_op
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    int32_t imm;
+};
+
+// description of an instruction word, NULL if it is not a known instruction
+const struct insn_desc* decode_lookup(uint32_t instruction);
+
+void decode(uint32_t instruction, struct decoded* d);
+
+// A text segment decoded ahead of time, one entry per instruction word,
+// in structure-of-arrays form
+struct decode_cache {
+    uint32_t start;     // address of the first word
+    uint32_t count;
+    uint32_t* word;     // the words the entries were decoded from
+    uint8_t* op;
+    uint8_t* rd;
+    uint8_t* rs1;
+    uint8_t* rs2;
+    int32_t* imm;
+};
+
+// decode count words starting at address start (NULL if out of host memory)
+struct decode_cache* decode_cache_create(uint32_t start, const uint32_t* words, uint32_t count);
+void decode_cache_delete(struct decode_cache* cache);
+
+// decode n words into entries first..first+n-1 of the cache. Fields and
+// immediates are extracted 8 words at a time with AVX2 when the host has
+// it, else with SSE2 (or whatever vectors the target has).
+void decode_bulk(struct decode_cache* cache, uint32_t first, const uint32_t* words, uint32_t n);
+
+// fill d from the cache if it holds pc and the word there is still
+// instruction, so stores to the text segment just miss the cache
+static inline int decode_cache_get(const struct decode_cache* cache, uint32_t pc, uint32_t instruction, struct decoded* d) {
+    uint32_t i = (pc - cache->start) >> 2;
+    if (i >= cache->count || cache->word[i] != instruction) {
+        return 0;
+    }
+    d->op = cache->op[i];
+    d->rd = cache->rd[i];
+    d->rs1 = cache->rs1[i];
+    d->rs2 = cache->rs2[i];
+    d->imm = cache->imm[i];
+    return 1;
+}
+
+static inline int32_t sign_extend(uint32_t x, int bits) {
+    uint32_t sign_bit = 1u << (bits - 1);
+    return (x ^ sign_bit) - sign_bit;
+}
+
+#endif
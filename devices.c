@@ -0,0 +1,178 @@
+#include "devices.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct devices
+{
+  struct timespec start;
+  unsigned timer_hi;        // latched by a read of TIMER_LO
+  unsigned dma_src;
+  unsigned dma_dst;
+  unsigned dma_len;
+  unsigned dma_result;
+};
+
+static int uart_read(void *ctx, struct memory *mem, unsigned offset, int size)
+{
+  (void)ctx;
+  (void)mem;
+  (void)size;
+  if (offset == UART_RX)
+  {
+    fflush(stdout);
+    return getchar();
+  }
+  return 0;
+}
+
+static void uart_write(void *ctx, struct memory *mem, unsigned offset, int size, int data)
+{
+  (void)ctx;
+  (void)mem;
+  (void)size;
+  if (offset == UART_TX)
+    putchar(data);
+}
+
+static int timer_read(void *ctx, struct memory *mem, unsigned offset, int size)
+{
+  struct devices *devices = ctx;
+  (void)mem;
+  (void)size;
+  if (offset == TIMER_LO)
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned long long usecs = (now.tv_sec - devices->start.tv_sec) * 1000000ULL
+                             + (now.tv_nsec - devices->start.tv_nsec) / 1000;
+    devices->timer_hi = usecs >> 32;
+    return (unsigned)usecs;
+  }
+  if (offset == TIMER_HI)
+    return devices->timer_hi;
+  return 0;
+}
+
+// Bulk transfers go through a bounce buffer a chunk at a time, so copies
+// between overlapping ranges behave like memmove only within a chunk
+#define DMA_CHUNK 4096
+
+// A destination over the DMA registers would start transfers from inside
+// a transfer, so such commands do nothing
+static int dma_dst_ok(struct devices *devices)
+{
+  unsigned long start = devices->dma_dst;
+  unsigned long end = start + devices->dma_len;
+  return end <= DMA_BASE || start >= DMA_BASE + DMA_RESULT + 4;
+}
+
+static unsigned dma_run(struct devices *devices, struct memory *mem, int cmd)
+{
+  unsigned char buffer[DMA_CHUNK];
+  unsigned done = 0;
+  if ((cmd == DMA_CMD_COPY || cmd == DMA_CMD_READ) && !dma_dst_ok(devices))
+    return 0;
+  while (done < devices->dma_len)
+  {
+    unsigned chunk = devices->dma_len - done;
+    if (chunk > DMA_CHUNK)
+      chunk = DMA_CHUNK;
+    switch (cmd)
+    {
+    case DMA_CMD_COPY:
+      memory_read_bytes(mem, devices->dma_src + done, buffer, chunk);
+      memory_write_bytes(mem, devices->dma_dst + done, buffer, chunk);
+      break;
+    case DMA_CMD_WRITE:
+      memory_read_bytes(mem, devices->dma_src + done, buffer, chunk);
+      chunk = fwrite(buffer, 1, chunk, stdout);
+      break;
+    case DMA_CMD_READ:
+      {
+        // through stdio like getchar, stopping after a newline so a guest
+        // asking for a line gets it as soon as it is typed
+        fflush(stdout);
+        unsigned got = 0;
+        int c = 0;
+        while (got < chunk && c != '\n' && (c = getchar()) != EOF)
+          buffer[got++] = c;
+        memory_write_bytes(mem, devices->dma_dst + done, buffer, got);
+        if (got < chunk)
+          return done + got;
+      }
+      break;
+    default:
+      return done;
+    }
+    done += chunk;
+    if (chunk == 0)
+      break;
+  }
+  return done;
+}
+
+static int dma_read(void *ctx, struct memory *mem, unsigned offset, int size)
+{
+  struct devices *devices = ctx;
+  (void)mem;
+  (void)size;
+  switch (offset)
+  {
+  case DMA_SRC:
+    return devices->dma_src;
+  case DMA_DST:
+    return devices->dma_dst;
+  case DMA_LEN:
+    return devices->dma_len;
+  case DMA_RESULT:
+    return devices->dma_result;
+  }
+  return 0;
+}
+
+static void dma_write(void *ctx, struct memory *mem, unsigned offset, int size, int data)
+{
+  struct devices *devices = ctx;
+  (void)size;
+  switch (offset)
+  {
+  case DMA_SRC:
+    devices->dma_src = data;
+    break;
+  case DMA_DST:
+    devices->dma_dst = data;
+    break;
+  case DMA_LEN:
+    devices->dma_len = data;
+    break;
+  case DMA_CMD:
+    devices->dma_result = dma_run(devices, mem, data);
+    break;
+  }
+}
+
+static const struct mmio_ops uart_ops = { uart_read, uart_write };
+static const struct mmio_ops timer_ops = { timer_read, NULL };
+static const struct mmio_ops dma_ops = { dma_read, dma_write };
+
+struct devices *devices_attach(struct memory *mem)
+{
+  struct devices *devices = calloc(sizeof(struct devices), 1);
+  if (devices == NULL)
+    return NULL;
+  clock_gettime(CLOCK_MONOTONIC, &devices->start);
+  if (memory_map_device(mem, UART_BASE, 8, &uart_ops, devices)
+      || memory_map_device(mem, TIMER_BASE, 8, &timer_ops, devices)
+      || memory_map_device(mem, DMA_BASE, 20, &dma_ops, devices))
+  {
+    free(devices);
+    return NULL;
+  }
+  return devices;
+}
+
+void devices_delete(struct devices *devices)
+{
+  free(devices);
+}
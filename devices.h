@@ -0,0 +1,42 @@
+#ifndef __DEVICES_H__
+#define __DEVICES_H__
+
+#include "memory.h"
+
+// Enheder der mappes ind i det simulerede adresserum (memory-mapped I/O).
+// Alle registre er 32 bit.
+
+// UART: skriv et tegn til TX for at udskrive det, læs RX for at læse et
+// tegn fra stdin (-1 ved end of file)
+#define UART_BASE    0xF0000000
+#define UART_TX      0x0
+#define UART_RX      0x4
+
+// Timer: mikrosekunder siden enhederne blev oprettet. Læsning af LO
+// fastfryser HI, så LO efterfulgt af HI giver en konsistent 64 bit værdi
+#define TIMER_BASE   0xF0000100
+#define TIMER_LO     0x0
+#define TIMER_HI     0x4
+
+// Bulk overførsel: sæt SRC, DST og LEN, og skriv en kommando til CMD.
+// RESULT angiver bagefter antal overførte bytes.
+#define DMA_BASE     0xF0000200
+#define DMA_SRC      0x0
+#define DMA_DST      0x4
+#define DMA_LEN      0x8
+#define DMA_CMD      0xC
+#define DMA_RESULT   0x10
+#define DMA_CMD_COPY  1   // kopier LEN bytes fra SRC til DST i lageret
+#define DMA_CMD_WRITE 2   // skriv LEN bytes fra SRC til stdout
+#define DMA_CMD_READ  3   // læs op til LEN bytes fra stdin til DST, til og
+                          // med første linjeskift
+// COPY og READ med DST oven i DMA-registrene gør intet (RESULT 0).
+
+struct devices;
+
+// opret enhederne og map dem ind i lageret (NULL ved fejl)
+struct devices *devices_attach(struct memory *mem);
+// skal først kaldes når intet lager (eller kopi af det) bruger enhederne
+void devices_delete(struct devices *devices);
+
+#endif
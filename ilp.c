@@ -0,0 +1,167 @@
+#include "ilp.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_WINDOWS 4
+static const unsigned window_sizes[NUM_WINDOWS] = { 0, 32, 64, 256 };  // 0 is unbounded
+
+// Latest store to a memory word, open addressing
+struct word_slot {
+    uint32_t word;                  // address / 4, + 1 so 0 marks a free slot
+    uint64_t ready[NUM_WINDOWS];    // cycle the stored value exists, per window
+};
+
+struct ilp {
+    struct timing_latencies latencies;
+    long insns;
+    long memory_dependencies;       // loads reading a word stored earlier
+    long lost;                      // stores not remembered for lack of host memory
+    uint64_t ready[NUM_WINDOWS][32];
+    uint64_t* retired[NUM_WINDOWS]; // retire cycles of the latest window instructions
+    uint64_t last_retire[NUM_WINDOWS];
+    uint64_t length[NUM_WINDOWS];   // cycle the latest instruction completes
+    struct word_slot* words;
+    unsigned size_bits;
+    unsigned used;
+};
+
+struct ilp* ilp_create(const struct timing_latencies* latencies) {
+    struct ilp* ilp = calloc(1, sizeof(struct ilp));
+    if (ilp == NULL) {
+        return NULL;
+    }
+    ilp->latencies = *latencies;
+    ilp->size_bits = 10;
+    ilp->words = calloc(1u << ilp->size_bits, sizeof(struct word_slot));
+    int failed = ilp->words == NULL;
+    for (int w = 1; w < NUM_WINDOWS; w++) {
+        ilp->retired[w] = calloc(window_sizes[w], sizeof(uint64_t));
+        failed |= ilp->retired[w] == NULL;
+    }
+    if (failed) {
+        ilp_delete(ilp);
+        return NULL;
+    }
+    return ilp;
+}
+
+void ilp_delete(struct ilp* ilp) {
+    free(ilp->words);
+    for (int w = 1; w < NUM_WINDOWS; w++) {
+        free(ilp->retired[w]);
+    }
+    free(ilp);
+}
+
+static struct word_slot* word_slot(struct word_slot* slots, unsigned size_bits, uint32_t key) {
+    unsigned mask = (1u << size_bits) - 1;
+    unsigned at = (key * 2654435761u) >> (32 - size_bits);
+    while (slots[at].word && slots[at].word != key) {
+        at = (at + 1) & mask;
+    }
+    return &slots[at];
+}
+
+// slot of a word, a free slot for it if it is new (NULL if out of host memory)
+static struct word_slot* find_word(struct ilp* ilp, uint32_t key) {
+    if (2 * (ilp->used + 1) > (1u << ilp->size_bits)) {
+        // keep the table at most half full
+        unsigned size_bits = ilp->size_bits + 1;
+        struct word_slot* slots = calloc(1u << size_bits, sizeof(struct word_slot));
+        if (slots == NULL) {
+            return NULL;
+        }
+        for (unsigned i = 0; i < (1u << ilp->size_bits); i++) {
+            if (ilp->words[i].word) {
+                *word_slot(slots, size_bits, ilp->words[i].word) = ilp->words[i];
+            }
+        }
+        free(ilp->words);
+        ilp->words = slots;
+        ilp->size_bits = size_bits;
+    }
+    return word_slot(ilp->words, ilp->size_bits, key);
+}
+
+void ilp_retire(struct ilp* ilp, const struct retired* r) {
+    enum rv_class cls = decode_table[r->op].cls;
+    int src1, src2, dst;
+    timing_registers(r, &src1, &src2, &dst);
+    unsigned latency = 1;
+    if (cls == CLASS_MULDIV) {
+        latency = r->op >= OP_DIV ? ilp->latencies.div : ilp->latencies.mul;
+    } else if (cls == CLASS_LOAD) {
+        latency += timing_served_latency(&ilp->latencies, r->data_served);
+    }
+
+    // loads depend on the latest store to their word, stores become it
+    struct word_slot* word = NULL;
+    uint32_t key = (r->addr >> 2) + 1;
+    if (cls == CLASS_LOAD) {
+        word = word_slot(ilp->words, ilp->size_bits, key);
+        if (word->word) {
+            ilp->memory_dependencies++;
+        } else {
+            word = NULL;
+        }
+    } else if (cls == CLASS_STORE) {
+        word = find_word(ilp, key);
+        if (word == NULL) {
+            ilp->lost++;
+        } else if (word->word == 0) {
+            word->word = key;
+            ilp->used++;
+        }
+    }
+
+    for (int w = 0; w < NUM_WINDOWS; w++) {
+        uint64_t* ready = ilp->ready[w];
+        uint64_t start = 0;
+        if (w > 0) {
+            start = ilp->retired[w][ilp->insns % window_sizes[w]];
+        }
+        start = src1 && ready[src1] > start ? ready[src1] : start;
+        start = src2 && ready[src2] > start ? ready[src2] : start;
+        if (cls == CLASS_LOAD && word && word->ready[w] > start) {
+            start = word->ready[w];
+        }
+        uint64_t complete = start + latency;
+        if (dst) {
+            ready[dst] = complete;
+        }
+        if (cls == CLASS_STORE && word) {
+            word->ready[w] = complete;
+        }
+        if (complete > ilp->length[w]) {
+            ilp->length[w] = complete;
+        }
+        if (w > 0) {
+            // retire in order
+            if (complete > ilp->last_retire[w]) {
+                ilp->last_retire[w] = complete;
+            }
+            ilp->retired[w][ilp->insns % window_sizes[w]] = ilp->last_retire[w];
+        }
+    }
+    ilp->insns++;
+}
+
+void ilp_report(struct ilp* ilp, FILE* out) {
+    const struct timing_latencies* latencies = &ilp->latencies;
+    fprintf(out, "Dataflow limit (mul %u, div %u, load 1 + l2 %u or mem %u cycles, others 1):\n", latencies->mul,
+            latencies->div, latencies->l2, latencies->memory);
+    fprintf(out, "  %ld instructions, %ld loads from words stored by the program, %u words stored\n", ilp->insns,
+            ilp->memory_dependencies, ilp->used);
+    if (ilp->lost) {
+        fprintf(out, "  (out of host memory: %ld stores not tracked)\n", ilp->lost);
+    }
+    fprintf(out, "  %10s %16s %10s\n", "window", "cycles", "ILP");
+    for (int w = 0; w < NUM_WINDOWS; w++) {
+        char name[16] = "unbounded";
+        if (w > 0) {
+            snprintf(name, sizeof(name), "%u", window_sizes[w]);
+        }
+        fprintf(out, "  %10s %16lu %10.2f\n", name, (unsigned long)ilp->length[w],
+                ilp->length[w] ? (double)ilp->insns / ilp->length[w] : 0.0);
+    }
+}
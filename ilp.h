@@ -0,0 +1,30 @@
+#ifndef __ILP_H__
+#define __ILP_H__
+
+#include "timing.h"
+#include <stdio.h>
+#include <stdint.h>
+
+// Dataflow limit of the retired instruction stream: every instruction
+// starts as soon as the registers and memory words it reads have been
+// written, limited only by true dependencies and latencies, once with an
+// unbounded window and once for each of a few window sizes, where an
+// instruction can not start before the one a window earlier has retired.
+// Only the latest writer of each register and memory word is kept, so
+// memory use follows the guest's footprint rather than the trace length.
+struct ilp;
+
+// analysis with mul/div latencies and load latencies from the cache model
+// (return NULL if out of host memory)
+struct ilp* ilp_create(const struct timing_latencies* latencies);
+
+void ilp_delete(struct ilp* ilp);
+
+// account for the next instruction in program order
+void ilp_retire(struct ilp* ilp, const struct retired* r);
+
+// write the cycles (with an unbounded window the critical path length)
+// and the ILP with each window
+void ilp_report(struct ilp* ilp, FILE* out);
+
+#endif
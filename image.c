@@ -0,0 +1,203 @@
+#include "image.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct image_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t page_size;
+  uint32_t num_pages;
+  uint32_t pc;
+  int32_t regs[32];
+  uint32_t text_start;
+  uint32_t text_end;
+  uint32_t start;
+};
+
+struct image
+{
+  unsigned char *data;
+  size_t size;
+  const struct image_header *header;
+};
+
+// Page data starts at the first page boundary after the address table
+static unsigned long pages_offset(unsigned page_size, unsigned num_pages)
+{
+  unsigned long offset = sizeof(struct image_header) + 4ul * num_pages;
+  return (offset + page_size - 1) / page_size * page_size;
+}
+
+struct page_list
+{
+  unsigned page_size;
+  unsigned num_pages;
+  unsigned max_pages;
+  uint32_t *addrs;
+  const unsigned char **data;
+  int failed;
+};
+
+static int all_zero(const unsigned char *data, unsigned size)
+{
+  for (unsigned i = 0; i < size; ++i)
+  {
+    if (data[i])
+      return 0;
+  }
+  return 1;
+}
+
+static void collect_page(void *ctx, unsigned addr, const unsigned char *data)
+{
+  struct page_list *list = ctx;
+  if (list->failed || all_zero(data, list->page_size))
+    return;
+  if (list->num_pages == list->max_pages)
+  {
+    unsigned max_pages = list->max_pages ? 2 * list->max_pages : 64;
+    uint32_t *addrs = realloc(list->addrs, max_pages * sizeof(uint32_t));
+    if (addrs)
+      list->addrs = addrs;
+    const unsigned char **pages = realloc(list->data, max_pages * sizeof(const unsigned char *));
+    if (pages)
+      list->data = pages;
+    if (addrs == NULL || pages == NULL)
+    {
+      list->failed = 1;
+      return;
+    }
+    list->max_pages = max_pages;
+  }
+  list->addrs[list->num_pages] = addr;
+  list->data[list->num_pages] = data;
+  list->num_pages++;
+}
+
+int image_write(const char *file_name, struct memory *mem, const struct cpu_state *cpu, const struct program_info *info)
+{
+  struct memory_usage usage;
+  memory_get_usage(mem, &usage);
+  // the page pointers stay valid as long as nothing else touches mem
+  struct page_list list = { usage.page_size, 0, 0, NULL, NULL, 0 };
+  memory_for_each_page(mem, collect_page, &list);
+  struct image_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+  header.version = IMAGE_VERSION;
+  header.page_size = list.page_size;
+  header.num_pages = list.num_pages;
+  header.pc = cpu->pc;
+  memcpy(header.regs, cpu->regs, sizeof(header.regs));
+  header.text_start = info->text_start;
+  header.text_end = info->text_end;
+  header.start = info->start;
+  FILE *file = list.failed ? NULL : fopen(file_name, "wb");
+  int status = -1;
+  if (file)
+  {
+    long offset = sizeof(header) + 4l * list.num_pages;
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1
+          && fwrite(list.addrs, 4, list.num_pages, file) == list.num_pages;
+    for (; ok && offset < (long)pages_offset(list.page_size, list.num_pages); ++offset)
+      ok = fputc(0, file) != EOF;
+    for (unsigned i = 0; ok && i < list.num_pages; ++i)
+      ok = fwrite(list.data[i], list.page_size, 1, file) == 1;
+    if (fclose(file) == 0 && ok)
+      status = 0;
+  }
+  free(list.addrs);
+  free(list.data);
+  return status;
+}
+
+struct image *image_open(const char *file_name)
+{
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0)
+  {
+    perror("Error opening image");
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct image_header))
+  {
+    fprintf(stderr, "Not a valid image file.\n");
+    close(fd);
+    return NULL;
+  }
+  // private and writable: guest stores to an adopted page get a private
+  // copy of that host page from the kernel and never reach the file
+  void *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+  {
+    perror("Error mapping image");
+    return NULL;
+  }
+  struct image *image = malloc(sizeof(struct image));
+  if (image == NULL)
+  {
+    munmap(data, st.st_size);
+    return NULL;
+  }
+  image->data = data;
+  image->size = st.st_size;
+  image->header = data;
+  const struct image_header *header = image->header;
+  if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) || header->version != IMAGE_VERSION
+      || header->page_size < (1u << MEMORY_MIN_PAGE_BITS) || (header->page_size & (header->page_size - 1))
+      || pages_offset(header->page_size, header->num_pages) + (unsigned long)header->num_pages * header->page_size > image->size)
+  {
+    fprintf(stderr, "Not a valid image file.\n");
+    image_close(image);
+    return NULL;
+  }
+  return image;
+}
+
+unsigned image_page_size(struct image *image)
+{
+  return image->header->page_size;
+}
+
+int image_load(struct image *image, struct memory *mem, struct cpu_state *cpu, struct program_info *info)
+{
+  const struct image_header *header = image->header;
+  struct memory_usage usage;
+  memory_get_usage(mem, &usage);
+  if (usage.page_size != header->page_size)
+  {
+    fprintf(stderr, "Image needs guest pages of %u bytes\n", header->page_size);
+    return -1;
+  }
+  const uint32_t *addrs = (const uint32_t *)(image->data + sizeof(struct image_header));
+  unsigned char *pages = image->data + pages_offset(header->page_size, header->num_pages);
+  for (unsigned i = 0; i < header->num_pages; ++i)
+  {
+    if (memory_adopt_page(mem, addrs[i], pages + (unsigned long)i * header->page_size))
+    {
+      fprintf(stderr, "Could not place image page at %x\n", addrs[i]);
+      return -1;
+    }
+  }
+  memcpy(cpu->regs, header->regs, sizeof(cpu->regs));
+  cpu->pc = header->pc;
+  info->text_start = header->text_start;
+  info->text_end = header->text_end;
+  info->start = header->start;
+  return 0;
+}
+
+void image_close(struct image *image)
+{
+  munmap(image->data, image->size);
+  free(image);
+}
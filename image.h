@@ -0,0 +1,30 @@
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include "memory.h"
+#include "simulate.h"
+#include "read_elf.h"
+
+// Et image er et færdigt initialiseret program: registre, programinfo og
+// alle sider der ikke er nul. Filen er opdelt i hele sider, så siderne kan
+// bruges direkte fra en mapping af filen uden at blive kopieret.
+//
+//   header | sideadresser (uint32) | fyld til sidegrænse | sider
+#define IMAGE_MAGIC "RVSIMIMG"
+#define IMAGE_VERSION 1
+
+struct image;
+
+// skriv lagerets sider og cpu til file_name; -1 ved fejl
+int image_write(const char *file_name, struct memory *mem, const struct cpu_state *cpu, const struct program_info *info);
+
+// map et image (NULL med en besked på stderr ved fejl)
+struct image *image_open(const char *file_name);
+// sidestørrelsen lageret til image_load skal oprettes med
+unsigned image_page_size(struct image *image);
+// brug siderne i et tomt lager og gendan cpu og programinfo; -1 ved fejl
+int image_load(struct image *image, struct memory *mem, struct cpu_state *cpu, struct program_info *info);
+// skal først kaldes når intet lager (eller kopi af det) bruger siderne
+void image_close(struct image *image);
+
+#endif
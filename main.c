@@ -2,10 +2,13 @@
 #include "read_elf.h"
 #include "disassemble.h"
 #include "simulate.h"
+#include "devices.h"
+#include "image.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/resource.h>
 
 void terminate(const char *error)
 {
@@ -16,6 +19,36 @@ void terminate(const char *error)
   printf("      sim riscv-elf -d         // disassemble text segment of riscv-elf file to stdout\n");
   printf("      sim riscv-elf -l log     // simulate and log each instruction to file 'log'\n");
   printf("      sim riscv-elf -s log     // simulate and log only summary to file 'log'\n");
+  printf("      sim riscv-elf -p prof    // write per instruction and per function profiles to 'prof'\n");
+  printf("      sim riscv-elf --folded file  // sample the call stack, write folded stacks for flame graphs\n");
+  printf("      sim riscv-elf --sample-interval n // take a --folded sample every n instructions (default 1000)\n");
+  printf("      sim riscv-elf --stats        // add instruction mix, memory traffic and syscall counts to the summary\n");
+  printf("      sim riscv-elf --stats-json file // write the same counts as JSON to 'file'\n");
+  printf("      sim riscv-elf --cache l1i=size:ways:line[:lru|plru|random[:wb|wt]]  // simulate a cache and\n");
+  printf("                               // report its misses; also l1d= and l2=, repeatable (e.g. l1d=32k:8:64)\n");
+  printf("      sim riscv-elf --mrc file     // write LRU miss ratio curves of fetches and data accesses to 'file'\n");
+  printf("      sim riscv-elf --mrc-line n   // use n byte lines for --mrc (default 64)\n");
+  printf("      sim riscv-elf --bpred kind[:bits[:history]]  // model a branch predictor (static, bimodal,\n");
+  printf("                               // gshare or tage) with a BTB and return stack, report mispredictions\n");
+  printf("      sim riscv-elf --pipeline     // estimate cycles and CPI on a 5 stage in-order pipeline, using\n");
+  printf("                               // the --cache and --bpred models if given\n");
+  printf("      sim riscv-elf --ooo list     // estimate cycles, IPC and stalls on an out-of-order core, list is\n");
+  printf("                               // 'default' or e.g. width=4,depth=5,rob=128,iq=64,lsq=48,alu=4,muldiv=1,mem=2,load=3\n");
+  printf("      sim riscv-elf --ilp          // report the critical path and ILP of the executed instructions\n");
+  printf("      sim riscv-elf --latencies list // cycles for the timing models, e.g. mul=3,div=20,l2=12,mem=100,branch=2\n");
+  printf("      sim riscv-elf --page-size n  // use guest pages of n bytes (4k..2m, default 4k)\n");
+  printf("      sim riscv-elf --mem-limit n  // fault a guest that needs more than n bytes of pages\n");
+  printf("      sim riscv-elf -w addr[:len]  // report stores to guest addresses (repeatable, len default 4)\n");
+  printf("      sim riscv-elf --strict-align // fault on misaligned loads/stores instead of emulating them\n");
+  printf("      sim riscv-elf --make-image file  // run to main (or --image-symbol sym) and save an image there\n");
+  printf("      sim image --image        // start from an image made with --make-image; riscv-elf is the image\n");
+  printf("      sim riscv-elf --lazy         // copy program pages from the elf file only when first used\n");
+  printf("      sim riscv-elf --mem-stats    // add guest and host memory use to the summary\n");
+  printf("      sim riscv-elf --hugepages    // back guest memory with 2 MiB huge pages, report coverage\n");
+  printf("      sim riscv-elf --repeat n     // run n times, restoring only dirty pages between runs\n");
+  printf("      sim riscv-elf --instances n  // run n instances sharing unmodified pages copy-on-write\n");
+  printf("    devices: uart at %x, timer at %x, bulk copy/io at %x (see devices.h)\n", UART_BASE, TIMER_BASE, DMA_BASE);
+  printf("    exit status is 2 if a guest faulted\n");
   printf("    prog-args: arguments to the simulated program\n");
   printf("               these arguments are provided through argv. Puts '--' in argv[0]\n");
   printf("      sim riscv-elf -- gylletank   // run riscv-elf with 'gylletank' in argv[1]\n");
@@ -58,77 +91,866 @@ void disassemble_to_stdout(struct memory* mem, struct program_info* prog_info, s
 {
   const int buf_size = 100;
   char disassembly[buf_size];
+  const char* last_file = NULL;
+  unsigned int last_line = 0;
   for (unsigned int addr = prog_info->text_start; addr < prog_info->text_end; addr += 4) {
+    const char* file;
+    unsigned int line;
+    if (symbols && symbols_addr_to_line(symbols, addr, &file, &line) == 0
+        && (line != last_line || file != last_file)) {
+      printf("%s:%u\n", file, line);
+      last_file = file;
+      last_line = line;
+    }
     unsigned int instruction = memory_rd_w(mem, addr);
     disassemble(addr, instruction, disassembly, buf_size, symbols);
     printf("%8x : %08X       %s\n", addr, instruction, disassembly);
   }
 }
 
+// Helper function, parses a size like 4096, 64k or 2m
+unsigned parse_size(const char* arg)
+{
+  char* end;
+  unsigned long size = strtoul(arg, &end, 0);
+  if (*end == 'k' || *end == 'K') { size <<= 10; end++; }
+  else if (*end == 'm' || *end == 'M') { size <<= 20; end++; }
+  if (*end != 0 || size == 0 || size > 0xffffffffUL)
+    terminate("Invalid size argument, terminating.");
+  return size;
+}
+
+// Helper function, prints guest and host memory use
+void print_memory_stats(FILE* out, struct memory* mem)
+{
+  struct memory_usage usage;
+  memory_get_usage(mem, &usage);
+  struct rusage host_usage;
+  getrusage(RUSAGE_SELF, &host_usage);
+  fprintf(out, "Guest memory: %ld pages of %u bytes (%ld KiB), page tables %ld KiB, host max RSS %ld KiB\n",
+          usage.pages, usage.page_size, usage.page_bytes >> 10, usage.table_bytes >> 10, host_usage.ru_maxrss);
+  if (usage.snapshot_bytes)
+  {
+    fprintf(out, "Snapshot: %ld KiB of baseline page copies\n", usage.snapshot_bytes >> 10);
+  }
+}
+
+// Helper function, sets a watchpoint given as addr or addr:len
+void add_watchpoint(struct memory* mem, const char* arg)
+{
+  char* end;
+  unsigned long addr = strtoul(arg, &end, 0);
+  unsigned long len = 4;
+  if (*end == ':')
+    len = strtoul(end + 1, &end, 0);
+  if (*end != 0 || memory_add_watchpoint(mem, addr, len))
+    terminate("Invalid watchpoint, terminating.");
+}
+
+// Helper function, explains why a guest stopped
+void report_fault(struct Stat* stats, struct cpu_state* cpu)
+{
+  const char* reason = "unknown fault";
+  switch (stats->fault)
+  {
+  case SIM_FAULT_MEMORY_LIMIT:
+    reason = "memory limit exceeded";
+    break;
+  case SIM_FAULT_MISALIGNED:
+    reason = "misaligned access";
+    break;
+  case SIM_FAULT_HOST_MEMORY:
+    reason = "host out of memory";
+    break;
+  case SIM_FAULT_ILLEGAL_INSTRUCTION:
+    fprintf(stderr, "Guest fault: illegal instruction %08x at pc %x after %ld instructions\n",
+            stats->fault_insn, stats->fault_pc, stats->insns);
+    return;
+  case SIM_FAULT_UNKNOWN_SYSCALL:
+    fprintf(stderr, "Guest fault: unknown syscall %d at pc %x after %ld instructions\n",
+            cpu->regs[17], stats->fault_pc, stats->insns);
+    return;
+  default:
+    break;
+  }
+  fprintf(stderr, "Guest fault: %s at pc %x accessing %x after %ld instructions\n",
+          reason, stats->fault_pc, stats->fault_addr, stats->insns);
+}
+
+// Helper function, adds the event counters of one run to the totals
+void add_event_counts(struct Stat* total, const struct Stat* run)
+{
+  total->insns += run->insns;
+  for (int op = 0; op < NUM_OPS; ++op)
+    total->op_counts[op] += run->op_counts[op];
+  for (int i = 0; i < SIM_SYSCALL_SLOTS; ++i)
+    total->syscalls[i] += run->syscalls[i];
+  total->branches_taken += run->branches_taken;
+  total->bytes_loaded += run->bytes_loaded;
+  total->bytes_stored += run->bytes_stored;
+}
+
+// Names for the event counts, with branches split into taken and not taken
+static const char* class_names[NUM_CLASSES + 1] = {
+  "illegal", "alu", "mul_div", "load", "store", "branch_taken", "jal", "jalr", "ecall", "branch_not_taken"
+};
+
+// Helper function, sums operation counts per class (index NUM_CLASSES is untaken branches)
+void count_classes(const struct Stat* counts, long classes[NUM_CLASSES + 1])
+{
+  for (int i = 0; i <= NUM_CLASSES; ++i)
+    classes[i] = 0;
+  for (int op = 0; op < NUM_OPS; ++op)
+    classes[decode_table[op].cls] += counts->op_counts[op];
+  classes[NUM_CLASSES] = classes[CLASS_BRANCH] - counts->branches_taken;
+  classes[CLASS_BRANCH] = counts->branches_taken;
+}
+
+static const char* syscall_name(int number)
+{
+  switch (number)
+  {
+  case 1: return "getchar";
+  case 2: return "putchar";
+  case 3: case 93: return "exit";
+  case SIM_SYSCALL_SLOTS - 1: return "other";
+  default: return "unknown";
+  }
+}
+
+// Helper function, prints the instruction mix, memory traffic and syscalls
+void print_event_counts(FILE* out, const struct Stat* counts)
+{
+  long classes[NUM_CLASSES + 1];
+  count_classes(counts, classes);
+  double percent = counts->insns ? 100.0 / counts->insns : 0.0;
+  fprintf(out, "Instruction mix:");
+  for (int i = CLASS_ALU; i <= NUM_CLASSES; ++i)
+    fprintf(out, " %s %ld (%.1f%%)%s", class_names[i], classes[i], percent * classes[i], i < NUM_CLASSES ? "," : "\n");
+  if (classes[CLASS_NONE])
+    fprintf(out, "Illegal instructions: %ld\n", classes[CLASS_NONE]);
+  fprintf(out, "Memory: %ld bytes loaded, %ld bytes stored\n", counts->bytes_loaded, counts->bytes_stored);
+  fprintf(out, "Syscalls:");
+  const char* separator = " ";
+  for (int i = 0; i < SIM_SYSCALL_SLOTS; ++i)
+  {
+    if (counts->syscalls[i])
+    {
+      fprintf(out, "%s%d (%s) %ld", separator, i, syscall_name(i), counts->syscalls[i]);
+      separator = ", ";
+    }
+  }
+  fprintf(out, "\nOperations:");
+  // most executed first
+  int order[NUM_OPS];
+  int n = 0;
+  for (int op = 0; op < NUM_OPS; ++op)
+  {
+    int at = n++;
+    while (at > 0 && counts->op_counts[order[at - 1]] < counts->op_counts[op])
+    {
+      order[at] = order[at - 1];
+      at--;
+    }
+    order[at] = op;
+  }
+  for (int i = 0; i < n && counts->op_counts[order[i]]; ++i)
+    fprintf(out, "%s %s %ld", i % 8 ? "," : "\n ", decode_table[order[i]].mnemonic, counts->op_counts[order[i]]);
+  fprintf(out, "\n");
+}
+
+// Helper function, writes the event counts as a JSON object
+void write_stats_json(FILE* out, const struct Stat* counts, int ticks, int faults)
+{
+  long classes[NUM_CLASSES + 1];
+  count_classes(counts, classes);
+  fprintf(out, "{\n  \"instructions\": %ld,\n  \"host_ticks\": %d,\n  \"faults\": %d,\n", counts->insns, ticks, faults);
+  fprintf(out, "  \"classes\": {");
+  for (int i = 0; i <= NUM_CLASSES; ++i)
+    fprintf(out, "%s\"%s\": %ld", i ? ", " : "", class_names[i], classes[i]);
+  fprintf(out, "},\n  \"bytes_loaded\": %ld,\n  \"bytes_stored\": %ld,\n", counts->bytes_loaded, counts->bytes_stored);
+  fprintf(out, "  \"syscalls\": {");
+  const char* separator = "";
+  for (int i = 0; i < SIM_SYSCALL_SLOTS; ++i)
+  {
+    if (counts->syscalls[i])
+    {
+      if (i == SIM_SYSCALL_SLOTS - 1)
+        fprintf(out, "%s\"other\": %ld", separator, counts->syscalls[i]);
+      else
+        fprintf(out, "%s\"%d\": %ld", separator, i, counts->syscalls[i]);
+      separator = ", ";
+    }
+  }
+  fprintf(out, "},\n  \"operations\": {");
+  separator = "";
+  for (int op = 1; op < NUM_OPS; ++op)
+  {
+    if (counts->op_counts[op])
+    {
+      fprintf(out, "%s\"%s\": %ld", separator, decode_table[op].mnemonic, counts->op_counts[op]);
+      separator = ", ";
+    }
+  }
+  fprintf(out, "}\n}\n");
+}
+
+// Helper function, runs the guest up to a symbol and saves an image of it there
+int make_image(const char* file_name, const char* symbol, struct memory* mem, struct cpu_state* cpu,
+               struct program_info* prog_info, const struct decode_cache* predecoded, FILE* log_file,
+               struct symbols* symbols)
+{
+  unsigned int stop_pc;
+  if (symbols_sym_to_value(symbols, symbol, &stop_pc))
+  {
+    fprintf(stderr, "No symbol %s for the image\n", symbol);
+    return -1;
+  }
+  struct Stat stats = simulate_to(mem, cpu, stop_pc, predecoded, NULL, log_file, symbols);
+  if (stats.fault)
+  {
+    report_fault(&stats, cpu);
+    return 2;
+  }
+  if (cpu->pc != stop_pc)
+  {
+    fprintf(stderr, "Program exited before reaching %s\n", symbol);
+    return -1;
+  }
+  if (image_write(file_name, mem, cpu, prog_info))
+  {
+    fprintf(stderr, "Could not write image %s\n", file_name);
+    return -1;
+  }
+  printf("Wrote image %s at %s (pc %x) after %ld instructions\n", file_name, symbol, cpu->pc, stats.insns);
+  return 0;
+}
+
+// Helper function, terminates if the program arguments did not fit in guest memory
+void check_arguments_fault(struct memory* mem)
+{
+  switch (memory_get_fault(mem, NULL))
+  {
+  case MEM_FAULT_NONE:
+    return;
+  case MEM_FAULT_LIMIT:
+    terminate("--mem-limit too small for the program arguments, terminating.");
+    break;
+  default:
+    terminate("Not enough host memory for program arguments, terminating.");
+  }
+}
+
+// Helper function, prints resident guest pages, summed over instances
+void print_page_stats(FILE* out, struct memory** guests, int instances)
+{
+  struct memory_usage usage;
+  long resident = 0;
+  long high_water = 0;
+  for (int instance = 0; instance < instances; ++instance)
+  {
+    memory_get_usage(guests[instance], &usage);
+    resident += usage.resident_pages;
+    if (usage.high_water_pages > high_water)
+      high_water = usage.high_water_pages;
+  }
+  fprintf(out, "Guest pages: %ld resident, high-water %ld", resident, high_water);
+  if (usage.limit_pages)
+    fprintf(out, ", limit %ld", usage.limit_pages);
+  fprintf(out, " (%u bytes each)\n", usage.page_size);
+}
+
+// Helper function, prints how many pages the instances share with the loaded program
+void print_instance_stats(FILE* out, struct memory* template, struct memory** guests, int instances)
+{
+  struct memory_usage usage;
+  memory_get_usage(template, &usage);
+  long template_pages = usage.pages;
+  long private_pages = 0;
+  long shared_pages = 0;
+  for (int instance = 0; instance < instances; ++instance)
+  {
+    memory_get_usage(guests[instance], &usage);
+    private_pages += usage.pages - usage.shared_pages;
+    shared_pages += usage.shared_pages;
+  }
+  fprintf(out, "Instances: %d cloned from %ld loaded pages, %ld private pages (%ld KiB), %ld shared page mappings (%ld KiB saved)\n",
+          instances, template_pages, private_pages, (private_pages * usage.page_size) >> 10,
+          shared_pages, (shared_pages * usage.page_size) >> 10);
+}
+
+// Helper function, prints how much of guest memory ended up in huge pages
+void print_huge_page_stats(FILE* out, struct memory* mem)
+{
+  struct memory_usage usage;
+  memory_get_usage(mem, &usage);
+  long chunk_bytes = usage.huge_chunks * 0x200000;
+  fprintf(out, "Huge pages: %ld chunks of 2 MiB (%ld hugetlb), %ld of %ld KiB backed by huge pages (%.1f%%)\n",
+          usage.huge_chunks, usage.hugetlb_chunks, usage.huge_bytes >> 10, chunk_bytes >> 10,
+          chunk_bytes ? 100.0 * usage.huge_bytes / chunk_bytes : 0.0);
+}
+
 int main(int argc, char *argv[])
 {
-  struct memory *mem = memory_create();
-  argc = pass_args_to_program(mem, argc, argv);
-  if (argc == 2 || argc == 3 || argc == 4)
+  if (argc < 2 || !strcmp(argv[1], "--"))
   {
-    FILE *log_file = NULL;
-    FILE *prof_file = NULL;
-    if (argc == 4 && !strcmp(argv[2], "-l"))
+    terminate("Missing operands");
+  }
+  FILE *log_file = NULL;
+  FILE *prof_file = NULL;
+  FILE *folded_file = NULL;
+  long sample_interval = 1000;
+  int event_counts = 0;
+  FILE *json_file = NULL;
+  struct cache_config cache_configs[3];   // l1i, l1d, l2
+  int use_cache[3] = { 0, 0, 0 };
+  FILE *mrc_file = NULL;
+  unsigned mrc_line = 64;
+  struct bpred_config bpred_config;
+  int use_bpred = 0;
+  int use_pipeline = 0;
+  struct ooo_config ooo_config;
+  int use_ooo = 0;
+  int use_ilp = 0;
+  struct timing_latencies latencies;
+  timing_default_latencies(&latencies);
+  const char *summary_name = NULL;
+  int disassemble_only = 0;
+  int mem_stats = 0;
+  int huge_pages = 0;
+  int repeat = 1;
+  int instances = 1;
+  unsigned mem_limit = 0;
+  const char *watch_args[argc];
+  int num_watches = 0;
+  int strict_align = 0;
+  int lazy_load = 0;
+  const char *image_name = NULL;
+  const char *make_image_name = NULL;
+  const char *image_symbol = "main";
+  unsigned page_size = MEMORY_DEFAULT_PAGE_SIZE;
+  for (int i = 2; i < argc && strcmp(argv[i], "--"); ++i)
+  {
+    int has_value = i + 1 < argc && strcmp(argv[i + 1], "--");
+    if (!strcmp(argv[i], "-d"))
+    {
+      disassemble_only = 1;
+    }
+    else if (!strcmp(argv[i], "-l") && has_value)
     {
-      log_file = fopen(argv[3], "w");
+      log_file = fopen(argv[++i], "w");
       if (log_file == NULL)
       {
         terminate("Could not open logfile, terminating.");
       }
     }
-    if (argc == 4 && !strcmp(argv[2], "-p"))
+    else if (!strcmp(argv[i], "-s") && has_value)
     {
-      prof_file = fopen(argv[3], "w");
+      summary_name = argv[++i];
+    }
+    else if (!strcmp(argv[i], "-p") && has_value)
+    {
+      prof_file = fopen(argv[++i], "w");
       if (prof_file == NULL)
       {
         terminate("Could not open file for exec profile, terminating.");
       }
     }
-    struct program_info prog_info;
-    int status = read_elf(mem, &prog_info, argv[1], log_file);
-    if (status) exit(status);
-    struct symbols* symbols = symbols_read_from_elf(argv[1]);
-    if (symbols == NULL) {
-      exit(-1);
+    else if (!strcmp(argv[i], "--folded") && has_value)
+    {
+      folded_file = fopen(argv[++i], "w");
+      if (folded_file == NULL)
+      {
+        terminate("Could not open file for folded stacks, terminating.");
+      }
     }
-    if (argc == 3 && !strcmp(argv[2], "-d")) {
-      // disassemble text segment to stdout
-      disassemble_to_stdout(mem, &prog_info, symbols);
-      exit(0);
-    }
-    int start_addr = prog_info.start;
-    clock_t before = clock();
-    struct Stat stats = simulate(mem, start_addr, log_file, symbols);
-    long int num_insns = stats.insns;
-    clock_t after = clock();
-    int ticks = after - before;
-    double mips = (1.0 * num_insns * CLOCKS_PER_SEC) / ticks / 1000000;
-    if (argc == 4 && !strcmp(argv[2], "-s"))
-    {
-      log_file = fopen(argv[3], "w");
-      if (log_file == NULL)
+    else if (!strcmp(argv[i], "--sample-interval") && has_value)
+    {
+      sample_interval = atol(argv[++i]);
+      if (sample_interval < 1)
       {
-        terminate("Could not open logfile, terminating.");
+        terminate("Invalid sample interval, terminating.");
+      }
+    }
+    else if (!strcmp(argv[i], "--stats"))
+    {
+      event_counts = 1;
+    }
+    else if (!strcmp(argv[i], "--stats-json") && has_value)
+    {
+      json_file = fopen(argv[++i], "w");
+      if (json_file == NULL)
+      {
+        terminate("Could not open file for statistics, terminating.");
+      }
+    }
+    else if (!strcmp(argv[i], "--cache") && has_value)
+    {
+      const char *arg = argv[++i];
+      int level = !strncmp(arg, "l1i=", 4) ? 0 : !strncmp(arg, "l1d=", 4) ? 1 : !strncmp(arg, "l2=", 3) ? 2 : -1;
+      if (level < 0 || cache_parse_config(strchr(arg, '=') + 1, &cache_configs[level]))
+      {
+        terminate("Invalid cache configuration, terminating.");
+      }
+      use_cache[level] = 1;
+    }
+    else if (!strcmp(argv[i], "--mrc") && has_value)
+    {
+      mrc_file = fopen(argv[++i], "w");
+      if (mrc_file == NULL)
+      {
+        terminate("Could not open file for miss ratio curves, terminating.");
+      }
+    }
+    else if (!strcmp(argv[i], "--mrc-line") && has_value)
+    {
+      mrc_line = parse_size(argv[++i]);
+      if (mrc_line < 4 || (mrc_line & (mrc_line - 1)))
+      {
+        terminate("Invalid line size, terminating.");
+      }
+    }
+    else if (!strcmp(argv[i], "--bpred") && has_value)
+    {
+      if (bpred_parse_config(argv[++i], &bpred_config))
+      {
+        terminate("Invalid branch predictor, terminating.");
       }
+      use_bpred = 1;
+    }
+    else if (!strcmp(argv[i], "--pipeline"))
+    {
+      use_pipeline = 1;
+    }
+    else if (!strcmp(argv[i], "--ooo") && has_value)
+    {
+      if (ooo_parse_config(argv[++i], &ooo_config))
+      {
+        terminate("Invalid out-of-order core, terminating.");
+      }
+      use_ooo = 1;
+    }
+    else if (!strcmp(argv[i], "--ilp"))
+    {
+      use_ilp = 1;
+    }
+    else if (!strcmp(argv[i], "--latencies") && has_value)
+    {
+      if (timing_parse_latencies(argv[++i], &latencies))
+      {
+        terminate("Invalid latencies, terminating.");
+      }
+    }
+    else if (!strcmp(argv[i], "--page-size") && has_value)
+    {
+      page_size = parse_size(argv[++i]);
     }
-    if (log_file)
+    else if (!strcmp(argv[i], "-w") && has_value)
     {
-      fprintf(log_file, "\nSimulated %ld instructions in %d host ticks (%f MIPS)\n", num_insns, ticks, mips);
-      fclose(log_file);
+      watch_args[num_watches++] = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--mem-limit") && has_value)
+    {
+      mem_limit = parse_size(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--strict-align"))
+    {
+      strict_align = 1;
+    }
+    else if (!strcmp(argv[i], "--make-image") && has_value)
+    {
+      make_image_name = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--image-symbol") && has_value)
+    {
+      image_symbol = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--image"))
+    {
+      image_name = argv[1];
+    }
+    else if (!strcmp(argv[i], "--lazy"))
+    {
+      lazy_load = 1;
+    }
+    else if (!strcmp(argv[i], "--mem-stats"))
+    {
+      mem_stats = 1;
+    }
+    else if (!strcmp(argv[i], "--hugepages"))
+    {
+      huge_pages = 1;
+    }
+    else if (!strcmp(argv[i], "--instances") && has_value)
+    {
+      instances = atoi(argv[++i]);
+      if (instances < 1)
+      {
+        terminate("Invalid instance count, terminating.");
+      }
+    }
+    else if (!strcmp(argv[i], "--repeat") && has_value)
+    {
+      repeat = atoi(argv[++i]);
+      if (repeat < 1)
+      {
+        terminate("Invalid repeat count, terminating.");
+      }
     }
     else
     {
-      printf("\nSimulated %ld instructions in %d host ticks (%f MIPS)\n", num_insns, ticks, mips);
+      terminate("Unknown or incomplete simulator option");
     }
-    memory_delete(mem);
   }
-  else {
-    terminate("Missing operands");
+  struct image *image = NULL;
+  if (image_name)
+  {
+    image = image_open(image_name);
+    if (image == NULL)
+    {
+      return -1;
+    }
+    page_size = image_page_size(image);
+  }
+  struct memory *mem = memory_create_with_page_size(page_size);
+  if (mem == NULL)
+  {
+    terminate("Unsupported page size, terminating.");
+  }
+  if (huge_pages)
+  {
+    memory_use_huge_pages(mem);
+  }
+  if (mem_limit)
+  {
+    memory_set_limit(mem, (mem_limit + page_size - 1) / page_size);
+  }
+  memory_set_strict_alignment(mem, strict_align);
+  for (int i = 0; i < num_watches; ++i)
+  {
+    add_watchpoint(mem, watch_args[i]);
+  }
+  struct devices *devices = devices_attach(mem);
+  if (devices == NULL)
+  {
+    terminate("Could not map devices, terminating.");
+  }
+  struct program_info prog_info;
+  struct cpu_state start_cpu;
+  struct symbols* symbols = NULL;
+  if (image)
+  {
+    if (image_load(image, mem, &start_cpu, &prog_info))
+    {
+      return -1;
+    }
+    // the image stops at main(argc, argv): replace the arguments it was made with
+    memory_wr_w(mem, 0x1000000, 0);
+    pass_args_to_program(mem, argc, argv);
+    check_arguments_fault(mem);
+    start_cpu.regs[10] = memory_rd_w(mem, 0x1000000);
+    start_cpu.regs[11] = 0x1000004;
+  }
+  else
+  {
+    pass_args_to_program(mem, argc, argv);
+    check_arguments_fault(mem);
+    struct elf_file* elf = elf_open(argv[1]);
+    if (elf)
+    {
+      if (elf_load(elf, mem, &prog_info, lazy_load) == 0)
+      {
+        symbols = symbols_read_from_elf(elf);
+      }
+      // the symbol table keeps the mapping that lazy pages are filled from
+      elf_close(elf);
+    }
+    if (symbols == NULL)
+    {
+      return -1;
+    }
+    cpu_init(&start_cpu, prog_info.start);
+  }
+  // decode the text segment up front, except when that would load every lazy page
+  struct decode_cache *predecoded = NULL;
+  if (!lazy_load && !disassemble_only)
+  {
+    predecoded = simulate_predecode(mem, prog_info.text_start, prog_info.text_end);
+  }
+  if (disassemble_only || make_image_name)
+  {
+    int status = 0;
+    if (disassemble_only)
+    {
+      // disassemble text segment to stdout
+      disassemble_to_stdout(mem, &prog_info, symbols);
+    }
+    else
+    {
+      status = make_image(make_image_name, image_symbol, mem, &start_cpu, &prog_info, predecoded, log_file, symbols);
+    }
+    if (predecoded)
+    {
+      decode_cache_delete(predecoded);
+    }
     memory_delete(mem);
+    if (symbols)
+    {
+      symbols_delete(symbols);
+    }
+    if (image)
+    {
+      image_close(image);
+    }
+    devices_delete(devices);
+    return status;
+  }
+  struct memory **guests = malloc(instances * sizeof(struct memory *));
+  if (guests == NULL)
+  {
+    terminate("Out of memory for instances, terminating.");
+  }
+  // -p: count executions of each instruction and calls between functions,
+  // --folded: sample the call stack, --stats: count instructions by kind,
+  // --cache: feed fetches and data accesses to caches, --mrc: measure
+  // their stack distances, --bpred: predict branches and jumps, --pipeline
+  // and --ooo: count cycles, --ilp: find the dataflow limit, all over all
+  // instances and runs
+  struct sim_tools tools;
+  memset(&tools, 0, sizeof(tools));
+  tools.count_events = event_counts || json_file;
+  if (prof_file)
+  {
+    tools.profile = profile_create(prog_info.text_start, prog_info.text_end);
+    if (tools.profile == NULL)
+    {
+      terminate("Out of memory for the profile, terminating.");
+    }
+  }
+  if (prof_file || folded_file)
+  {
+    tools.callgraph = callgraph_create(prog_info.text_start, prog_info.text_end, symbols);
+    if (tools.callgraph == NULL)
+    {
+      terminate("Out of memory for the profile, terminating.");
+    }
+  }
+  if (use_cache[0] || use_cache[1] || use_cache[2])
+  {
+    tools.caches = caches_create(use_cache[0] ? &cache_configs[0] : NULL, use_cache[1] ? &cache_configs[1] : NULL,
+                                 use_cache[2] ? &cache_configs[2] : NULL, prog_info.text_start, prog_info.text_end);
+    if (tools.caches == NULL)
+    {
+      terminate("Out of memory for the caches, terminating.");
+    }
+  }
+  if (mrc_file)
+  {
+    tools.fetch_distances = stackdist_create(mrc_line);
+    tools.data_distances = stackdist_create(mrc_line);
+    if (tools.fetch_distances == NULL || tools.data_distances == NULL)
+    {
+      terminate("Out of memory for stack distances, terminating.");
+    }
+  }
+  if (use_bpred)
+  {
+    tools.bpred = bpred_create(&bpred_config, prog_info.text_start, prog_info.text_end);
+    if (tools.bpred == NULL)
+    {
+      terminate("Out of memory for the branch predictor, terminating.");
+    }
+  }
+  if (use_pipeline)
+  {
+    tools.pipeline = pipeline_create(&latencies, use_bpred, prog_info.text_start, prog_info.text_end);
+    if (tools.pipeline == NULL)
+    {
+      terminate("Out of memory for the pipeline model, terminating.");
+    }
+  }
+  if (use_ooo)
+  {
+    tools.ooo = ooo_create(&ooo_config, &latencies, prog_info.text_start, prog_info.text_end);
+    if (tools.ooo == NULL)
+    {
+      terminate("Out of memory for the out-of-order model, terminating.");
+    }
+  }
+  if (use_ilp)
+  {
+    tools.ilp = ilp_create(&latencies);
+    if (tools.ilp == NULL)
+    {
+      terminate("Out of memory for the dataflow analysis, terminating.");
+    }
+  }
+  if (folded_file)
+  {
+    tools.sample_interval = sample_interval;
+    tools.sample_countdown = sample_interval;
+  }
+  long int num_insns = 0;
+  long int restored_pages = 0;
+  int faults = 0;
+  long int misaligned = 0;
+  struct Stat events = {0};
+  clock_t before = clock();
+  for (int instance = 0; instance < instances; ++instance)
+  {
+    // with several instances each one is a copy-on-write clone of the loaded program
+    struct memory *guest = instances > 1 ? memory_clone(mem) : mem;
+    if (guest == NULL)
+    {
+      terminate("Could not clone guest memory, terminating.");
+    }
+    guests[instance] = guest;
+    struct cpu_state cpu, baseline;
+    cpu = start_cpu;
+    if (repeat > 1 && simulate_snapshot(guest, &cpu, &baseline))
+    {
+      fprintf(stderr, "Out of host memory for snapshot, running each program once\n");
+      repeat = 1;
+    }
+    for (int run = 0; run < repeat; ++run)
+    {
+      if (run > 0)
+      {
+        restored_pages += simulate_reset(guest, &cpu, &baseline);
+      }
+      int measure = tools.callgraph || tools.count_events || tools.caches || mrc_file || use_bpred || use_pipeline || use_ooo || use_ilp;
+      struct Stat stats = simulate(guest, &cpu, predecoded, measure ? &tools : NULL, log_file, symbols);
+      num_insns += stats.insns;
+      misaligned += stats.misaligned;
+      add_event_counts(&events, &stats);
+      if (stats.fault)
+      {
+        report_fault(&stats, &cpu);
+        faults++;
+      }
+    }
+  }
+  clock_t after = clock();
+  int ticks = after - before;
+  double mips = (1.0 * num_insns * CLOCKS_PER_SEC) / ticks / 1000000;
+  if (summary_name)
+  {
+    log_file = fopen(summary_name, "w");
+    if (log_file == NULL)
+    {
+      terminate("Could not open logfile, terminating.");
+    }
+  }
+  FILE *summary_file = log_file ? log_file : stdout;
+  fprintf(summary_file, "\nSimulated %ld instructions in %d host ticks (%f MIPS)\n", num_insns, ticks, mips);
+  if (mem_stats || mem_limit)
+  {
+    print_page_stats(summary_file, guests, instances);
+  }
+  if (misaligned)
+  {
+    fprintf(summary_file, "Misaligned accesses: %ld\n", misaligned);
+  }
+  if (repeat > 1)
+  {
+    fprintf(summary_file, "Ran %d times, restored %ld dirty pages between runs\n", repeat, restored_pages);
+  }
+  if (instances > 1)
+  {
+    print_instance_stats(summary_file, mem, guests, instances);
+  }
+  if (event_counts)
+  {
+    print_event_counts(summary_file, &events);
+  }
+  if (json_file)
+  {
+    write_stats_json(json_file, &events, ticks, faults);
+    fclose(json_file);
+  }
+  if (tools.caches)
+  {
+    caches_report(tools.caches, summary_file, symbols);
+    caches_delete(tools.caches);
+  }
+  if (tools.pipeline)
+  {
+    pipeline_report(tools.pipeline, summary_file, symbols);
+    pipeline_delete(tools.pipeline);
+  }
+  if (tools.ooo)
+  {
+    ooo_report(tools.ooo, summary_file, symbols);
+    ooo_delete(tools.ooo);
+  }
+  if (tools.ilp)
+  {
+    ilp_report(tools.ilp, summary_file);
+    ilp_delete(tools.ilp);
+  }
+  if (tools.bpred)
+  {
+    bpred_report(tools.bpred, summary_file, symbols, num_insns);
+    bpred_delete(tools.bpred);
+  }
+  if (mrc_file)
+  {
+    stackdist_report(tools.fetch_distances, "instruction fetches", mrc_file);
+    fprintf(mrc_file, "\n");
+    stackdist_report(tools.data_distances, "data accesses", mrc_file);
+    stackdist_delete(tools.fetch_distances);
+    stackdist_delete(tools.data_distances);
+    fclose(mrc_file);
+  }
+  if (mem_stats)
+  {
+    print_memory_stats(summary_file, mem);
+  }
+  if (huge_pages)
+  {
+    print_huge_page_stats(summary_file, mem);
+  }
+  if (log_file)
+  {
+    fclose(log_file);
+  }
+  if (prof_file)
+  {
+    profile_report(tools.profile, prof_file, mem, symbols);
+    callgraph_report(tools.callgraph, tools.profile, prof_file);
+    profile_delete(tools.profile);
+    fclose(prof_file);
+  }
+  if (folded_file)
+  {
+    callgraph_write_folded(tools.callgraph, folded_file);
+    fclose(folded_file);
+  }
+  if (tools.callgraph)
+  {
+    callgraph_delete(tools.callgraph);
+  }
+  if (instances > 1)
+  {
+    for (int instance = 0; instance < instances; ++instance)
+    {
+      memory_delete(guests[instance]);
+    }
+  }
+  free(guests);
+  if (predecoded)
+  {
+    decode_cache_delete(predecoded);
+  }
+  memory_delete(mem);
+  if (symbols)
+  {
+    symbols_delete(symbols);
+  }
+  if (image)
+  {
+    image_close(image);
   }
+  devices_delete(devices);
+  return faults ? 2 : 0;
 }
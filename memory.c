@@ -1,128 +1,1194 @@
 #include "memory.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0
+#endif
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 0
+#endif
+
+// Guest memory is a two-level radix table. The top 10 address bits select a
+// secondary table in 'dir', the next (22 - page_bits) bits select a page in
+// that table, and the low page_bits bits are the offset within the page.
+// Pages and secondary tables are allocated on first use.
+// Words and halfwords are accessed with memcpy, assuming a little-endian host.
+#define DIR_BITS 10
+#define DIR_SHIFT (32 - DIR_BITS)
+
+// With huge pages enabled, guest pages are carved out of 2 MiB chunks that are
+// either explicit hugetlb pages or anonymous mappings advised MADV_HUGEPAGE.
+#define HUGE_SIZE 0x200000
+
+struct huge_chunk
+{
+  unsigned char *base;
+  int hugetlb;
+  struct huge_chunk *next;
+};
+
+// A page table entry. Loads and stores use 'rd' and 'wr' directly when they
+// are set; a NULL pointer sends the access through the slow path, which
+// allocates the page and handles dirty tracking and copy-on-write.
+// Page contents shared between a template and its clones carry a reference
+// count in 'refs'; the first store through any of them makes a private copy.
+#define PAGE_DIRTY 1
+#define PAGE_CHUNK 2    // data lives in a huge page chunk, never free()d
+#define PAGE_DEVICE 4   // accesses go to the mmio regions, never has data
+#define PAGE_WATCH 8    // holds a watchpoint, stores always take the slow path
+#define PAGE_BACKED 16  // contents start out as a copy of backing data
+#define PAGE_EXTERNAL 32 // data belongs to the caller (memory_adopt_page), never free()d
+#define PAGE_CHARGED 64 // data is counted in this memory's 'resident'
+
+struct page
+{
+  unsigned char *rd;    // fast path for loads
+  unsigned char *wr;    // fast path for stores
+  unsigned char *data;  // page contents, NULL until allocated
+  unsigned char *base;  // contents at the last snapshot, NULL if all zero
+  long *refs;           // sharers of 'data', NULL if private
+  unsigned flags;
+};
+
+struct mmio_region
+{
+  unsigned base;
+  unsigned size;
+  const struct mmio_ops *ops;
+  void *ctx;
+  struct mmio_region *next;
+};
+
+// Host data that pages in [addr, addr+len) are filled from when they are
+// first used, instead of being copied in up front
+struct backing
+{
+  unsigned addr;
+  unsigned len;
+  const unsigned char *data;
+  struct backing *next;
+};
+
+struct watchpoint
+{
+  unsigned addr;
+  unsigned len;
+  unsigned old_value;       // during memory_write_bytes, for its report
+  struct watchpoint *next;
+};
 
 struct memory
 {
-  int *pages[0x10000];
+  int page_bits;
+  unsigned offset_mask;     // address bits within a page
+  unsigned table_mask;      // index into a secondary table (after shift)
+  long pages;               // number of allocated pages
+  long tables;              // number of allocated secondary tables
+  int huge;                 // pages are carved from huge page chunks
+  int no_hugetlb;           // hugetlb was tried and failed
+  struct huge_chunk *chunks;
+  unsigned chunk_used;      // bytes used in the newest chunk
+  int tracking;             // a snapshot exists; stores mark pages dirty
+  long snapshot_pages;      // pages with a private baseline copy
+  struct page **dirty;      // pages written since the snapshot
+  long num_dirty;
+  long max_dirty;
+  long resident;            // pages allocated by this memory (not shared ones)
+  long high_water;          // maximum of resident
+  long limit;               // maximum of resident, 0 for no limit
+  jmp_buf *trap;            // where to go on a fault, NULL to drop the access
+  int strict_alignment;     // fault on misaligned accesses instead of emulating them
+  long misaligned;          // misaligned accesses emulated so far
+  enum mem_fault fault;
+  unsigned fault_addr;
+  struct mmio_region *regions;
+  struct backing *backings;
+  struct watchpoint *watchpoints;
+  memory_watch_fn watch_fn;
+  void *watch_ctx;
+  long users;               // this memory plus clones that may use its chunks
+  struct memory *template;  // memory this one was cloned from
+  struct page *dir[1 << DIR_BITS];
 };
 
+struct memory *memory_create_with_page_size(unsigned page_size)
+{
+  int page_bits = 0;
+  while ((1u << page_bits) < page_size && page_bits < DIR_SHIFT)
+    ++page_bits;
+  if ((1u << page_bits) != page_size || page_bits < MEMORY_MIN_PAGE_BITS || page_bits > MEMORY_MAX_PAGE_BITS)
+    return NULL;
+  struct memory *mem = calloc(sizeof(struct memory), 1);
+  if (mem == NULL)
+    return NULL;
+  mem->page_bits = page_bits;
+  mem->offset_mask = page_size - 1;
+  mem->table_mask = (1u << (DIR_SHIFT - page_bits)) - 1;
+  mem->users = 1;
+  return mem;
+}
+
 struct memory *memory_create()
 {
-  return calloc(sizeof(struct memory), 1);
+  return memory_create_with_page_size(MEMORY_DEFAULT_PAGE_SIZE);
 }
 
-void memory_delete(struct memory *mem)
+// Drop one reference to page contents, freeing them with the last one
+static void release_data(struct page *page)
 {
-  for (int j = 0; j < 0x10000; ++j)
+  if (page->refs)
   {
-    if (mem->pages[j])
-      free(mem->pages[j]);
+    if (__atomic_sub_fetch(page->refs, 1, __ATOMIC_ACQ_REL))
+      return;
+    free(page->refs);
   }
+  if (!(page->flags & (PAGE_CHUNK | PAGE_EXTERNAL)))
+    free(page->data);
+}
+
+// The memory struct and its huge page chunks outlive memory_delete() while
+// clones may still point into the chunks
+static void release_memory(struct memory *mem)
+{
+  if (__atomic_sub_fetch(&mem->users, 1, __ATOMIC_ACQ_REL))
+    return;
+  while (mem->chunks)
+  {
+    struct huge_chunk *chunk = mem->chunks;
+    mem->chunks = chunk->next;
+    munmap(chunk->base, HUGE_SIZE);
+    free(chunk);
+  }
+  if (mem->template)
+    release_memory(mem->template);
   free(mem);
 }
 
-int *get_page(struct memory *mem, int addr)
+void memory_delete(struct memory *mem)
 {
-  int page_number = (addr >> 16) & 0x0ffff;
-  if (mem->pages[page_number] == NULL)
+  for (int i = 0; i < (1 << DIR_BITS); ++i)
+  {
+    struct page *table = mem->dir[i];
+    if (table == NULL)
+      continue;
+    for (unsigned j = 0; j <= mem->table_mask; ++j)
+    {
+      if (table[j].data)
+        release_data(&table[j]);
+      free(table[j].base);
+    }
+    free(table);
+    mem->dir[i] = NULL;
+  }
+  free(mem->dirty);
+  mem->dirty = NULL;
+  while (mem->regions)
+  {
+    struct mmio_region *region = mem->regions;
+    mem->regions = region->next;
+    free(region);
+  }
+  while (mem->backings)
+  {
+    struct backing *backing = mem->backings;
+    mem->backings = backing->next;
+    free(backing);
+  }
+  while (mem->watchpoints)
   {
-    mem->pages[page_number] = calloc(65536, 1);
+    struct watchpoint *watch = mem->watchpoints;
+    mem->watchpoints = watch->next;
+    free(watch);
   }
-  return mem->pages[page_number];
+  release_memory(mem);
 }
 
-void memory_wr_w(struct memory *mem, int addr, int data)
+struct memory *memory_clone(struct memory *template)
 {
-  if (addr & 0x3)
+  struct memory *clone = memory_create_with_page_size(template->offset_mask + 1);
+  if (clone == NULL)
+    return NULL;
+  clone->huge = template->huge;
+  clone->no_hugetlb = template->no_hugetlb;
+  clone->chunk_used = HUGE_SIZE;
+  clone->template = template;
+  clone->limit = template->limit;
+  clone->strict_alignment = template->strict_alignment;
+  __atomic_add_fetch(&template->users, 1, __ATOMIC_ACQ_REL);
+  for (struct mmio_region *region = template->regions; region; region = region->next)
+  {
+    struct mmio_region *copy = malloc(sizeof(struct mmio_region));
+    if (copy == NULL)
+    {
+      memory_delete(clone);
+      return NULL;
+    }
+    *copy = *region;
+    copy->next = clone->regions;
+    clone->regions = copy;
+  }
+  for (struct backing *backing = template->backings; backing; backing = backing->next)
+  {
+    struct backing *copy = malloc(sizeof(struct backing));
+    if (copy == NULL)
+    {
+      memory_delete(clone);
+      return NULL;
+    }
+    *copy = *backing;
+    copy->next = clone->backings;
+    clone->backings = copy;
+  }
+  for (int i = 0; i < (1 << DIR_BITS); ++i)
   {
-    printf("Unaligned word write to %x\n", addr);
-    exit(-1);
+    struct page *table = template->dir[i];
+    if (table == NULL)
+      continue;
+    clone->dir[i] = calloc(clone->table_mask + 1, sizeof(struct page));
+    if (clone->dir[i] == NULL)
+    {
+      memory_delete(clone);
+      return NULL;
+    }
+    clone->tables++;
+    for (unsigned j = 0; j <= template->table_mask; ++j)
+    {
+      struct page *page = &table[j];
+      clone->dir[i][j].flags = page->flags & (PAGE_DEVICE | PAGE_BACKED);
+      if (page->data == NULL)
+        continue;
+      if (page->refs == NULL)
+      {
+        page->refs = malloc(sizeof(long));
+        if (page->refs == NULL)
+        {
+          memory_delete(clone);
+          return NULL;
+        }
+        *page->refs = 1;
+      }
+      __atomic_add_fetch(page->refs, 1, __ATOMIC_ACQ_REL);
+      page->wr = NULL;
+      struct page *copy = &clone->dir[i][j];
+      copy->rd = page->data;
+      copy->data = page->data;
+      copy->refs = page->refs;
+      copy->flags |= page->flags & (PAGE_CHUNK | PAGE_EXTERNAL);
+      clone->pages++;
+    }
   }
-  int *page = get_page(mem, addr);
-  page[(addr >> 2) & 0x3fff] = data;
+  for (struct watchpoint *watch = template->watchpoints; watch; watch = watch->next)
+  {
+    if (memory_add_watchpoint(clone, watch->addr, watch->len))
+    {
+      memory_delete(clone);
+      return NULL;
+    }
+  }
+  return clone;
 }
 
-void memory_wr_h(struct memory *mem, int addr, int data)
+int memory_use_huge_pages(struct memory *mem)
+{
+  if (mem->pages)
+    return -1;
+  mem->huge = 1;
+  mem->chunk_used = HUGE_SIZE;
+  return 0;
+}
+
+// Map a 2 MiB aligned chunk: explicit hugetlb first, then an aligned
+// anonymous mapping advised for THP. Without either it is plain memory.
+static struct huge_chunk *map_huge_chunk(struct memory *mem)
+{
+  struct huge_chunk *chunk = calloc(sizeof(struct huge_chunk), 1);
+  if (chunk == NULL)
+    return NULL;
+  if (!mem->no_hugetlb && MAP_HUGETLB)
+  {
+    void *p = mmap(NULL, HUGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+    {
+      chunk->base = p;
+      chunk->hugetlb = 1;
+      return chunk;
+    }
+    mem->no_hugetlb = 1;
+  }
+  unsigned char *p = mmap(NULL, 2 * HUGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+  {
+    free(chunk);
+    return NULL;
+  }
+  unsigned long skip = (HUGE_SIZE - ((unsigned long)p & (HUGE_SIZE - 1))) & (HUGE_SIZE - 1);
+  if (skip)
+    munmap(p, skip);
+  munmap(p + skip + HUGE_SIZE, HUGE_SIZE - skip);
+  chunk->base = p + skip;
+  if (MADV_HUGEPAGE)
+    madvise(chunk->base, HUGE_SIZE, MADV_HUGEPAGE);
+  return chunk;
+}
+
+static unsigned char *alloc_huge_backed(struct memory *mem)
+{
+  if (mem->chunk_used + mem->offset_mask + 1 > HUGE_SIZE)
+  {
+    struct huge_chunk *chunk = map_huge_chunk(mem);
+    if (chunk == NULL)
+      return NULL;
+    chunk->next = mem->chunks;
+    mem->chunks = chunk;
+    mem->chunk_used = 0;
+  }
+  unsigned char *page = mem->chunks->base + mem->chunk_used;
+  mem->chunk_used += mem->offset_mask + 1;
+  return page;
+}
+
+// Sum AnonHugePages over the mappings in /proc/self/smaps that overlap a chunk
+static long thp_bytes(struct memory *mem)
+{
+  FILE *smaps = fopen("/proc/self/smaps", "r");
+  if (smaps == NULL)
+    return 0;
+  char line[256];
+  unsigned long start, end;
+  long kib, total = 0;
+  int overlaps = 0;
+  while (fgets(line, sizeof(line), smaps))
+  {
+    if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+    {
+      overlaps = 0;
+      for (struct huge_chunk *chunk = mem->chunks; chunk; chunk = chunk->next)
+      {
+        unsigned long base = (unsigned long)chunk->base;
+        if (!chunk->hugetlb && base < end && base + HUGE_SIZE > start)
+          overlaps = 1;
+      }
+    }
+    else if (overlaps && sscanf(line, "AnonHugePages: %ld kB", &kib) == 1)
+      total += kib << 10;
+  }
+  fclose(smaps);
+  return total;
+}
+
+void memory_get_usage(struct memory *mem, struct memory_usage *usage)
+{
+  usage->page_size = mem->offset_mask + 1;
+  usage->pages = mem->pages;
+  usage->page_bytes = mem->pages * (long)usage->page_size;
+  usage->table_bytes = sizeof(struct memory) + mem->tables * (long)(mem->table_mask + 1) * sizeof(struct page);
+  usage->snapshot_bytes = mem->snapshot_pages * (long)usage->page_size;
+  usage->resident_pages = mem->resident;
+  usage->high_water_pages = mem->high_water;
+  usage->limit_pages = mem->limit;
+  usage->shared_pages = 0;
+  for (int i = 0; i < (1 << DIR_BITS); ++i)
+  {
+    struct page *table = mem->dir[i];
+    for (unsigned j = 0; table && j <= mem->table_mask; ++j)
+    {
+      if (table[j].refs)
+        usage->shared_pages++;
+    }
+  }
+  usage->huge_chunks = 0;
+  usage->hugetlb_chunks = 0;
+  usage->huge_bytes = 0;
+  if (!mem->huge)
+    return;
+  for (struct huge_chunk *chunk = mem->chunks; chunk; chunk = chunk->next)
+  {
+    usage->huge_chunks++;
+    usage->hugetlb_chunks += chunk->hugetlb;
+  }
+  usage->huge_bytes = usage->hugetlb_chunks * (long)HUGE_SIZE + thp_bytes(mem);
+}
+
+// Without a trap the fault is only recorded and raise_fault returns; the
+// caller then drops the access, so loads read 0 and stores are lost.
+static void raise_fault(struct memory *mem, enum mem_fault fault, unsigned addr)
 {
-  if (addr & 0x1)
+  mem->fault = fault;
+  mem->fault_addr = addr;
+  if (mem->trap)
+    longjmp(*mem->trap, fault);
+}
+
+// Allocate zeroed contents for a page, charged to this memory
+static int alloc_data(struct memory *mem, struct page *page, unsigned addr)
+{
+  if (mem->limit && mem->resident >= mem->limit)
   {
-    printf("Unaligned halfword write to %x\n", addr);
-    exit(-1);
+    raise_fault(mem, MEM_FAULT_LIMIT, addr);
+    return -1;
   }
-  int *page = get_page(mem, addr);
-  int index = (addr >> 2) & 0x3fff;
-  if ((addr & 2) == 0)
-    page[index] = (page[index] & 0xffff0000) | (data & 0x0000ffff);
+  unsigned char *data;
+  if (mem->huge)
+    data = alloc_huge_backed(mem);
   else
-    page[index] = (page[index] & 0x0000ffff) | ((unsigned)data << 16);
+    data = calloc(mem->offset_mask + 1, 1);
+  if (data == NULL)
+  {
+    raise_fault(mem, MEM_FAULT_HOST_MEMORY, addr);
+    return -1;
+  }
+  page->data = data;
+  page->flags &= ~(PAGE_CHUNK | PAGE_EXTERNAL);
+  page->flags |= PAGE_CHARGED;
+  if (mem->huge)
+    page->flags |= PAGE_CHUNK;
+  if (++mem->resident > mem->high_water)
+    mem->high_water = mem->resident;
+  return 0;
 }
 
-void memory_wr_b(struct memory *mem, int addr, int data)
+// Give a page private contents before its first store. The last sharer
+// takes over the contents and is charged for them; otherwise the memory
+// lets go of the shared contents (and their charge) for a copy.
+static int unshare_page(struct memory *mem, struct page *page, unsigned addr)
+{
+  if (__atomic_load_n(page->refs, __ATOMIC_ACQUIRE) == 1)
+  {
+    if (!(page->flags & PAGE_CHARGED))
+    {
+      if (mem->limit && mem->resident >= mem->limit)
+      {
+        raise_fault(mem, MEM_FAULT_LIMIT, addr);
+        return -1;
+      }
+      page->flags |= PAGE_CHARGED;
+      if (++mem->resident > mem->high_water)
+        mem->high_water = mem->resident;
+    }
+    free(page->refs);
+    page->refs = NULL;
+    return 0;
+  }
+  unsigned char *shared = page->data;
+  unsigned flags = page->flags;
+  if (flags & PAGE_CHARGED)
+    mem->resident--;
+  if (alloc_data(mem, page, addr))
+  {
+    if (flags & PAGE_CHARGED)
+      mem->resident++;
+    page->flags = flags;
+    return -1;
+  }
+  memcpy(page->data, shared, mem->offset_mask + 1);
+  __atomic_sub_fetch(page->refs, 1, __ATOMIC_ACQ_REL);
+  page->refs = NULL;
+  page->rd = page->data;
+  return 0;
+}
+
+// Find the page table entry for addr, allocating its secondary table.
+// NULL (after raise_fault) if the host is out of memory.
+static struct page *get_entry(struct memory *mem, unsigned addr)
 {
-  int *page = get_page(mem, addr);
-  int index = (addr >> 2) & 0x3fff;
-  switch (addr & 0x3)
+  struct page **table = &mem->dir[addr >> DIR_SHIFT];
+  if (*table == NULL)
   {
-  case 0:
-    page[index] = (page[index] & 0xffffff00) | (data & 0xff);
-    break;
-  case 1:
-    page[index] = (page[index] & 0xffff00ff) | ((data & 0xff) << 8);
-    break;
-  case 2:
-    page[index] = (page[index] & 0xff00ffff) | ((data & 0xff) << 16);
-    break;
-  case 3:
-    page[index] = (page[index] & 0x00ffffff) | (((unsigned)(data & 0xff)) << 24);
-    break;
+    *table = calloc(mem->table_mask + 1, sizeof(struct page));
+    if (*table == NULL)
+    {
+      raise_fault(mem, MEM_FAULT_HOST_MEMORY, addr);
+      return NULL;
+    }
+    mem->tables++;
   }
+  return &(*table)[(addr >> mem->page_bits) & mem->table_mask];
 }
 
-int memory_rd_w(struct memory *mem, int addr)
+// Copy the backing data that overlaps the page at page_addr into it
+static void fill_page(struct memory *mem, unsigned char *data, unsigned page_addr)
 {
-  int *page = get_page(mem, addr);
-  if (addr & 0x3)
+  unsigned size = mem->offset_mask + 1;
+  for (struct backing *backing = mem->backings; backing; backing = backing->next)
   {
-    printf("Unaligned word read from %x\n", addr);
-    exit(-1);
+    unsigned from = backing->addr > page_addr ? backing->addr : page_addr;
+    unsigned long end = (unsigned long)backing->addr + backing->len;
+    if (end > (unsigned long)page_addr + size)
+      end = (unsigned long)page_addr + size;
+    if (from < end)
+      memcpy(data + (from - page_addr), backing->data + (from - backing->addr), end - from);
   }
-  return page[(addr >> 2) & 0x3fff];
 }
 
-int memory_rd_h(struct memory *mem, int addr)
+// Find the entry for addr and make sure a RAM page has contents.
+// NULL if that faulted.
+static struct page *alloc_page(struct memory *mem, unsigned addr)
 {
-  int *page = get_page(mem, addr);
-  int index = (addr >> 2) & 0x3fff;
-  if (addr & 0x1)
+  struct page *page = get_entry(mem, addr);
+  if (page == NULL || page->data || (page->flags & PAGE_DEVICE))
+    return page;
+  // A backed page first used after a snapshot gets its initial contents as
+  // baseline, since memory_reset could not refill a huge page chunk slot
+  unsigned char *base = NULL;
+  if ((page->flags & PAGE_BACKED) && mem->tracking)
+  {
+    base = malloc(mem->offset_mask + 1);
+    if (base == NULL)
+    {
+      raise_fault(mem, MEM_FAULT_HOST_MEMORY, addr);
+      return NULL;
+    }
+  }
+  if (alloc_data(mem, page, addr))
   {
-    printf("Unaligned halfword read from %x\n", addr);
-    exit(-1);
+    free(base);
+    return NULL;
+  }
+  if (page->flags & PAGE_BACKED)
+    fill_page(mem, page->data, addr & ~mem->offset_mask);
+  if (base)
+  {
+    memcpy(base, page->data, mem->offset_mask + 1);
+    page->base = base;
+    mem->snapshot_pages++;
+  }
+  mem->pages++;
+  page->rd = page->data;
+  page->wr = mem->tracking || (page->flags & PAGE_WATCH) ? NULL : page->data;
+  return page;
+}
+
+// Contents of the page holding addr for loads, NULL for a device page or
+// after a fault. Either way read_slow ends up in device_read, and outside
+// the mmio regions that reads as 0.
+static unsigned char *readable_page(struct memory *mem, unsigned addr)
+{
+  struct page *page = alloc_page(mem, addr);
+  return page ? page->rd : NULL;
+}
+
+// Contents of the page holding addr for stores, NULL for a device page or
+// after a fault. Unshares the page and records it as dirty as needed.
+static unsigned char *writable_page(struct memory *mem, unsigned addr)
+{
+  struct page *page = alloc_page(mem, addr);
+  if (page == NULL || (page->flags & PAGE_DEVICE))
+    return NULL;
+  if (page->refs && unshare_page(mem, page, addr))
+    return NULL;
+  if (mem->tracking && !(page->flags & PAGE_DIRTY))
+  {
+    if (mem->num_dirty == mem->max_dirty)
+    {
+      long max_dirty = mem->max_dirty ? 2 * mem->max_dirty : 64;
+      struct page **dirty = realloc(mem->dirty, max_dirty * sizeof(struct page *));
+      if (dirty == NULL)
+      {
+        // an untracked store would survive memory_reset, so drop it
+        raise_fault(mem, MEM_FAULT_HOST_MEMORY, addr);
+        return NULL;
+      }
+      mem->dirty = dirty;
+      mem->max_dirty = max_dirty;
+    }
+    mem->dirty[mem->num_dirty++] = page;
+    page->flags |= PAGE_DIRTY;
+  }
+  if (!(page->flags & PAGE_WATCH))
+    page->wr = page->data;
+  return page->data;
+}
+
+static struct mmio_region *find_region(struct memory *mem, unsigned addr)
+{
+  for (struct mmio_region *region = mem->regions; region; region = region->next)
+  {
+    if (addr - region->base < region->size)
+      return region;
+  }
+  return NULL;
+}
+
+// Parts of a device page outside any region read as zero and ignore stores
+static int device_read(struct memory *mem, unsigned addr, int size)
+{
+  struct mmio_region *region = find_region(mem, addr);
+  if (region == NULL || region->ops->read == NULL)
+    return 0;
+  return region->ops->read(region->ctx, mem, addr - region->base, size);
+}
+
+static void device_write(struct memory *mem, unsigned addr, int size, int data)
+{
+  struct mmio_region *region = find_region(mem, addr);
+  if (region && region->ops->write)
+    region->ops->write(region->ctx, mem, addr - region->base, size, data);
+}
+
+static inline int load(const unsigned char *p, int size)
+{
+  if (size == 4)
+  {
+    int data;
+    memcpy(&data, p, 4);
+    return data;
+  }
+  if (size == 2)
+  {
+    unsigned short half;
+    memcpy(&half, p, 2);
+    return half;
+  }
+  return *p;
+}
+
+static inline void store(unsigned char *p, int size, int data)
+{
+  if (size == 4)
+    memcpy(p, &data, 4);
+  else if (size == 2)
+  {
+    short half = data;
+    memcpy(p, &half, 2);
   }
-  if ((addr & 2) == 0)
-    return page[index] & 0xffff;
   else
-    return (page[index] >> 16) & 0xffff;
+    *p = data;
+}
+
+// Misaligned accesses are done a byte at a time, so they work across page
+// boundaries and on device and watched pages. Strict mode faults instead.
+static int read_misaligned(struct memory *mem, unsigned addr, int size)
+{
+  if (mem->strict_alignment)
+  {
+    raise_fault(mem, MEM_FAULT_MISALIGNED, addr);
+    return 0;
+  }
+  mem->misaligned++;
+  unsigned value = 0;
+  for (int i = 0; i < size; ++i)
+    value |= (unsigned)memory_rd_b(mem, addr + i) << (8 * i);
+  return value;
+}
+
+static int read_slow(struct memory *mem, unsigned addr, int size)
+{
+  if (addr & (size - 1))
+    return read_misaligned(mem, addr, size);
+  unsigned char *data = readable_page(mem, addr);
+  if (data == NULL)
+    return device_read(mem, addr, size);
+  return load(data + (addr & mem->offset_mask), size);
+}
+
+static int watched(struct memory *mem, unsigned addr, unsigned size)
+{
+  for (struct watchpoint *watch = mem->watchpoints; watch; watch = watch->next)
+  {
+    if (addr - watch->addr < watch->len || watch->addr - addr < size)
+      return 1;
+  }
+  return 0;
+}
+
+// An aligned store, reported to the watch handler if report is set
+static void write_aligned(struct memory *mem, unsigned addr, int size, int value, int report)
+{
+  unsigned char *data = writable_page(mem, addr);
+  if (data == NULL)
+  {
+    device_write(mem, addr, size, value);
+    return;
+  }
+  unsigned char *p = data + (addr & mem->offset_mask);
+  if (!(report && mem->watch_fn && watched(mem, addr, size)))
+  {
+    store(p, size, value);
+    return;
+  }
+  unsigned old_value = load(p, size);
+  store(p, size, value);
+  mem->watch_fn(mem->watch_ctx, addr, size, old_value, load(p, size));
+}
+
+// The bytes of RAM at [addr, addr+size) as a little-endian value, with
+// device pages read as 0 rather than through their callbacks
+static unsigned peek(struct memory *mem, unsigned addr, int size)
+{
+  unsigned value = 0;
+  for (int i = 0; i < size; ++i)
+  {
+    unsigned char *data = readable_page(mem, addr + i);
+    if (data)
+      value |= (unsigned)data[(addr + i) & mem->offset_mask] << (8 * i);
+  }
+  return value;
+}
+
+// A watched misaligned store is reported once for the whole access
+static void write_misaligned(struct memory *mem, unsigned addr, int size, int value)
+{
+  if (mem->strict_alignment)
+  {
+    raise_fault(mem, MEM_FAULT_MISALIGNED, addr);
+    return;
+  }
+  mem->misaligned++;
+  int report = mem->watch_fn && watched(mem, addr, size);
+  unsigned old_value = report ? peek(mem, addr, size) : 0;
+  for (int i = 0; i < size; ++i)
+    write_aligned(mem, addr + i, 1, (unsigned)value >> (8 * i), 0);
+  if (report)
+    mem->watch_fn(mem->watch_ctx, addr, size, old_value, peek(mem, addr, size));
+}
+
+static void write_slow(struct memory *mem, unsigned addr, int size, int value)
+{
+  if (addr & (size - 1))
+    write_misaligned(mem, addr, size, value);
+  else
+    write_aligned(mem, addr, size, value, 1);
+}
+
+// Fast path lookups: NULL unless the page can be accessed directly
+static inline unsigned char *fast_read_page(struct memory *mem, unsigned addr)
+{
+  struct page *table = mem->dir[addr >> DIR_SHIFT];
+  return table ? table[(addr >> mem->page_bits) & mem->table_mask].rd : NULL;
+}
+
+static inline unsigned char *fast_write_page(struct memory *mem, unsigned addr)
+{
+  struct page *table = mem->dir[addr >> DIR_SHIFT];
+  return table ? table[(addr >> mem->page_bits) & mem->table_mask].wr : NULL;
+}
+
+static int all_zero(const unsigned char *data, unsigned size)
+{
+  for (unsigned i = 0; i < size; ++i)
+  {
+    if (data[i])
+      return 0;
+  }
+  return 1;
+}
+
+int memory_snapshot(struct memory *mem)
+{
+  unsigned size = mem->offset_mask + 1;
+  mem->snapshot_pages = 0;
+  for (int i = 0; i < (1 << DIR_BITS); ++i)
+  {
+    struct page *table = mem->dir[i];
+    if (table == NULL)
+      continue;
+    for (unsigned j = 0; j <= mem->table_mask; ++j)
+    {
+      struct page *page = &table[j];
+      if (page->data == NULL)
+        continue;
+      free(page->base);
+      page->base = NULL;
+      // backed pages always get a baseline, see alloc_page()
+      if ((page->flags & PAGE_BACKED) || !all_zero(page->data, size))
+      {
+        page->base = malloc(size);
+        if (page->base == NULL)
+        {
+          // stores are not tracked, so memory_reset has nothing to undo
+          mem->tracking = 0;
+          mem->num_dirty = 0;
+          return -1;
+        }
+        memcpy(page->base, page->data, size);
+        mem->snapshot_pages++;
+      }
+      page->flags &= ~PAGE_DIRTY;
+      page->wr = NULL;
+    }
+  }
+  mem->num_dirty = 0;
+  mem->tracking = 1;
+  return 0;
+}
+
+// Address of a page table entry, for fault reports outside an access
+static unsigned page_address(struct memory *mem, struct page *page)
+{
+  for (int i = 0; i < (1 << DIR_BITS); ++i)
+  {
+    struct page *table = mem->dir[i];
+    if (table && page >= table && page <= table + mem->table_mask)
+      return ((unsigned)i << DIR_SHIFT) | ((unsigned)(page - table) << mem->page_bits);
+  }
+  return 0;
+}
+
+// Let go of a page's contents; it comes back zeroed on next use
+static void drop_data(struct memory *mem, struct page *page)
+{
+  release_data(page);
+  if (page->flags & PAGE_CHARGED)
+    mem->resident--;
+  page->flags &= ~(PAGE_CHARGED | PAGE_CHUNK | PAGE_EXTERNAL);
+  page->data = NULL;
+  page->rd = NULL;
+  page->refs = NULL;
+  mem->pages--;
+}
+
+long memory_reset(struct memory *mem)
+{
+  unsigned size = mem->offset_mask + 1;
+  long restored = mem->num_dirty;
+  for (long i = 0; i < mem->num_dirty; ++i)
+  {
+    struct page *page = mem->dirty[i];
+    page->flags &= ~PAGE_DIRTY;
+    page->wr = NULL;
+    if (page->refs && page->base)
+    {
+      // shared with a clone made since the store: restore into a private copy
+      if (unshare_page(mem, page, page_address(mem, page)))
+      {
+        restored--;
+        continue;
+      }
+      memcpy(page->data, page->base, size);
+    }
+    else if (page->refs)
+      drop_data(mem, page);
+    else if (page->base)
+      memcpy(page->data, page->base, size);
+    else if (page->flags & (PAGE_CHUNK | PAGE_EXTERNAL))
+      memset(page->data, 0, size);
+    else
+      // zero at the snapshot: drop it, it comes back zeroed on next use
+      drop_data(mem, page);
+  }
+  mem->num_dirty = 0;
+  return restored;
+}
+
+// Aligned accesses to RAM pages take the fast path. Everything else,
+// including misaligned accesses, goes through read_slow/write_slow.
+void memory_wr_w(struct memory *mem, int addr, int data)
+{
+  unsigned char *page = fast_write_page(mem, addr);
+  if (page == NULL || (addr & 0x3))
+    write_slow(mem, addr, 4, data);
+  else
+    memcpy(page + (addr & mem->offset_mask), &data, 4);
+}
+
+void memory_wr_h(struct memory *mem, int addr, int data)
+{
+  unsigned char *page = fast_write_page(mem, addr);
+  if (page == NULL || (addr & 0x1))
+    write_slow(mem, addr, 2, data);
+  else
+  {
+    short half = data;
+    memcpy(page + (addr & mem->offset_mask), &half, 2);
+  }
+}
+
+void memory_wr_b(struct memory *mem, int addr, int data)
+{
+  unsigned char *page = fast_write_page(mem, addr);
+  if (page == NULL)
+    write_slow(mem, addr, 1, data);
+  else
+    page[addr & mem->offset_mask] = data;
+}
+
+int memory_rd_w(struct memory *mem, int addr)
+{
+  unsigned char *page = fast_read_page(mem, addr);
+  if (page == NULL || (addr & 0x3))
+    return read_slow(mem, addr, 4);
+  int data;
+  memcpy(&data, page + (addr & mem->offset_mask), 4);
+  return data;
+}
+
+int memory_rd_h(struct memory *mem, int addr)
+{
+  unsigned char *page = fast_read_page(mem, addr);
+  if (page == NULL || (addr & 0x1))
+    return read_slow(mem, addr, 2);
+  unsigned short half;
+  memcpy(&half, page + (addr & mem->offset_mask), 2);
+  return half;
 }
 
 int memory_rd_b(struct memory *mem, int addr)
 {
-  int *page = get_page(mem, addr);
-  int index = (addr >> 2) & 0x3fff;
-  switch (addr & 0x3)
-  {
-  case 0:
-    return page[index] & 0xff;
-    break;
-  case 1:
-    return (page[index] >> 8) & 0xff;
-    break;
-  case 2:
-    return (page[index] >> 16) & 0xff;
-    break;
-  case 3:
-    return (page[index] >> 24) & 0xff;
-    break;
-  }
-  return 0; // silence a warning
+  unsigned char *page = fast_read_page(mem, addr);
+  if (page == NULL)
+    return read_slow(mem, addr, 1);
+  return page[addr & mem->offset_mask];
+}
+
+void memory_read_bytes(struct memory *mem, unsigned addr, void *dst, unsigned len)
+{
+  unsigned char *to = dst;
+  while (len)
+  {
+    unsigned offset = addr & mem->offset_mask;
+    unsigned chunk = mem->offset_mask + 1 - offset;
+    if (chunk > len)
+      chunk = len;
+    unsigned char *data = readable_page(mem, addr);
+    if (data)
+      memcpy(to, data + offset, chunk);
+    else
+    {
+      for (unsigned i = 0; i < chunk; ++i)
+        to[i] = device_read(mem, addr + i, 1);
+    }
+    addr += chunk;
+    to += chunk;
+    len -= chunk;
+  }
+}
+
+// The part of [addr, addr+len) that a watchpoint covers; 0 if none
+static unsigned watch_overlap(struct watchpoint *watch, unsigned addr, unsigned len, unsigned *start)
+{
+  unsigned long from = watch->addr > addr ? watch->addr : addr;
+  unsigned long end = (unsigned long)addr + len;
+  if ((unsigned long)watch->addr + watch->len < end)
+    end = (unsigned long)watch->addr + watch->len;
+  *start = from;
+  return end > from ? end - from : 0;
+}
+
+// Bulk writes are reported once for each watchpoint they touch, after all
+// bytes are written
+void memory_write_bytes(struct memory *mem, unsigned addr, const void *src, unsigned len)
+{
+  int report = mem->watch_fn && len && watched(mem, addr, len);
+  for (struct watchpoint *watch = mem->watchpoints; report && watch; watch = watch->next)
+  {
+    unsigned start, size = watch_overlap(watch, addr, len, &start);
+    if (size)
+      watch->old_value = peek(mem, start, size < 4 ? size : 4);
+  }
+  const unsigned char *from = src;
+  unsigned at = addr;
+  unsigned left = len;
+  while (left)
+  {
+    unsigned offset = at & mem->offset_mask;
+    unsigned chunk = mem->offset_mask + 1 - offset;
+    if (chunk > left)
+      chunk = left;
+    unsigned char *data = writable_page(mem, at);
+    if (data)
+      memcpy(data + offset, from, chunk);
+    else
+    {
+      for (unsigned i = 0; i < chunk; ++i)
+        write_aligned(mem, at + i, 1, from[i], 0);
+    }
+    at += chunk;
+    from += chunk;
+    left -= chunk;
+  }
+  for (struct watchpoint *watch = mem->watchpoints; report && watch; watch = watch->next)
+  {
+    unsigned start, size = watch_overlap(watch, addr, len, &start);
+    if (size)
+      mem->watch_fn(mem->watch_ctx, start, size, watch->old_value, peek(mem, start, size < 4 ? size : 4));
+  }
+}
+
+void memory_clear_bytes(struct memory *mem, unsigned addr, unsigned len)
+{
+  while (len)
+  {
+    unsigned offset = addr & mem->offset_mask;
+    unsigned chunk = mem->offset_mask + 1 - offset;
+    if (chunk > len)
+      chunk = len;
+    struct page *table = mem->dir[addr >> DIR_SHIFT];
+    if (table && table[(addr >> mem->page_bits) & mem->table_mask].data)
+    {
+      unsigned char *data = writable_page(mem, addr);
+      if (data)
+        memset(data + offset, 0, chunk);
+    }
+    addr += chunk;
+    len -= chunk;
+  }
+}
+
+int memory_add_backing(struct memory *mem, unsigned addr, const void *data, unsigned len)
+{
+  if (len == 0)
+    return 0;
+  unsigned first = addr & ~mem->offset_mask;
+  unsigned last = (addr + len - 1) & ~mem->offset_mask;
+  for (unsigned page_addr = first;; page_addr += mem->offset_mask + 1)
+  {
+    struct page *page = get_entry(mem, page_addr);
+    if (page == NULL || (page->flags & PAGE_DEVICE))
+      return -1;
+    if (page_addr == last)
+      break;
+  }
+  struct backing *backing = malloc(sizeof(struct backing));
+  if (backing == NULL)
+    return -1;
+  backing->addr = addr;
+  backing->len = len;
+  backing->data = data;
+  backing->next = mem->backings;
+  mem->backings = backing;
+  // pages already in use get their part now, the rest on first use
+  for (unsigned page_addr = first;; page_addr += mem->offset_mask + 1)
+  {
+    struct page *page = get_entry(mem, page_addr);
+    if (page->data)
+    {
+      unsigned from = addr > page_addr ? addr : page_addr;
+      unsigned to = addr + len - 1 < page_addr + mem->offset_mask ? addr + len - 1 : page_addr + mem->offset_mask;
+      memory_write_bytes(mem, from, backing->data + (from - addr), to - from + 1);
+    }
+    else
+      page->flags |= PAGE_BACKED;
+    if (page_addr == last)
+      break;
+  }
+  return 0;
+}
+
+int memory_adopt_page(struct memory *mem, unsigned addr, void *data)
+{
+  struct page *page = get_entry(mem, addr);
+  if (page == NULL || page->data || (page->flags & PAGE_DEVICE))
+    return -1;
+  if (mem->limit && mem->resident >= mem->limit)
+    return -1;
+  page->data = data;
+  page->flags = (page->flags & ~PAGE_BACKED) | PAGE_EXTERNAL | PAGE_CHARGED;
+  page->rd = page->data;
+  page->wr = mem->tracking || (page->flags & PAGE_WATCH) ? NULL : page->data;
+  mem->pages++;
+  if (++mem->resident > mem->high_water)
+    mem->high_water = mem->resident;
+  return 0;
+}
+
+void memory_for_each_page(struct memory *mem, memory_page_fn fn, void *ctx)
+{
+  for (int i = 0; i < (1 << DIR_BITS); ++i)
+  {
+    struct page *table = mem->dir[i];
+    for (unsigned j = 0; table && j <= mem->table_mask; ++j)
+    {
+      if (!(table[j].data || (table[j].flags & PAGE_BACKED)) || (table[j].flags & PAGE_DEVICE))
+        continue;
+      unsigned addr = ((unsigned)i << DIR_SHIFT) | (j << mem->page_bits);
+      unsigned char *data = readable_page(mem, addr);
+      if (data)
+        fn(ctx, addr, data);
+    }
+  }
+}
+
+int memory_map_device(struct memory *mem, unsigned base, unsigned size, const struct mmio_ops *ops, void *ctx)
+{
+  if (size == 0)
+    return -1;
+  unsigned first = base & ~mem->offset_mask;
+  unsigned last = (base + size - 1) & ~mem->offset_mask;
+  for (unsigned addr = first;; addr += mem->offset_mask + 1)
+  {
+    struct page *page = get_entry(mem, addr);
+    if (page == NULL || page->data)
+      return -1;
+    if (addr == last)
+      break;
+  }
+  struct mmio_region *region = malloc(sizeof(struct mmio_region));
+  if (region == NULL)
+    return -1;
+  region->base = base;
+  region->size = size;
+  region->ops = ops;
+  region->ctx = ctx;
+  region->next = mem->regions;
+  mem->regions = region;
+  for (unsigned addr = first;; addr += mem->offset_mask + 1)
+  {
+    get_entry(mem, addr)->flags |= PAGE_DEVICE;
+    if (addr == last)
+      break;
+  }
+  return 0;
+}
+
+void memory_set_limit(struct memory *mem, long max_pages)
+{
+  mem->limit = max_pages;
+}
+
+void memory_set_strict_alignment(struct memory *mem, int strict)
+{
+  mem->strict_alignment = strict;
+}
+
+long memory_misaligned_count(struct memory *mem)
+{
+  return mem->misaligned;
+}
+
+void memory_set_trap(struct memory *mem, jmp_buf *trap)
+{
+  mem->trap = trap;
+}
+
+enum mem_fault memory_get_fault(struct memory *mem, unsigned *addr)
+{
+  if (addr)
+    *addr = mem->fault_addr;
+  return mem->fault;
+}
+
+int memory_add_watchpoint(struct memory *mem, unsigned addr, unsigned len)
+{
+  if (len == 0)
+    return -1;
+  struct watchpoint *watch = malloc(sizeof(struct watchpoint));
+  if (watch == NULL)
+    return -1;
+  watch->addr = addr;
+  watch->len = len;
+  watch->next = mem->watchpoints;
+  mem->watchpoints = watch;
+  unsigned first = addr & ~mem->offset_mask;
+  unsigned last = (addr + len - 1) & ~mem->offset_mask;
+  for (unsigned page_addr = first;; page_addr += mem->offset_mask + 1)
+  {
+    struct page *page = get_entry(mem, page_addr);
+    if (page == NULL)
+      return -1;
+    page->flags |= PAGE_WATCH;
+    page->wr = NULL;
+    if (page_addr == last)
+      break;
+  }
+  return 0;
+}
+
+void memory_set_watch_handler(struct memory *mem, memory_watch_fn fn, void *ctx)
+{
+  mem->watch_fn = fn;
+  mem->watch_ctx = ctx;
 }
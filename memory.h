@@ -1,12 +1,78 @@
 #ifndef __MEMORY_H__
 #define __MEMORY_H__
 
+#include <setjmp.h>
+
 struct memory;
 
+// sidestørrelser der kan vælges: 4 KiB til 2 MiB, en potens af to
+#define MEMORY_MIN_PAGE_BITS 12
+#define MEMORY_MAX_PAGE_BITS 21
+#define MEMORY_DEFAULT_PAGE_SIZE 0x1000
+
 // opret/nedlæg lager
 struct memory *memory_create();
+// opret lager med given sidestørrelse (NULL hvis størrelsen ikke understøttes)
+struct memory *memory_create_with_page_size(unsigned page_size);
 void memory_delete(struct memory *);
 
+// opret en kopi af lageret der deler alle sider med originalen; en side
+// kopieres først ved den første skrivning (copy-on-write), både i kopien og
+// i originalen. Originalen kan slettes før kopierne.
+struct memory *memory_clone(struct memory *template);
+
+// læg siderne i 2 MiB huge pages (hugetlb hvis værten har dem, ellers
+// transparent huge pages via madvise, ellers almindelige sider).
+// Skal kaldes før første adgang; returnerer -1 hvis det er for sent.
+int memory_use_huge_pages(struct memory *mem);
+
+// forbrug af værtslager for det simulerede lager
+struct memory_usage
+{
+  unsigned page_size;
+  long pages;        // allokerede sider
+  long page_bytes;   // lager brugt til sider
+  long table_bytes;  // lager brugt til sidetabeller
+  long huge_chunks;  // 2 MiB chunks når huge pages bruges
+  long hugetlb_chunks;
+  long huge_bytes;   // bytes der faktisk ligger i huge pages
+  long snapshot_bytes; // kopier af sider gemt af memory_snapshot
+  long shared_pages; // sider delt med en original eller kopi
+  long resident_pages;   // sider allokeret af netop dette lager
+  long high_water_pages; // højeste antal resident_pages
+  long limit_pages;      // grænse for resident_pages, 0 hvis ingen
+};
+void memory_get_usage(struct memory *mem, struct memory_usage *usage);
+
+// gem lagerets nuværende indhold som basis og følg hvilke sider der skrives;
+// -1 hvis værten mangler lager til basis (så følges skrivninger ikke)
+int memory_snapshot(struct memory *mem);
+// gendan de sider der er skrevet siden memory_snapshot; returnerer antallet.
+// Kopier lavet efter skrivningen beholder deres indhold. En side der ikke
+// kan gendannes (grænse eller værtens lager) tælles ikke med og giver en fejl.
+long memory_reset(struct memory *mem);
+
+// fejl i en lageradgang
+enum mem_fault
+{
+  MEM_FAULT_NONE,
+  MEM_FAULT_LIMIT,    // grænsen for antal sider er nået
+  MEM_FAULT_MISALIGNED, // ujusteret adgang i strict mode
+  MEM_FAULT_HOST_MEMORY // værten kunne ikke allokere en side eller tabel
+};
+
+// sæt en grænse for antal sider lageret selv må allokere (0: ingen grænse)
+void memory_set_limit(struct memory *mem, long max_pages);
+// ujusterede word/halfword adgange udføres byte for byte (også hen over
+// sidegrænser) og tælles; i strict mode giver de i stedet en fejl
+void memory_set_strict_alignment(struct memory *mem, int strict);
+long memory_misaligned_count(struct memory *mem);
+// ved fejl hopper lageret til trap med longjmp. Uden trap gemmes fejlen blot
+// og adgangen opgives: læsninger giver 0 og skrivninger går tabt.
+void memory_set_trap(struct memory *mem, jmp_buf *trap);
+// seneste fejl og adressen der gav den (MEM_FAULT_NONE hvis ingen endnu)
+enum mem_fault memory_get_fault(struct memory *mem, unsigned *addr);
+
 // skriv word/halfword/byte til lager
 void memory_wr_w(struct memory *mem, int addr, int data);
 void memory_wr_h(struct memory *mem, int addr, int data);
@@ -16,4 +82,49 @@ void memory_wr_b(struct memory *mem, int addr, int data);
 int memory_rd_w(struct memory *mem, int addr);
 int memory_rd_h(struct memory *mem, int addr);
 int memory_rd_b(struct memory *mem, int addr);
+
+// kopier len bytes mellem lager og værtens buffer, side for side
+void memory_read_bytes(struct memory *mem, unsigned addr, void *dst, unsigned len);
+void memory_write_bytes(struct memory *mem, unsigned addr, const void *src, unsigned len);
+// nulstil len bytes; sider der endnu ikke er allokeret er allerede nul og
+// bliver ikke allokeret
+void memory_clear_bytes(struct memory *mem, unsigned addr, unsigned len);
+
+// lad [addr, addr+len) starte som en kopi af data, der kopieres side for side
+// først når siden bruges. data skal leve lige så længe som lageret og dets
+// kopier. Returnerer -1 hvis området rører en enhedsside.
+int memory_add_backing(struct memory *mem, unsigned addr, const void *data, unsigned len);
+
+// brug data (en hel side) som indhold af den ubrugte side ved addr uden at
+// kopiere. data frigives aldrig af lageret og skal leve lige så længe som
+// lageret og dets kopier; skrivninger går direkte til data.
+int memory_adopt_page(struct memory *mem, unsigned addr, void *data);
+
+// kald fn for hver side med indhold (ikke enhedssider), i adresseorden;
+// sider der endnu ikke er hentet fra memory_add_backing hentes først
+typedef void (*memory_page_fn)(void *ctx, unsigned addr, const unsigned char *data);
+void memory_for_each_page(struct memory *mem, memory_page_fn fn, void *ctx);
+
+// memory-mapped I/O: adgange til [base, base+size) går til callbacks i stedet
+// for lager. Sider der rører et område markeres som enhedssider, så alle
+// andre sider bruger den normale hurtige vej. Dele af en enhedsside uden for
+// områderne læses som 0. offset er relativt til base, size er 1, 2 eller 4.
+// Kopier fra memory_clone deler enhederne med originalen.
+struct mmio_ops
+{
+  int (*read)(void *ctx, struct memory *mem, unsigned offset, int size);
+  void (*write)(void *ctx, struct memory *mem, unsigned offset, int size, int data);
+};
+// returnerer -1 hvis området overlapper sider der allerede bruges som lager
+int memory_map_device(struct memory *mem, unsigned base, unsigned size, const struct mmio_ops *ops, void *ctx);
+
+// watchpoints: skrivninger der rører [addr, addr+len) rapporteres til en
+// handler med gammel og ny værdi. Kun sider med et watchpoint mister den
+// hurtige vej for skrivninger; alle andre sider er upåvirkede.
+// memory_write_bytes rapporteres én gang pr. watchpoint den rører, med den
+// berørte del som addr og size og værdierne af dens første (højst 4) bytes.
+typedef void (*memory_watch_fn)(void *ctx, unsigned addr, int size, unsigned old_value, unsigned new_value);
+int memory_add_watchpoint(struct memory *mem, unsigned addr, unsigned len);
+// uden handler (fn == NULL) skrives der blot som normalt
+void memory_set_watch_handler(struct memory *mem, memory_watch_fn fn, void *ctx);
 #endif
@@ -0,0 +1,425 @@
+#include "ooo.h"
+#include "cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_UNITS 64
+#define RING 4096           // cycles of issue slots remembered per unit kind
+#define STORE_TABLE 4096    // latest stores by word, direct mapped
+
+// What a commit was waiting for
+enum cause {
+    CAUSE_BASE,         // commit slots used, and any lost without a longer delay
+    CAUSE_FETCH,        // instruction cache misses
+    CAUSE_BRANCH,       // refilling after a misprediction
+    CAUSE_ROB,          // reorder buffer full
+    CAUSE_IQ,           // issue queue full
+    CAUSE_LSQ,          // load/store queue full
+    CAUSE_DEPENDENCY,   // operands from short latency instructions
+    CAUSE_MEMORY,       // loads served by L2 or memory, or operands from them
+    CAUSE_MULDIV,       // mul/div latency or a busy div unit
+    CAUSE_UNITS,        // all units of the kind busy
+    NUM_CAUSES
+};
+
+enum unit_kind { UNIT_ALU, UNIT_MEM, NUM_KINDS };
+
+// counts for one instruction of the text segment; a commit slot is 1/width
+// of a cycle
+struct slot_cycles {
+    long insns;
+    long commit_slots[NUM_CAUSES];
+};
+
+struct store {
+    uint32_t word;      // address / 4, + 1 so 0 is free
+    uint64_t complete;
+};
+
+struct ooo {
+    struct ooo_config config;
+    struct timing_latencies latencies;
+    uint64_t fetch_cycle;
+    unsigned fetched;           // in fetch_cycle
+    uint64_t redirect;          // first fetch cycle after the latest misprediction
+    uint64_t dispatch_cycle;
+    unsigned dispatched;
+    uint64_t commit_cycle;
+    unsigned committed;
+    long seq;                   // instructions so far
+    long mem_seq;               // loads and stores so far
+    uint64_t* rob_commit;       // commit cycles of the latest rob instructions
+    uint64_t* lsq_commit;       // and of the latest lsq loads and stores
+    uint64_t* iq_heap;          // issue cycles of the issue queue entries, min heap
+    unsigned iq_used;
+    uint64_t ready[32];         // cycle a register's value is available
+    enum cause ready_cause[32];
+    uint64_t muldiv_busy[MAX_UNITS];
+    uint64_t ring_cycle[NUM_KINDS][RING];
+    uint8_t ring_used[NUM_KINDS][RING];
+    struct store stores[STORE_TABLE];
+    long insns;
+    long commit_slots[NUM_CAUSES];
+    uint32_t text_start;
+    uint32_t text_count;
+    struct slot_cycles* slots;
+    struct slot_cycles outside;
+};
+
+static const char* field_names[] = { "width", "depth", "rob", "iq", "lsq", "alu", "muldiv", "mem", "load" };
+#define NUM_FIELDS 9
+
+int ooo_parse_config(const char* text, struct ooo_config* config) {
+    *config = (struct ooo_config) { 4, 5, 128, 64, 48, 4, 1, 2, 3 };
+    unsigned* fields[NUM_FIELDS] = { &config->width, &config->depth, &config->rob, &config->iq, &config->lsq,
+                                     &config->alu, &config->muldiv, &config->mem, &config->load };
+    if (!strcmp(text, "default")) {
+        return 0;
+    }
+    while (*text) {
+        size_t length = strcspn(text, "=");
+        int field = -1;
+        for (int i = 0; i < NUM_FIELDS; i++) {
+            if (strlen(field_names[i]) == length && !strncmp(text, field_names[i], length)) {
+                field = i;
+            }
+        }
+        if (field < 0 || text[length] != '=') {
+            return -1;
+        }
+        char* end;
+        unsigned long value = strtoul(text + length + 1, &end, 0);
+        if (end == text + length + 1 || value > 65536 || (*end != ',' && *end != 0)) {
+            return -1;
+        }
+        *fields[field] = value;
+        text = *end ? end + 1 : end;
+    }
+    // every part of the core needs room for at least one instruction
+    for (int i = 0; i < NUM_FIELDS; i++) {
+        if (*fields[i] == 0 && fields[i] != &config->depth) {
+            return -1;
+        }
+    }
+    if (config->alu > 255 || config->mem > 255 || config->muldiv > MAX_UNITS) {
+        return -1;
+    }
+    return 0;
+}
+
+struct ooo* ooo_create(const struct ooo_config* config, const struct timing_latencies* latencies,
+                       uint32_t text_start, uint32_t text_end) {
+    struct ooo* ooo = calloc(1, sizeof(struct ooo));
+    if (ooo == NULL) {
+        return NULL;
+    }
+    ooo->config = *config;
+    ooo->latencies = *latencies;
+    ooo->rob_commit = calloc(config->rob, sizeof(uint64_t));
+    ooo->lsq_commit = calloc(config->lsq, sizeof(uint64_t));
+    ooo->iq_heap = calloc(config->iq, sizeof(uint64_t));
+    ooo->text_start = text_start;
+    ooo->text_count = text_end > text_start ? (text_end - text_start) / 4 : 0;
+    ooo->slots = calloc(ooo->text_count + 1, sizeof(struct slot_cycles));
+    if (ooo->rob_commit == NULL || ooo->lsq_commit == NULL || ooo->iq_heap == NULL || ooo->slots == NULL) {
+        ooo_delete(ooo);
+        return NULL;
+    }
+    return ooo;
+}
+
+void ooo_delete(struct ooo* ooo) {
+    free(ooo->rob_commit);
+    free(ooo->lsq_commit);
+    free(ooo->iq_heap);
+    free(ooo->slots);
+    free(ooo);
+}
+
+static uint64_t max(uint64_t a, uint64_t b) {
+    return a > b ? a : b;
+}
+
+static uint64_t iq_min(const struct ooo* ooo) {
+    return ooo->iq_heap[0];
+}
+
+static void iq_pop(struct ooo* ooo) {
+    uint64_t* heap = ooo->iq_heap;
+    uint64_t last = heap[--ooo->iq_used];
+    unsigned at = 0;
+    for (;;) {
+        unsigned child = 2 * at + 1;
+        if (child >= ooo->iq_used) {
+            break;
+        }
+        if (child + 1 < ooo->iq_used && heap[child + 1] < heap[child]) {
+            child++;
+        }
+        if (heap[child] >= last) {
+            break;
+        }
+        heap[at] = heap[child];
+        at = child;
+    }
+    heap[at] = last;
+}
+
+static void iq_push(struct ooo* ooo, uint64_t issue) {
+    uint64_t* heap = ooo->iq_heap;
+    unsigned at = ooo->iq_used++;
+    while (at > 0 && heap[(at - 1) / 2] > issue) {
+        heap[at] = heap[(at - 1) / 2];
+        at = (at - 1) / 2;
+    }
+    heap[at] = issue;
+}
+
+// the first cycle from cycle on with a free unit of kind, which is taken
+static uint64_t take_unit(struct ooo* ooo, enum unit_kind kind, uint64_t cycle) {
+    unsigned units = kind == UNIT_ALU ? ooo->config.alu : ooo->config.mem;
+    for (;; cycle++) {
+        unsigned at = cycle % RING;
+        if (ooo->ring_cycle[kind][at] != cycle) {
+            ooo->ring_cycle[kind][at] = cycle;
+            ooo->ring_used[kind][at] = 0;
+        }
+        if (ooo->ring_used[kind][at] < units) {
+            ooo->ring_used[kind][at]++;
+            return cycle;
+        }
+    }
+}
+
+// the next slot of a stage that handles width instructions per cycle, at
+// cycle or later
+static uint64_t take_slot(uint64_t* stage_cycle, unsigned* used, unsigned width, uint64_t cycle) {
+    if (cycle > *stage_cycle) {
+        *stage_cycle = cycle;
+        *used = 0;
+    } else if (*used == width) {
+        (*stage_cycle)++;
+        *used = 0;
+    }
+    (*used)++;
+    return *stage_cycle;
+}
+
+void ooo_retire(struct ooo* ooo, const struct retired* r) {
+    const struct ooo_config* config = &ooo->config;
+    const struct timing_latencies* latencies = &ooo->latencies;
+    enum rv_class cls = decode_table[r->op].cls;
+    int is_mem = cls == CLASS_LOAD || cls == CLASS_STORE;
+    int src1, src2, dst;
+    timing_registers(r, &src1, &src2, &dst);
+    // delays of this instruction, the largest of which is charged for a late commit
+    uint64_t delay[NUM_CAUSES] = { 0 };
+
+    // fetch, after any redirect and instruction cache miss
+    uint64_t in_order = ooo->fetch_cycle + (ooo->fetched == config->width);
+    unsigned fetch_latency = timing_served_latency(latencies, r->fetch_served);
+    if (ooo->redirect > in_order) {
+        delay[CAUSE_BRANCH] = ooo->redirect - in_order;
+    }
+    delay[CAUSE_FETCH] = fetch_latency;
+    uint64_t fetch = take_slot(&ooo->fetch_cycle, &ooo->fetched, config->width,
+                               max(in_order, ooo->redirect) + fetch_latency);
+
+    // dispatch into the reorder buffer, issue queue and load/store queue
+    uint64_t dispatch = max(fetch + config->depth, ooo->dispatch_cycle + (ooo->dispatched == config->width));
+    uint64_t rob_free = ooo->rob_commit[ooo->seq % config->rob] + 1;
+    if (rob_free > dispatch) {
+        delay[CAUSE_ROB] = rob_free - dispatch;
+        dispatch = rob_free;
+    }
+    if (is_mem) {
+        uint64_t lsq_free = ooo->lsq_commit[ooo->mem_seq % config->lsq] + 1;
+        if (lsq_free > dispatch) {
+            delay[CAUSE_LSQ] = lsq_free - dispatch;
+            dispatch = lsq_free;
+        }
+    }
+    while (ooo->iq_used && iq_min(ooo) < dispatch) {
+        iq_pop(ooo);
+    }
+    if (ooo->iq_used == config->iq) {
+        uint64_t iq_free = iq_min(ooo) + 1;
+        iq_pop(ooo);
+        if (iq_free > dispatch) {
+            delay[CAUSE_IQ] = iq_free - dispatch;
+            dispatch = iq_free;
+        }
+    }
+    dispatch = take_slot(&ooo->dispatch_cycle, &ooo->dispatched, config->width, dispatch);
+
+    // issue once the operands are there and a unit is free
+    uint64_t operands = dispatch + 1;
+    enum cause operand_cause = CAUSE_DEPENDENCY;
+    int sources[2] = { src1, src2 };
+    for (int i = 0; i < 2; i++) {
+        if (sources[i] && ooo->ready[sources[i]] > operands) {
+            operands = ooo->ready[sources[i]];
+            operand_cause = ooo->ready_cause[sources[i]];
+        }
+    }
+    struct store* store = &ooo->stores[(r->addr >> 2) % STORE_TABLE];
+    if (cls == CLASS_LOAD && store->word == (r->addr >> 2) + 1 && store->complete > operands) {
+        operands = store->complete;
+        operand_cause = CAUSE_DEPENDENCY;
+    }
+    delay[operand_cause] += operands - (dispatch + 1);
+    uint64_t issue;
+    unsigned latency = 1;
+    enum cause latency_cause = CAUSE_DEPENDENCY;
+    if (cls == CLASS_MULDIV) {
+        int is_div = r->op >= OP_DIV;
+        unsigned unit = 0;
+        for (unsigned i = 1; i < config->muldiv; i++) {
+            if (ooo->muldiv_busy[i] < ooo->muldiv_busy[unit]) {
+                unit = i;
+            }
+        }
+        issue = max(operands, ooo->muldiv_busy[unit]);
+        delay[CAUSE_MULDIV] += issue - operands;
+        latency = is_div ? latencies->div : latencies->mul;
+        latency_cause = CAUSE_MULDIV;
+        ooo->muldiv_busy[unit] = issue + (is_div ? latency : 1);
+    } else {
+        issue = take_unit(ooo, is_mem ? UNIT_MEM : UNIT_ALU, operands);
+        delay[CAUSE_UNITS] = issue - operands;
+        if (cls == CLASS_LOAD) {
+            unsigned miss = timing_served_latency(latencies, r->data_served);
+            latency = config->load + miss;
+            latency_cause = miss ? CAUSE_MEMORY : CAUSE_DEPENDENCY;
+        }
+    }
+    delay[latency_cause] += latency - 1;
+    iq_push(ooo, issue);
+    uint64_t complete = issue + latency;
+    if (dst) {
+        ooo->ready[dst] = complete;
+        ooo->ready_cause[dst] = latency_cause;
+    }
+    if (cls == CLASS_STORE) {
+        store->word = (r->addr >> 2) + 1;
+        store->complete = complete;
+    }
+    if (r->mispredicted) {
+        ooo->redirect = complete + 1;
+    }
+
+    // commit in order. Each instruction is charged its own commit slot, and
+    // the slots lost since the previous commit, the rest of that cycle and
+    // any cycles without commits, go to its largest delay
+    uint64_t last_commit = ooo->commit_cycle;
+    unsigned last_used = ooo->committed;
+    uint64_t commit = take_slot(&ooo->commit_cycle, &ooo->committed, config->width, complete + 1);
+    uint32_t slot = (r->pc - ooo->text_start) >> 2;
+    struct slot_cycles* counts = slot < ooo->text_count ? &ooo->slots[slot] : &ooo->outside;
+    counts->commit_slots[CAUSE_BASE]++;
+    ooo->commit_slots[CAUSE_BASE]++;
+    if (commit > last_commit) {
+        enum cause cause = CAUSE_BASE;
+        for (int i = 1; i < NUM_CAUSES; i++) {
+            if (delay[i] > delay[cause]) {
+                cause = i;
+            }
+        }
+        long lost = (config->width - last_used) + (commit - last_commit - 1) * config->width;
+        counts->commit_slots[cause] += lost;
+        ooo->commit_slots[cause] += lost;
+    }
+    counts->insns++;
+    ooo->insns++;
+    ooo->rob_commit[ooo->seq++ % config->rob] = commit;
+    if (is_mem) {
+        ooo->lsq_commit[ooo->mem_seq++ % config->lsq] = commit;
+    }
+}
+
+struct function_cycles {
+    const char* name;
+    struct slot_cycles counts;
+    long total;
+};
+
+static int compare_functions(const void* a, const void* b) {
+    const struct function_cycles* x = a;
+    const struct function_cycles* y = b;
+    if (x->total != y->total) {
+        return x->total > y->total ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+static void add_counts(struct function_cycles* function, const struct slot_cycles* counts) {
+    function->counts.insns += counts->insns;
+    for (int cause = 0; cause < NUM_CAUSES; cause++) {
+        function->counts.commit_slots[cause] += counts->commit_slots[cause];
+        function->total += counts->commit_slots[cause];
+    }
+}
+
+#define REPORT_FUNCTIONS 20
+
+static const char* cause_names[] = { "base", "icache", "mispredict", "rob full", "iq full", "lsq full",
+                                     "dependency", "memory", "mul/div", "units busy" };
+
+void ooo_report(struct ooo* ooo, FILE* out, struct symbols* symbols) {
+    const struct ooo_config* config = &ooo->config;
+    uint64_t cycles = ooo->commit_cycle;
+    double width = config->width;
+    fprintf(out, "Out-of-order core (width %u, depth %u, rob %u, iq %u, lsq %u, %u alu, %u mul/div, %u mem ports,"
+            " load %u cycles):\n", config->width, config->depth, config->rob, config->iq, config->lsq, config->alu,
+            config->muldiv, config->mem, config->load);
+    fprintf(out, "  %lu cycles for %ld instructions, IPC %.3f\n", (unsigned long)cycles, ooo->insns,
+            cycles ? (double)ooo->insns / cycles : 0.0);
+    for (int cause = 0; cause < NUM_CAUSES; cause++) {
+        fprintf(out, "  %-12s %15.2f cycles %7.2f%%\n", cause_names[cause], ooo->commit_slots[cause] / width,
+                cycles ? 100.0 * ooo->commit_slots[cause] / width / cycles : 0.0);
+    }
+    if (symbols == NULL) {
+        return;
+    }
+
+    // consecutive instructions of the same function share one entry
+    struct function_cycles* functions = calloc(ooo->text_count + 1, sizeof(struct function_cycles));
+    if (functions == NULL) {
+        return;
+    }
+    int num_functions = 0;
+    const char* previous = NULL;
+    for (uint32_t slot = 0; slot < ooo->text_count; slot++) {
+        unsigned int offset;
+        const char* name = symbols_enclosing(symbols, ooo->text_start + 4 * slot, &offset);
+        name = name ? name : "<unknown>";
+        if (num_functions == 0 || name != previous || offset == 0) {
+            functions[num_functions++].name = name;
+        }
+        add_counts(&functions[num_functions - 1], &ooo->slots[slot]);
+        previous = name;
+    }
+    functions[num_functions].name = "<outside text>";
+    add_counts(&functions[num_functions++], &ooo->outside);
+    qsort(functions, num_functions, sizeof(struct function_cycles), compare_functions);
+
+    // the critical resource of a function is the cause of most of its lost
+    // commit slots; its IPC is at most the width since every instruction
+    // is charged at least its own slot
+    fprintf(out, "Out-of-order cycles per function:\n  %15s %7s %13s %7s  %-12s %7s  %s\n", "cycles", "%", "insns",
+            "IPC", "critical", "%", "function");
+    for (int i = 0; i < num_functions && i < REPORT_FUNCTIONS && functions[i].total; i++) {
+        const struct function_cycles* function = &functions[i];
+        int critical = CAUSE_BASE;
+        for (int cause = 1; cause < NUM_CAUSES; cause++) {
+            if (function->counts.commit_slots[cause] > function->counts.commit_slots[critical]) {
+                critical = cause;
+            }
+        }
+        fprintf(out, "  %15.2f %7.2f %13ld %7.3f  %-12s %7.2f  %s\n", function->total / width,
+                cycles ? 100.0 * function->total / width / cycles : 0.0, function->counts.insns,
+                width * function->counts.insns / function->total, cause_names[critical],
+                100.0 * function->counts.commit_slots[critical] / function->total, function->name);
+    }
+    free(functions);
+}
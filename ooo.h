@@ -0,0 +1,52 @@
+#ifndef __OOO_H__
+#define __OOO_H__
+
+#include "timing.h"
+#include "read_elf.h"
+#include <stdio.h>
+#include <stdint.h>
+
+struct ooo_config {
+    unsigned width;     // instructions fetched, dispatched and committed per cycle
+    unsigned depth;     // cycles from fetch to dispatch, the refill after a misprediction
+    unsigned rob;       // reorder buffer entries
+    unsigned iq;        // issue queue entries, freed at issue
+    unsigned lsq;       // load/store queue entries, freed at commit
+    unsigned alu;       // integer units, also doing branches and jumps
+    unsigned muldiv;    // mul/div units; mul is pipelined, div is not
+    unsigned mem;       // load/store ports
+    unsigned load;      // cycles of a load that hits L1
+};
+
+// set config from "name=value,..." over the defaults (width=4, depth=5,
+// rob=128, iq=64, lsq=48, alu=4, muldiv=1, mem=2, load=3), "default"
+// keeps them (return -1 if invalid)
+int ooo_parse_config(const char* text, struct ooo_config* config);
+
+// Timing of an out-of-order core driven only by the stream of retired
+// instructions, which it follows through fetch, dispatch into the reorder
+// buffer, issue queue and load/store queue, issue to functional units and
+// in order commit. Registers are renamed, so only true dependencies wait;
+// loads wait for an earlier store to the same word. Cache latencies come
+// from the --cache model, mispredictions from the --bpred model (without
+// one branches are predicted perfectly). Each instruction is charged its
+// commit slot, 1/width of a cycle, and the commit slots lost before it
+// commits are charged to its largest delay, which gives the stall breakdown
+// and keeps the IPC of any function within the width.
+struct ooo;
+
+// model with cycles per instruction of [text_start,text_end) (return NULL
+// if out of host memory)
+struct ooo* ooo_create(const struct ooo_config* config, const struct timing_latencies* latencies,
+                       uint32_t text_start, uint32_t text_end);
+
+void ooo_delete(struct ooo* ooo);
+
+// account for the next instruction in program order
+void ooo_retire(struct ooo* ooo, const struct retired* r);
+
+// write cycles, IPC and the stall breakdown overall and for the functions
+// taking the most cycles if symbols is not NULL
+void ooo_report(struct ooo* ooo, FILE* out, struct symbols* symbols);
+
+#endif
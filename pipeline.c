@@ -0,0 +1,196 @@
+#include "pipeline.h"
+#include "cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Why an instruction entered EX later than the cycle after its predecessor
+enum stall {
+    STALL_LOAD_USE,
+    STALL_MULDIV,       // waiting for a mul/div result or for the div unit
+    STALL_BRANCH,       // fetch redirected after a jump or mispredicted branch
+    STALL_FETCH,        // instruction cache miss
+    STALL_DATA,         // load miss holding MEM
+    NUM_STALLS
+};
+
+// counts for one instruction of the text segment
+struct slot_cycles {
+    long insns;
+    long cycles;
+};
+
+struct pipeline {
+    struct timing_latencies latencies;
+    int predicted;
+    uint64_t ex;            // cycle the latest instruction entered EX
+    uint64_t ex_free;       // first cycle EX can take another instruction
+    enum stall ex_cause;    // what keeps EX busy until ex_free
+    uint64_t fetched;       // cycle the next instruction can enter EX as far as fetch goes
+    uint64_t ready[32];     // cycle a register's value can be forwarded to EX
+    enum stall cause[32];   // why it is not ready sooner
+    long insns;
+    long stalls[NUM_STALLS];
+    uint32_t text_start;
+    uint32_t text_count;
+    struct slot_cycles* slots;
+    struct slot_cycles outside;
+};
+
+struct pipeline* pipeline_create(const struct timing_latencies* latencies, int predicted,
+                                 uint32_t text_start, uint32_t text_end) {
+    struct pipeline* pipeline = calloc(1, sizeof(struct pipeline));
+    if (pipeline == NULL) {
+        return NULL;
+    }
+    pipeline->latencies = *latencies;
+    pipeline->predicted = predicted;
+    pipeline->text_start = text_start;
+    pipeline->text_count = text_end > text_start ? (text_end - text_start) / 4 : 0;
+    pipeline->slots = calloc(pipeline->text_count + 1, sizeof(struct slot_cycles));
+    if (pipeline->slots == NULL) {
+        free(pipeline);
+        return NULL;
+    }
+    pipeline->fetched = 2;      // the first instruction goes through IF and ID
+    return pipeline;
+}
+
+void pipeline_delete(struct pipeline* pipeline) {
+    free(pipeline->slots);
+    free(pipeline);
+}
+
+void pipeline_retire(struct pipeline* pipeline, const struct retired* r) {
+    const struct timing_latencies* latencies = &pipeline->latencies;
+    enum rv_class cls = decode_table[r->op].cls;
+    int src1, src2, dst;
+    timing_registers(r, &src1, &src2, &dst);
+
+    // enter EX when fetch, operands and EX itself allow it, and blame the
+    // latest of them for any stall
+    uint64_t in_order = pipeline->ex + 1;
+    uint64_t start = in_order;
+    enum stall cause = NUM_STALLS;
+    unsigned fetch_latency = timing_served_latency(latencies, r->fetch_served);
+    if (pipeline->fetched + fetch_latency > start) {
+        start = pipeline->fetched + fetch_latency;
+        cause = fetch_latency ? STALL_FETCH : STALL_BRANCH;
+    }
+    if (pipeline->ex_free > start) {
+        start = pipeline->ex_free;
+        cause = pipeline->ex_cause;
+    }
+    int sources[2] = { src1, src2 };
+    for (int i = 0; i < 2; i++) {
+        if (sources[i] && pipeline->ready[sources[i]] > start) {
+            start = pipeline->ready[sources[i]];
+            cause = pipeline->cause[sources[i]];
+        }
+    }
+    if (start > in_order) {
+        pipeline->stalls[cause] += start - in_order;
+    }
+
+    uint32_t slot = (r->pc - pipeline->text_start) >> 2;
+    struct slot_cycles* counts = slot < pipeline->text_count ? &pipeline->slots[slot] : &pipeline->outside;
+    counts->insns++;
+    counts->cycles += start - pipeline->ex;
+    pipeline->insns++;
+    pipeline->ex = start;
+
+    // when the result can be forwarded and what EX and fetch do next
+    uint64_t result = start + 1;
+    pipeline->ex_free = start + 1;
+    if (cls == CLASS_LOAD) {
+        unsigned miss = timing_served_latency(latencies, r->data_served);
+        result = start + 2 + miss;
+        pipeline->ex_free = start + 1 + miss;
+        pipeline->ex_cause = STALL_DATA;
+        pipeline->cause[dst] = miss ? STALL_DATA : STALL_LOAD_USE;
+    } else if (cls == CLASS_MULDIV) {
+        int is_div = r->op >= OP_DIV;
+        result = start + (is_div ? latencies->div : latencies->mul);
+        if (is_div) {
+            pipeline->ex_free = result;
+            pipeline->ex_cause = STALL_MULDIV;
+        }
+        pipeline->cause[dst] = STALL_MULDIV;
+    }
+    if (dst) {
+        pipeline->ready[dst] = result;
+    }
+
+    unsigned bubbles = 0;
+    int taken = r->next_pc != r->pc + 4;
+    if (cls == CLASS_JAL) {
+        bubbles = (pipeline->predicted ? r->mispredicted : 1) ? 1 : 0;
+    } else if (cls == CLASS_JALR || cls == CLASS_BRANCH) {
+        bubbles = (pipeline->predicted ? r->mispredicted : taken || cls == CLASS_JALR) ? latencies->branch : 0;
+    }
+    pipeline->fetched = start + 1 + bubbles;
+}
+
+struct function_cycles {
+    const char* name;
+    struct slot_cycles counts;
+};
+
+static int compare_functions(const void* a, const void* b) {
+    const struct function_cycles* x = a;
+    const struct function_cycles* y = b;
+    if (x->counts.cycles != y->counts.cycles) {
+        return x->counts.cycles > y->counts.cycles ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+#define REPORT_FUNCTIONS 20
+
+void pipeline_report(struct pipeline* pipeline, FILE* out, struct symbols* symbols) {
+    static const char* stall_names[] = { "load-use", "mul/div", "branch and jump", "instruction fetch", "data miss" };
+    // the last instruction still has to go through MEM and WB
+    uint64_t cycles = pipeline->insns ? pipeline->ex + 3 : 0;
+    const struct timing_latencies* latencies = &pipeline->latencies;
+    fprintf(out, "In-order pipeline (mul %u, div %u, l2 %u, mem %u, branch %u cycles%s):\n", latencies->mul,
+            latencies->div, latencies->l2, latencies->memory, latencies->branch,
+            pipeline->predicted ? ", predicted branches" : ", branches predicted not taken");
+    fprintf(out, "  %lu cycles for %ld instructions, CPI %.3f\n", (unsigned long)cycles, pipeline->insns,
+            pipeline->insns ? (double)cycles / pipeline->insns : 0.0);
+    for (int stall = 0; stall < NUM_STALLS; stall++) {
+        fprintf(out, "  %-18s %13ld stall cycles %7.2f%%\n", stall_names[stall], pipeline->stalls[stall],
+                cycles ? 100.0 * pipeline->stalls[stall] / cycles : 0.0);
+    }
+    if (symbols == NULL) {
+        return;
+    }
+
+    // consecutive instructions of the same function share one entry
+    struct function_cycles* functions = calloc(pipeline->text_count + 1, sizeof(struct function_cycles));
+    if (functions == NULL) {
+        return;
+    }
+    int num_functions = 0;
+    const char* previous = NULL;
+    for (uint32_t slot = 0; slot < pipeline->text_count; slot++) {
+        unsigned int offset;
+        const char* name = symbols_enclosing(symbols, pipeline->text_start + 4 * slot, &offset);
+        name = name ? name : "<unknown>";
+        if (num_functions == 0 || name != previous || offset == 0) {
+            functions[num_functions++].name = name;
+        }
+        functions[num_functions - 1].counts.insns += pipeline->slots[slot].insns;
+        functions[num_functions - 1].counts.cycles += pipeline->slots[slot].cycles;
+        previous = name;
+    }
+    functions[num_functions].name = "<outside text>";
+    functions[num_functions++].counts = pipeline->outside;
+    qsort(functions, num_functions, sizeof(struct function_cycles), compare_functions);
+
+    fprintf(out, "Pipeline cycles per function:\n  %13s %7s %13s %7s  %s\n", "cycles", "%", "insns", "CPI", "function");
+    for (int i = 0; i < num_functions && i < REPORT_FUNCTIONS && functions[i].counts.insns; i++) {
+        const struct slot_cycles* counts = &functions[i].counts;
+        fprintf(out, "  %13ld %7.2f %13ld %7.3f  %s\n", counts->cycles, cycles ? 100.0 * counts->cycles / cycles : 0.0,
+                counts->insns, (double)counts->cycles / counts->insns, functions[i].name);
+    }
+    free(functions);
+}
@@ -0,0 +1,36 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include "timing.h"
+#include "read_elf.h"
+#include <stdio.h>
+#include <stdint.h>
+
+// Cycle count of a classic 5 stage in-order pipeline (IF ID EX MEM WB)
+// with full forwarding, run alongside the functional simulation:
+// - a load followed by a user of its result stalls 1 cycle
+// - mul results take latencies.mul cycles in a pipelined unit, div and
+//   rem latencies.div cycles in one that blocks EX
+// - without a branch predictor model fetch assumes not taken, so taken
+//   branches and jalr lose latencies.branch cycles and jal 1 cycle (it is
+//   resolved in ID); with one only mispredictions do
+// - instruction and load misses stall the pipeline for their latency;
+//   stores drain through a write buffer
+struct pipeline;
+
+// pipeline with cycles per instruction of [text_start,text_end), predicted
+// set if the retired instructions carry branch predictions (return NULL if
+// out of host memory)
+struct pipeline* pipeline_create(const struct timing_latencies* latencies, int predicted,
+                                 uint32_t text_start, uint32_t text_end);
+
+void pipeline_delete(struct pipeline* pipeline);
+
+// account for the next instruction in program order
+void pipeline_retire(struct pipeline* pipeline, const struct retired* r);
+
+// write cycles, CPI and stall cycles by cause, and cycles and CPI of the
+// functions taking the most cycles if symbols is not NULL
+void pipeline_report(struct pipeline* pipeline, FILE* out, struct symbols* symbols);
+
+#endif
@@ -0,0 +1,93 @@
+#include "profile.h"
+#include "disassemble.h"
+#include <stdlib.h>
+
+struct profile* profile_create(uint32_t start, uint32_t end) {
+    struct profile* profile = malloc(sizeof(struct profile));
+    if (profile == NULL) {
+        return NULL;
+    }
+    profile->start = start;
+    profile->count = end > start ? (end - start) / 4 : 0;
+    profile->outside = 0;
+    profile->hits = calloc(profile->count + 1, sizeof(long));
+    if (profile->hits == NULL) {
+        free(profile);
+        return NULL;
+    }
+    return profile;
+}
+
+void profile_delete(struct profile* profile) {
+    free(profile->hits);
+    free(profile);
+}
+
+struct hot_slot {
+    long hits;
+    uint32_t pc;
+};
+
+// Order of the report: most executed first, then by address
+static int compare_slots(const void* a, const void* b) {
+    const struct hot_slot* x = a;
+    const struct hot_slot* y = b;
+    if (x->hits != y->hits) {
+        return x->hits > y->hits ? -1 : 1;
+    }
+    return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+void profile_report(struct profile* profile, FILE* out, struct memory* mem, struct symbols* symbols) {
+    uint32_t executed = 0;
+    long total = profile->outside;
+    for (uint32_t i = 0; i < profile->count; i++) {
+        if (profile->hits[i]) {
+            executed++;
+            total += profile->hits[i];
+        }
+    }
+    struct hot_slot* slots = malloc((executed + 1) * sizeof(struct hot_slot));
+    if (slots == NULL) {
+        fprintf(out, "Out of host memory for the profile report\n");
+        return;
+    }
+    executed = 0;
+    for (uint32_t i = 0; i < profile->count; i++) {
+        if (profile->hits[i]) {
+            slots[executed].hits = profile->hits[i];
+            slots[executed].pc = profile->start + 4 * i;
+            executed++;
+        }
+    }
+    qsort(slots, executed, sizeof(struct hot_slot), compare_slots);
+
+    fprintf(out, "Execution profile: %ld instructions at %u addresses", total, executed);
+    if (profile->outside) {
+        fprintf(out, ", %ld outside the text segment", profile->outside);
+    }
+    fprintf(out, "\n\n%12s %6s %6s %8s  %-40s %s\n", "count", "%", "cum%", "pc", "instruction", "function");
+    long cumulative = 0;
+    char disassembly[100];
+    for (uint32_t n = 0; n < executed; n++) {
+        uint32_t pc = slots[n].pc;
+        long hits = slots[n].hits;
+        cumulative += hits;
+        // no symbols here, or labels replace the instruction
+        disassemble(pc, memory_rd_w(mem, pc), disassembly, sizeof(disassembly), NULL);
+        fprintf(out, "%12ld %6.2f %6.2f %8x  %-40s", hits, 100.0 * hits / total,
+                100.0 * cumulative / total, pc, disassembly);
+        unsigned int offset;
+        const char* function = symbols ? symbols_enclosing(symbols, pc, &offset) : NULL;
+        if (function) {
+            fprintf(out, " %s+0x%x", function, offset);
+        }
+        const char* file;
+        unsigned int line;
+        if (symbols && symbols_addr_to_line(symbols, pc, &file, &line) == 0) {
+            fprintf(out, " %s:%u", file, line);
+        }
+        fprintf(out, "\n");
+    }
+    free(slots);
+}
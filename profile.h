@@ -0,0 +1,35 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include "memory.h"
+#include "read_elf.h"
+#include <stdio.h>
+#include <stdint.h>
+
+// Execution counts for every instruction slot of the text segment
+struct profile {
+    uint32_t start;     // address of the first slot
+    uint32_t count;     // number of slots
+    long* hits;         // executions per slot
+    long outside;       // executions outside the text segment
+};
+
+// profile for the instructions in [start,end) (NULL if out of host memory)
+struct profile* profile_create(uint32_t start, uint32_t end);
+
+void profile_delete(struct profile* profile);
+
+static inline void profile_count(struct profile* profile, uint32_t pc) {
+    uint32_t i = (pc - profile->start) >> 2;
+    if (i < profile->count) {
+        profile->hits[i]++;
+    } else {
+        profile->outside++;
+    }
+}
+
+// write the executed instructions sorted by count, with their disassembly,
+// enclosing function and source line if known (symbols may be NULL)
+void profile_report(struct profile* profile, FILE* out, struct memory* mem, struct symbols* symbols);
+
+#endif
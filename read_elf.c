@@ -1,228 +1,326 @@
 #include "read_elf.h"
 #include "disassemble.h"
+#include "debug_line.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "elf.h"
 
-int read_elf(struct memory* mem, struct program_info* info, const char *filename, FILE *log_file) {
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
-        fprintf(log_file, "Error opening file");
+// The whole file is mapped read-only once. Headers are checked in elf_open()
+// and then used in place, segments are copied straight from the mapping into
+// guest memory, and the symbol table refers to the mapped entries and names.
+struct elf_file {
+    const unsigned char* data;
+    size_t size;
+    const Elf32_Ehdr* header;
+    const Elf32_Phdr* program_headers;
+    const Elf32_Shdr* section_headers;  // NULL if the file has none
+    long refs;                          // elf_open() plus symbol tables
+};
+
+// Does [offset, offset + size) lie within the file, suitably aligned?
+static int in_file(const struct elf_file* elf, unsigned long offset, unsigned long size, unsigned align) {
+    return offset <= elf->size && size <= elf->size - offset && offset % align == 0;
+}
+
+static int check_headers(struct elf_file* elf) {
+    if (elf->size < sizeof(Elf32_Ehdr)) {
+        fprintf(stderr, "Elf file error, file shorter than minimal header size.\n");
         return -1;
     }
-
-    // Read the ELF header
-    Elf32_Ehdr elf_header;
-    unsigned stat = fread(&elf_header, 1, sizeof(Elf32_Ehdr), file);
-    if (stat != sizeof(Elf32_Ehdr)) {
-        fprintf(log_file, "Elf file error, file shorter than minimal header size.\n");
-        fclose(file);
+    const Elf32_Ehdr* header = elf->header;
+    if (memcmp(header->e_ident, ELFMAG, SELFMAG) != 0) {
+        fprintf(stderr, "Not a valid ELF file.\n");
         return -1;
     }
-
-    // Check for ELF magic number
-    if (memcmp(elf_header.e_ident, ELFMAG, SELFMAG) != 0) {
-        fprintf(log_file, "Not a valid ELF file.\n");
-        fclose(file);
+    if (header->e_ident[EI_CLASS] != ELFCLASS32 || header->e_ident[EI_DATA] != ELFDATA2LSB
+        || header->e_machine != EM_RISCV) {
+        fprintf(stderr, "Not a 32-bit little-endian RISC-V ELF file.\n");
+        return -1;
+    }
+    if (header->e_phnum && (header->e_phentsize != sizeof(Elf32_Phdr)
+        || !in_file(elf, header->e_phoff, header->e_phnum * sizeof(Elf32_Phdr), 4))) {
+        fprintf(stderr, "Elf file error, invalid program header table.\n");
+        return -1;
+    }
+    elf->program_headers = (const Elf32_Phdr*)(elf->data + header->e_phoff);
+    for (int i = 0; i < header->e_phnum; i++) {
+        const Elf32_Phdr* segment = &elf->program_headers[i];
+        if (segment->p_type == PT_LOAD && (!in_file(elf, segment->p_offset, segment->p_filesz, 1)
+            || segment->p_filesz > segment->p_memsz)) {
+            fprintf(stderr, "Elf file error, segment %d outside file.\n", i);
+            return -1;
+        }
+    }
+    if (header->e_shnum == 0) {
+        return 0;
+    }
+    if (header->e_shentsize != sizeof(Elf32_Shdr)
+        || !in_file(elf, header->e_shoff, header->e_shnum * sizeof(Elf32_Shdr), 4)) {
+        fprintf(stderr, "While reading ELF file: Invalid section header.\n");
         return -1;
     }
+    elf->section_headers = (const Elf32_Shdr*)(elf->data + header->e_shoff);
+    return 0;
+}
+
+struct elf_file* elf_open(const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening file");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "Elf file error, file shorter than minimal header size.\n");
+        close(fd);
+        return NULL;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("Error mapping file");
+        return NULL;
+    }
+    struct elf_file* elf = calloc(1, sizeof(struct elf_file));
+    if (!elf) {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    elf->data = data;
+    elf->size = st.st_size;
+    elf->header = data;
+    elf->refs = 1;
+    if (check_headers(elf)) {
+        elf_close(elf);
+        return NULL;
+    }
+    return elf;
+}
+
+void elf_close(struct elf_file* elf) {
+    if (--elf->refs) {
+        return;
+    }
+    munmap((void*)elf->data, elf->size);
+    free(elf);
+}
 
-    // Seek to the program header table and read program headers
+int elf_load(struct elf_file* elf, struct memory* mem, struct program_info* info, int lazy) {
+    const Elf32_Ehdr* header = elf->header;
     info->text_start = 0;
     info->text_end = 0;
-    info->start = elf_header.e_entry;
-    //printf("Program headers starting at offset %d\n", elf_header.e_phoff);
-    //printf("Program entry point address: 0x%x\n", info->start);
-    //printf("Text offset 0x%x\n\n", info->text_start);
-    Elf32_Phdr program_header;
-    for (int i = 0; i < elf_header.e_phnum; i++) {
-        fseek(file, elf_header.e_phoff + i * sizeof(Elf32_Phdr), SEEK_SET);
-        stat = fread(&program_header, 1, sizeof(Elf32_Phdr), file);
-        if (stat != sizeof(Elf32_Phdr)) {
-            fprintf(log_file, "Elf file error, file shorter than minimal prog header size.\n");
-            fclose(file);
+    info->start = header->e_entry;
+    for (int i = 0; i < header->e_phnum; i++) {
+        const Elf32_Phdr* segment = &elf->program_headers[i];
+        if (segment->p_type != PT_LOAD) {
+            continue;
+        }
+        if (segment->p_flags & PF_X) {
+            info->text_start = segment->p_vaddr + (unsigned int)(sizeof(Elf32_Ehdr) + header->e_phnum * sizeof(Elf32_Phdr));
+            info->text_end = segment->p_vaddr + segment->p_filesz;
+        }
+        if (!lazy) {
+            memory_write_bytes(mem, segment->p_vaddr, elf->data + segment->p_offset, segment->p_filesz);
+        } else if (memory_add_backing(mem, segment->p_vaddr, elf->data + segment->p_offset, segment->p_filesz)) {
+            fprintf(stderr, "Could not map segment at 0x%x\n", segment->p_vaddr);
             return -1;
         }
-
-        // Check for loadable segments (PT_LOAD)
-        if (program_header.p_type == PT_LOAD) {
-            // const char *segment_type = NULL;
-
-            // Identify segment type
-            if (program_header.p_flags & PF_X) {
-                // segment_type = "Executable (.text)";
-                info->text_start = program_header.p_vaddr + (unsigned int)(sizeof(Elf32_Ehdr) + elf_header.e_phnum * sizeof(Elf32_Phdr));
-                info->text_end = program_header.p_vaddr + program_header.p_filesz;
-            } else if (program_header.p_flags & PF_W) {
-                // segment_type = "Writable (static data)";
-            } else {
-                // segment_type = "Read-only (e.g., .rodata)";
-            }
-
-            //printf("Found %s segment at offset 0x%x, size 0x%x, in-memory address 0x%x\n",
-            //      segment_type, program_header.p_offset, program_header.p_filesz, program_header.p_vaddr);
-
-            // Allocate buffer for the segment
-            unsigned char *segment_data = malloc(program_header.p_filesz);
-            if (!segment_data) {
-                fprintf(log_file, "Error allocating memory for segment\n");
-                fclose(file);
-                return -1;
-            }
-
-            // Read the segment data
-            fseek(file, program_header.p_offset, SEEK_SET);
-            stat = fread(segment_data, 1, program_header.p_filesz, file);
-            if (stat != program_header.p_filesz) {
-                fprintf(log_file, "Error reading segment - failed to read entire segment in one go\n");
-                return -1;
-            }
-
-            // Process the segment data (e.g., print or analyze)
-            // printf("All bytes of %s segment:\n", segment_type);
-            for (unsigned int j = 0; j < program_header.p_filesz; j++) {
-                // printf("%02x ", segment_data[j]);
-                memory_wr_b(mem, program_header.p_vaddr + j, segment_data[j]);
-            }
-            /*
-            printf("\n\nDisassembly\n");
-            for (unsigned int j = info->text_start; j < program_header.p_filesz; j += 4) {
-                unsigned int addr = program_header.p_vaddr + j;
-                int inst = memory_rd_w(mem, addr);
-                const int buf_sz = 64;
-                char buf[buf_sz];
-                decode_rv32i(addr, inst, buf, buf_sz);
-                // printf("%6x %8x   %s\n", j, inst, buf);
-            }
-            printf("\n");
-            */
-            free(segment_data);
+        // .bss: pages not touched yet are zero already
+        memory_clear_bytes(mem, segment->p_vaddr + segment->p_filesz, segment->p_memsz - segment->p_filesz);
+        enum mem_fault fault = memory_get_fault(mem, NULL);
+        if (fault == MEM_FAULT_LIMIT) {
+            fprintf(stderr, "Guest memory limit too small for segment at 0x%x\n", segment->p_vaddr);
+            return -1;
+        } else if (fault != MEM_FAULT_NONE) {
+            fprintf(stderr, "Not enough host memory for segment at 0x%x\n", segment->p_vaddr);
+            return -1;
         }
     }
-    // adjust program info to virtual addresses instead of file offsets
-    fclose(file);
     return 0;
 }
 
 struct symbols {
-    char* strtab;
-    Elf32_Sym* symbols;
+    struct elf_file* elf;
+    const char* strtab;
+    unsigned int strtab_size;
+    const Elf32_Sym* symbols;
     int num_symbols;
+    const Elf32_Sym** by_value;  // named entries sorted by value, then table order
+    int num_sorted;
+    struct line_table* lines;    // built on first use
+    int lines_read;
 };
 
-struct symbols* symbols_read_from_elf(const char *filename) {
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
-        perror("Error opening file");
-        return NULL;
+static int compare_symbols(const void* a, const void* b) {
+    const Elf32_Sym* x = *(const Elf32_Sym* const*)a;
+    const Elf32_Sym* y = *(const Elf32_Sym* const*)b;
+    if (x->st_value != y->st_value) {
+        return x->st_value < y->st_value ? -1 : 1;
     }
+    return x < y ? -1 : x > y;
+}
 
-    // Read the ELF header
-    Elf32_Ehdr elf_header;
-    int status = fread(&elf_header, 1, sizeof(Elf32_Ehdr), file);
-    if (status != sizeof(Elf32_Ehdr)) {
-        fprintf(stderr, "Not a valid ELF file.\n");
-        fclose(file);
+struct symbols* symbols_read_from_elf(struct elf_file* elf) {
+    // Locate the symbol table and the string table it links to
+    const Elf32_Shdr *symtab_section = NULL;
+    const Elf32_Shdr *strtab_section = NULL;
+    for (int i = 0; i < elf->header->e_shnum; i++) {
+        if (elf->section_headers[i].sh_type == SHT_SYMTAB) {
+            symtab_section = &elf->section_headers[i];
+        }
+    }
+    if (symtab_section && symtab_section->sh_link < elf->header->e_shnum) {
+        strtab_section = &elf->section_headers[symtab_section->sh_link];
+    }
+    if (!symtab_section || !strtab_section || strtab_section->sh_type != SHT_STRTAB) {
+        fprintf(stderr, "No symbol table found.\n");
+        return NULL;
+    }
+    if (!in_file(elf, symtab_section->sh_offset, symtab_section->sh_size, 4)
+        || !in_file(elf, strtab_section->sh_offset, strtab_section->sh_size, 1)
+        || strtab_section->sh_size == 0
+        || elf->data[strtab_section->sh_offset + strtab_section->sh_size - 1] != 0) {
+        fprintf(stderr, "Error, unable to read symbol table entry.\n");
         return NULL;
     }
 
-    // Check for ELF magic number
-    if (memcmp(elf_header.e_ident, ELFMAG, SELFMAG) != 0) {
-        fprintf(stderr, "Not a valid ELF file.\n");
-        fclose(file);
+    struct symbols* symbols = calloc(1, sizeof(struct symbols));
+    if (!symbols) {
+        return NULL;
+    }
+    symbols->strtab = (const char*)elf->data + strtab_section->sh_offset;
+    symbols->strtab_size = strtab_section->sh_size;
+    symbols->symbols = (const Elf32_Sym*)(elf->data + symtab_section->sh_offset);
+    symbols->num_symbols = symtab_section->sh_size / sizeof(Elf32_Sym);
+    symbols->by_value = malloc((symbols->num_symbols + 1) * sizeof(const Elf32_Sym*));
+    if (!symbols->by_value) {
+        free(symbols);
         return NULL;
     }
+    for (int i = 0; i < symbols->num_symbols; i++) {
+        if (symbols->symbols[i].st_name < symbols->strtab_size) {
+            symbols->by_value[symbols->num_sorted++] = &symbols->symbols[i];
+        }
+    }
+    qsort(symbols->by_value, symbols->num_sorted, sizeof(const Elf32_Sym*), compare_symbols);
+    symbols->elf = elf;
+    elf->refs++;
+    return symbols;
+}
 
-    // Seek to the section header table
-    fseek(file, elf_header.e_shoff, SEEK_SET);
 
-    // Read all section headers
-    Elf32_Shdr *section_headers = malloc(elf_header.e_shnum * sizeof(Elf32_Shdr));
-    status = fread(section_headers, elf_header.e_shnum, sizeof(Elf32_Shdr), file);
-    if (status != sizeof(Elf32_Shdr)) {
-        fprintf(stderr, "While reading ELF file: Invalid section header.\n");
-        fclose(file);
-        return NULL;
+const char* symbols_value_to_sym(struct symbols* symbols, unsigned int value)
+{
+    // first entry with st_value >= value
+    int low = 0;
+    int high = symbols->num_sorted;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (symbols->by_value[mid]->st_value < value) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
     }
+    for (int i = low; i < symbols->num_sorted && symbols->by_value[i]->st_value == value; i++) {
+        if (ELF32_ST_BIND(symbols->by_value[i]->st_info)) {
+            return &symbols->strtab[symbols->by_value[i]->st_name];
+        }
+    }
+    return NULL;
+}
 
-    // Locate the symbol table and the string table
-    Elf32_Shdr *symtab_section = NULL;
-    Elf32_Shdr *strtab_section = NULL;
-    for (int i = 0; i < elf_header.e_shnum; i++) {
-        if (section_headers[i].sh_type == SHT_SYMTAB) {
-            symtab_section = &section_headers[i];
-        } else if (section_headers[i].sh_type == SHT_STRTAB && i != elf_header.e_shstrndx) {
-            // Avoid the section header string table
-            strtab_section = &section_headers[i];
+const char* symbols_enclosing(struct symbols* symbols, unsigned int addr, unsigned int* offset)
+{
+    // first entry with st_value > addr
+    int low = 0;
+    int high = symbols->num_sorted;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (symbols->by_value[mid]->st_value <= addr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (int i = low - 1; i >= 0; i--) {
+        const Elf32_Sym* symbol = symbols->by_value[i];
+        int type = ELF32_ST_TYPE(symbol->st_info);
+        if (symbol->st_shndx == SHN_UNDEF || symbol->st_shndx == SHN_ABS) {
+            continue;
+        }
+        if (type == STT_FUNC || (type == STT_NOTYPE && ELF32_ST_BIND(symbol->st_info) != STB_LOCAL)) {
+            *offset = addr - symbol->st_value;
+            return &symbols->strtab[symbol->st_name];
         }
     }
+    return NULL;
+}
 
-    if (!symtab_section || !strtab_section) {
-        fprintf(stderr, "No symbol table found.\n");
-        free(section_headers);
-        fclose(file);
-        return NULL;
+int symbols_sym_to_value(struct symbols* symbols, const char* name, unsigned int* value)
+{
+    for (int i = 0; i < symbols->num_sorted; i++) {
+        const Elf32_Sym* symbol = symbols->by_value[i];
+        if (ELF32_ST_BIND(symbol->st_info) && !strcmp(&symbols->strtab[symbol->st_name], name)) {
+            *value = symbol->st_value;
+            return 0;
+        }
     }
+    return -1;
+}
 
-    struct symbols* symbols = malloc(sizeof(struct symbols));
-    // Read the string table
-    symbols->strtab = malloc(strtab_section->sh_size);
-    fseek(file, strtab_section->sh_offset, SEEK_SET);
-    status = fread(symbols->strtab, 1, strtab_section->sh_size, file);
-    if ((unsigned int)status != strtab_section->sh_size) {
-        fprintf(stderr, "Error, unable to read string table in one go.\n");
-        fclose(file);
+// Contents of the section with the given name, NULL if there is none
+static const unsigned char* find_section(struct elf_file* elf, const char* name, size_t* size) {
+    const Elf32_Ehdr* header = elf->header;
+    if (header->e_shstrndx >= header->e_shnum) {
         return NULL;
     }
-
-    // Read the symbol table entries
-    symbols->num_symbols = symtab_section->sh_size / sizeof(Elf32_Sym);
-    symbols->symbols = malloc(symtab_section->sh_size);
-    fseek(file, symtab_section->sh_offset, SEEK_SET);
-    status = fread(symbols->symbols, symbols->num_symbols, sizeof(Elf32_Sym), file);
-    if (status != sizeof(Elf32_Sym)) {
-        fprintf(stderr, "Error, unable to read symbol table entry.\n");
-        fclose(file);
+    const Elf32_Shdr* names = &elf->section_headers[header->e_shstrndx];
+    if (!in_file(elf, names->sh_offset, names->sh_size, 1)) {
         return NULL;
     }
-
-    // Print symbols
-    /* printf("Symbols:\n");
-    for (int i = 0; i < symbols->num_symbols; i++) {
-        const char *name = &symbols->strtab[symbols->symbols[i].st_name];
-        printf("Name: %-50s Address: 0x%-8x Size: %3d Type: %2d Binding: %2d\n",
-               name,
-               symbols->symbols[i].st_value,
-               symbols->symbols[i].st_size,
-               ELF32_ST_TYPE(symbols->symbols[i].st_info),
-               ELF32_ST_BIND(symbols->symbols[i].st_info));
-    }
-    */
-    // Free allocated memory
-    // free(strtab);
-    // free(symbols);
-    free(section_headers);
-    fclose(file);
-    return symbols;
+    size_t name_length = strlen(name) + 1;
+    for (int i = 0; i < header->e_shnum; i++) {
+        const Elf32_Shdr* section = &elf->section_headers[i];
+        if (section->sh_type != SHT_NOBITS && section->sh_name < names->sh_size
+            && names->sh_size - section->sh_name >= name_length
+            && !memcmp(elf->data + names->sh_offset + section->sh_name, name, name_length)
+            && in_file(elf, section->sh_offset, section->sh_size, 1)) {
+            *size = section->sh_size;
+            return elf->data + section->sh_offset;
+        }
+    }
+    return NULL;
 }
 
-
-const char* symbols_value_to_sym(struct symbols* symbols, unsigned int value) 
+int symbols_addr_to_line(struct symbols* symbols, unsigned int addr, const char** file, unsigned int* line)
 {
-    for (int i = 0; i < symbols->num_symbols; i++) {
-        if (symbols->symbols[i].st_value == value && ELF32_ST_BIND(symbols->symbols[i].st_info)) {
-            return &symbols->strtab[symbols->symbols[i].st_name];
-        }
+    if (!symbols->lines_read) {
+        struct debug_sections sections = { NULL, 0, NULL, 0, NULL, 0 };
+        sections.line = find_section(symbols->elf, ".debug_line", &sections.line_size);
+        sections.line_str = (const char*)find_section(symbols->elf, ".debug_line_str", &sections.line_str_size);
+        sections.str = (const char*)find_section(symbols->elf, ".debug_str", &sections.str_size);
+        symbols->lines = line_table_parse(&sections);
+        symbols->lines_read = 1;
     }
-    return NULL;
+    if (!symbols->lines) {
+        return -1;
+    }
+    return line_table_lookup(symbols->lines, addr, file, line);
 }
 
 void symbols_delete(struct symbols* symbols)
 {
-    free(symbols->strtab);
-    free(symbols->symbols);
+    if (symbols->lines) {
+        line_table_delete(symbols->lines);
+    }
+    free(symbols->by_value);
+    elf_close(symbols->elf);
     free(symbols);
 }
-
@@ -11,13 +11,25 @@ struct program_info {
     unsigned int start;
 };
 
-// read file into simulated memory, fill in program info
-int read_elf(struct memory* mem, struct program_info* info, const char* file_name, FILE *log_file);
+// an ELF file mapped into the host address space
+struct elf_file;
+
+// map file and check its headers (return NULL with a message on stderr)
+struct elf_file* elf_open(const char* file_name);
+
+// unmap file once it and all symbol tables read from it are deleted
+void elf_close(struct elf_file* elf);
+
+// copy loadable segments into simulated memory, fill in program info.
+// With lazy set each page is only copied from the file on first use, and
+// the file must stay open as long as the memory and its clones exist.
+int elf_load(struct elf_file* elf, struct memory* mem, struct program_info* info, int lazy);
 
 struct symbols;
 
-// read symbol table from elf file
-struct symbols* symbols_read_from_elf(const char* file_name);
+// symbol table of a mapped elf file; names and entries are not copied, so
+// the table keeps the mapping alive until symbols_delete
+struct symbols* symbols_read_from_elf(struct elf_file* elf);
 
 // delete symbol table after use
 void symbols_delete(struct symbols* symbols);
@@ -25,5 +37,16 @@ void symbols_delete(struct symbols* symbols);
 // map a value to a symbol (return NULL if no matching symbol found)
 const char* symbols_value_to_sym(struct symbols* symbols, unsigned int value);
 
+// name of the function an address lies in, i.e. the nearest function or
+// global label at or below it, with the offset into it (NULL if none)
+const char* symbols_enclosing(struct symbols* symbols, unsigned int addr, unsigned int* offset);
+
+// map an address to a source file and line using the DWARF line table,
+// which is read from the file on first use (return -1 if not known)
+int symbols_addr_to_line(struct symbols* symbols, unsigned int addr, const char** file, unsigned int* line);
+
+// map a global symbol name to its value (return -1 if not found)
+int symbols_sym_to_value(struct symbols* symbols, const char* name, unsigned int* value);
+
 
 #endif
@@ -1,394 +1,561 @@
-#include "simulate.h"
-#include "disassemble.h"
-#include <stdlib.h>
-#include <stdint.h>
-#include <stdbool.h>
-
-// Register file
-static int32_t registers[32];
-#define zero registers[0]    // x0 is hardwired to 0
-#define ra registers[1]      // Return address
-#define sp registers[2]      // Stack pointer
-#define a0 registers[10]     // Function argument/return value
-#define a7 registers[17]     // System call number
-
-// Helper function to log register changes
-static void log_register_change(FILE *log_file, int reg_num, int32_t new_value) {
-    if (log_file && reg_num != 0) { // Don't log changes to x0
-        fprintf(log_file, "                R[%2d] <- %x", reg_num, new_value);
-    }
-}
-
-// Helper function to log memory writes
-static void log_memory_write(FILE *log_file, uint32_t addr, uint32_t value, int bytes) {
-    if (log_file) {
-        fprintf(log_file, "                M[%x] <- %x (%d bytes)", addr, value, bytes);
-    }
-}
-
-// Helper function to indicate taken branches
-static void log_branch_taken(FILE *log_file) {
-    if (log_file) {
-        fprintf(log_file, "            {T}");
-    }
-}
-
-// Helper function to indicate instruction fetch from new address
-static void log_jump_target(FILE *log_file) {
-    if (log_file) {
-        fprintf(log_file, "=>");
-    }
-}
-
-// Helper functions for instruction decoding
-static inline uint32_t extract_bits(uint32_t instruction, int start, int length) {
-    return (instruction >> start) & ((1 << length) - 1);
-}
-
-static inline int32_t sign_extend(uint32_t x, int bits) {
-    uint32_t sign_bit = 1u << (bits - 1);
-    return (x ^ sign_bit) - sign_bit;
-}
-
-// Immediate extraction functions
-static int32_t get_i_imm(uint32_t inst) {
-    return sign_extend(inst >> 20, 12);
-}
-
-static int32_t get_s_imm(uint32_t inst) {
-    return sign_extend(((inst >> 25) << 5) | ((inst >> 7) & 0x1F), 12);
-}
-
-static int32_t get_b_imm(uint32_t inst) {
-    return sign_extend(
-        ((inst >> 31) << 12) | 
-        ((inst >> 7) & 0x1) << 11 |
-        ((inst >> 25) & 0x3F) << 5 |
-        ((inst >> 8) & 0xF) << 1,
-        13);
-}
-
-static int32_t get_u_imm(uint32_t inst) {
-    return inst & 0xFFFFF000;
-}
-
-static int32_t get_j_imm(uint32_t inst) {
-    return sign_extend(
-        ((inst >> 31) << 20) |
-        ((inst >> 12) & 0xFF) << 12 |
-        ((inst >> 20) & 0x1) << 11 |
-        ((inst >> 21) & 0x3FF) << 1,
-        21);
-}
-
-struct Stat simulate(struct memory *mem, int start_addr, FILE *log_file, struct symbols* symbols) {
-    struct Stat stats = {0};  // Initialize statistics
-    uint32_t pc = start_addr;  // Program counter
-    uint32_t prev_pc = pc;     // Previous PC for jump detection
-    char disasm_buf[100];      // Buffer for disassembly
-
-    // Initialize registers
-    for (int i = 0; i < 32; i++) {
-        registers[i] = 0;
-    }
-
-    // Main simulation loop
-    while (1) {
-        // Check if we jumped to this instruction
-        if (pc != prev_pc + 4 && log_file) {
-            log_jump_target(log_file);
-        }
-
-        // Fetch instruction
-        uint32_t instruction = memory_rd_w(mem, pc);
-        
-        // Log the instruction if logging is enabled
-        if (log_file) {
-            disassemble(pc, instruction, disasm_buf, sizeof(disasm_buf), symbols);
-            fprintf(log_file, "%8ld %8x : %08X     %-30s", 
-                    stats.insns, pc, instruction, disasm_buf);
-        }
-
-        // Increment instruction count
-        stats.insns++;
-
-        // Keep x0 as zero
-        zero = 0;
-
-        // Extract common fields
-        uint32_t opcode = instruction & 0x7F;
-        uint32_t rd = (instruction >> 7) & 0x1F;
-        uint32_t rs1 = (instruction >> 15) & 0x1F;
-        uint32_t rs2 = (instruction >> 20) & 0x1F;
-        uint32_t funct3 = (instruction >> 12) & 0x7;
-        uint32_t funct7 = (instruction >> 25) & 0x7F;
-
-        // Default next PC is next instruction
-        uint32_t next_pc = pc + 4;
-        prev_pc = pc;  // Save current PC
-
-        // Execute instruction
-        switch (opcode) {
-            case 0x37: // LUI
-                registers[rd] = get_u_imm(instruction);
-                log_register_change(log_file, rd, registers[rd]);
-                break;
-
-            case 0x17: // AUIPC
-                registers[rd] = pc + get_u_imm(instruction);
-                log_register_change(log_file, rd, registers[rd]);
-                break;
-
-            case 0x6F: // JAL
-                registers[rd] = pc + 4;
-                next_pc = pc + get_j_imm(instruction);
-                log_register_change(log_file, rd, registers[rd]);
-                break;
-
-            case 0x67: // JALR
-                {
-                    uint32_t temp = pc + 4;
-                    next_pc = (registers[rs1] + get_i_imm(instruction)) & ~1;
-                    registers[rd] = temp;
-                    log_register_change(log_file, rd, registers[rd]);
-                }
-                break;
-
-            case 0x63: // Branch instructions
-                {
-                    bool take_branch = false;
-                    switch (funct3) {
-                        case 0x0: // BEQ
-                            take_branch = (registers[rs1] == registers[rs2]);
-                            break;
-                        case 0x1: // BNE
-                            take_branch = (registers[rs1] != registers[rs2]);
-                            break;
-                        case 0x4: // BLT
-                            take_branch = (registers[rs1] < registers[rs2]);
-                            break;
-                        case 0x5: // BGE
-                            take_branch = (registers[rs1] >= registers[rs2]);
-                            break;
-                        case 0x6: // BLTU
-                            take_branch = ((uint32_t)registers[rs1] < (uint32_t)registers[rs2]);
-                            break;
-                        case 0x7: // BGEU
-                            take_branch = ((uint32_t)registers[rs1] >= (uint32_t)registers[rs2]);
-                            break;
-                    }
-                    if (take_branch) {
-                        next_pc = pc + get_b_imm(instruction);
-                        log_branch_taken(log_file);
-                    }
-                }
-                break;
-
-            case 0x03: // Load instructions
-                {
-                    uint32_t addr = registers[rs1] + get_i_imm(instruction);
-                    switch (funct3) {
-                        case 0x0: // LB
-                            registers[rd] = sign_extend(memory_rd_b(mem, addr), 8);
-                            log_register_change(log_file, rd, registers[rd]);
-                            break;
-                        case 0x1: // LH
-                            registers[rd] = sign_extend(memory_rd_h(mem, addr), 16);
-                            log_register_change(log_file, rd, registers[rd]);
-                            break;
-                        case 0x2: // LW
-                            registers[rd] = memory_rd_w(mem, addr);
-                            log_register_change(log_file, rd, registers[rd]);
-                            break;
-                        case 0x4: // LBU
-                            registers[rd] = memory_rd_b(mem, addr) & 0xFF;
-                            log_register_change(log_file, rd, registers[rd]);
-                            break;
-                        case 0x5: // LHU
-                            registers[rd] = memory_rd_h(mem, addr) & 0xFFFF;
-                            log_register_change(log_file, rd, registers[rd]);
-                            break;
-                    }
-                }
-                break;
-
-            case 0x23: // Store instructions
-                {
-                    uint32_t addr = registers[rs1] + get_s_imm(instruction);
-                    switch (funct3) {
-                        case 0x0: // SB
-                            memory_wr_b(mem, addr, registers[rs2]);
-                            log_memory_write(log_file, addr, registers[rs2] & 0xFF, 1);
-                            break;
-                        case 0x1: // SH
-                            memory_wr_h(mem, addr, registers[rs2]);
-                            log_memory_write(log_file, addr, registers[rs2] & 0xFFFF, 2);
-                            break;
-                        case 0x2: // SW
-                            memory_wr_w(mem, addr, registers[rs2]);
-                            log_memory_write(log_file, addr, registers[rs2], 4);
-                            break;
-                    }
-                }
-                break;
-
-            case 0x13: // Immediate arithmetic
-                switch (funct3) {
-                    case 0x0: // ADDI
-                        registers[rd] = registers[rs1] + get_i_imm(instruction);
-                        log_register_change(log_file, rd, registers[rd]);
-                        break;
-                    case 0x1: // SLLI
-                        registers[rd] = registers[rs1] << (instruction >> 20) & 0x1F;
-                        log_register_change(log_file, rd, registers[rd]);
-                        break;
-                    case 0x2: // SLTI
-                        registers[rd] = (registers[rs1] < get_i_imm(instruction)) ? 1 : 0;
-                        log_register_change(log_file, rd, registers[rd]);
-                        break;
-                    case 0x3: // SLTIU
-                        registers[rd] = ((uint32_t)registers[rs1] < (uint32_t)get_i_imm(instruction)) ? 1 : 0;
-                        log_register_change(log_file, rd, registers[rd]);
-                        break;
-                    case 0x4: // XORI
-                        registers[rd] = registers[rs1] ^ get_i_imm(instruction);
-                        log_register_change(log_file, rd, registers[rd]);
-                        break;
-                    case 0x5: // SRLI/SRAI
-                        if (funct7 == 0x20) { // SRAI
-                            registers[rd] = registers[rs1] >> (instruction >> 20) & 0x1F;
-                        } else { // SRLI
-                            registers[rd] = (uint32_t)registers[rs1] >> (instruction >> 20) & 0x1F;
-                        }
-                        log_register_change(log_file, rd, registers[rd]);
-                        break;
-                    case 0x6: // ORI
-                        registers[rd] = registers[rs1] | get_i_imm(instruction);
-                        log_register_change(log_file, rd, registers[rd]);
-                        break;
-                    case 0x7: // ANDI
-                        registers[rd] = registers[rs1] & get_i_imm(instruction);
-                        log_register_change(log_file, rd, registers[rd]);
-                        break;
-                }
-                break;
-
-            case 0x33: // Register arithmetic
-                switch (funct3) {
-                    case 0x0: // ADD/SUB/MUL
-                        if (funct7 == 0x20) {
-                            registers[rd] = registers[rs1] - registers[rs2];
-                        } else if (funct7 == 0x01) {
-                            registers[rd] = registers[rs1] * registers[rs2];
-                        } else {
-                            registers[rd] = registers[rs1] + registers[rs2];
-                        }
-                        log_register_change(log_file, rd, registers[rd]);
-                        break;
-                    case 0x1: // SLL/MULH
-                        if (funct7 == 0x01) {
-                            registers[rd] = ((int64_t)registers[rs1] * (int64_t)registers[rs2]) >> 32;
-                        } else {
-                            registers[rd] = registers[rs1] << (registers[rs2] & 0x1F);
-                        }
-                        log_register_change(log_file, rd, registers[rd]);
-                        break;
-                    case 0x2: // SLT
-                        registers[rd] = (registers[rs1] < registers[rs2]) ? 1 : 0;
-                        log_register_change(log_file, rd, registers[rd]);
-                        break;
-                    case 0x3: // SLTU
-                        registers[rd] = ((uint32_t)registers[rs1] < (uint32_t)registers[rs2]) ? 1 : 0;
-                        log_register_change(log_file, rd, registers[rd]);
-                        break;
-                    case 0x4: // XOR/DIV
-                        if (funct7 == 0x01) {
-                            if (registers[rs2] != 0) {
-                                registers[rd] = (int32_t)((int32_t)registers[rs1] / (int32_t)registers[rs2]);
-                            } else {
-                                registers[rd] = -1;
-                            }
-                        } else {
-                            registers[rd] = registers[rs1] ^ registers[rs2];
-                        }
-                        log_register_change(log_file, rd, registers[rd]);
-                        break;
-                    case 0x5: // SRL/SRA/DIVU
-                        if (funct7 == 0x20) {
-                            registers[rd] = registers[rs1] >> (registers[rs2] & 0x1F);
-                        } else if (funct7 == 0x01) {
-                            if (registers[rs2] != 0) {
-                                registers[rd] = (int32_t)((uint32_t)registers[rs1] / (uint32_t)registers[rs2]);
-                            } else {
-                                registers[rd] = -1;
-                            }
-                        } else {
-                            registers[rd] = (uint32_t)registers[rs1] >> (registers[rs2] & 0x1F);
-                        }
-                        log_register_change(log_file, rd, registers[rd]);
-                        break;
-                    case 0x6: // OR/REM
-                        if (funct7 == 0x01) {
-                            if (registers[rs2] != 0) {
-                                registers[rd] = (int32_t)((int32_t)registers[rs1] % (int32_t)registers[rs2]);
-                            } else {
-                                registers[rd] = registers[rs1];
-                            }
-                        } else {
-                            registers[rd] = registers[rs1] | registers[rs2];
-                        }
-                        log_register_change(log_file, rd, registers[rd]);
-                        break;
-                    case 0x7: // AND/REMU
-                        if (funct7 == 0x01) {
-                            if (registers[rs2] != 0) {
-                                registers[rd] = (int32_t)((uint32_t)registers[rs1] % (uint32_t)registers[rs2]);
-                            } else {
-                                registers[rd] = registers[rs1];
-                            }
-                        } else {
-                            registers[rd] = registers[rs1] & registers[rs2];
-                        }
-                        log_register_change(log_file, rd, registers[rd]);
-                        break;
-                }
-                break;
-
-                    case 0x73: // ECALL
-                        if (instruction == 0x73) {
-                            switch (a7) {
-                                case 1: // getchar
-                                    a0 = getchar();
-                                    if (log_file) fprintf(log_file, "getchar() -> %c\n", a0);
-                                    log_register_change(log_file, 10, a0);
-                                    break;
-                                case 2: // putchar
-                                    putchar(a0);
-                                    if (log_file) fprintf(log_file, "putchar(%c)\n", a0);
-                                    break;
-                                case 3: case 93: // exit
-                                    if (log_file) fprintf(log_file, "exit()\n");
-                                    return stats;
-                                default:
-                                    fprintf(stderr, "Unknown syscall: %d\n", a7);
-                                    exit(1);
-                            }
-                        }
-                        break;
-
-            default:
-                fprintf(stderr, "Unknown instruction at PC=%x: %x\n", pc, instruction);
-                exit(1);
-        }
-
-        // Add newline to log if needed
-        if (log_file) {
-            fprintf(log_file, "\n");
-        }
-
-        // Update PC
-        pc = next_pc;
-    }
-
-    return stats;
-}
\ No newline at end of file
+#include "simulate.h"
+#include "disassemble.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <setjmp.h>
+
+// Register file, points into the cpu_state given to simulate()
+#define zero registers[0]    // x0 is hardwired to 0
+#define ra registers[1]      // Return address
+#define sp registers[2]      // Stack pointer
+#define a0 registers[10]     // Function argument/return value
+#define a7 registers[17]     // System call number
+
+// Helper function to log register changes
+static void log_register_change(FILE *log_file, int reg_num, int32_t new_value) {
+    if (log_file && reg_num != 0) { // Don't log changes to x0
+        fprintf(log_file, "                R[%2d] <- %x", reg_num, new_value);
+    }
+}
+
+// Helper function to log memory writes
+static void log_memory_write(FILE *log_file, uint32_t addr, uint32_t value, int bytes) {
+    if (log_file) {
+        fprintf(log_file, "                M[%x] <- %x (%d bytes)", addr, value, bytes);
+    }
+}
+
+// Helper function to indicate taken branches
+static void log_branch_taken(FILE *log_file) {
+    if (log_file) {
+        fprintf(log_file, "            {T}");
+    }
+}
+
+// Helper function to indicate instruction fetch from new address
+static void log_jump_target(FILE *log_file) {
+    if (log_file) {
+        fprintf(log_file, "=>");
+    }
+}
+
+void cpu_init(struct cpu_state *cpu, uint32_t start_addr) {
+    for (int i = 0; i < 32; i++) {
+        cpu->regs[i] = 0;
+    }
+    cpu->pc = start_addr;
+}
+
+int simulate_snapshot(struct memory *mem, const struct cpu_state *cpu, struct cpu_state *baseline) {
+    *baseline = *cpu;
+    return memory_snapshot(mem);
+}
+
+long simulate_reset(struct memory *mem, struct cpu_state *cpu, const struct cpu_state *baseline) {
+    *cpu = *baseline;
+    return memory_reset(mem);
+}
+
+struct decode_cache *simulate_predecode(struct memory *mem, uint32_t start, uint32_t end) {
+    uint32_t count = end > start ? (end - start) / 4 : 0;
+    uint32_t *words = malloc(count * sizeof(uint32_t) + 1);
+    if (words == NULL) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        words[i] = memory_rd_w(mem, start + 4 * i);
+    }
+    struct decode_cache *cache = decode_cache_create(start, words, count);
+    free(words);
+    return cache;
+}
+
+// Record why execution stopped before the guest exited
+static void stop(struct Stat *stats, enum sim_fault fault, uint32_t pc, uint32_t instruction) {
+    stats->fault = fault;
+    stats->fault_pc = pc;
+    stats->fault_insn = instruction;
+}
+
+// Run until the guest exits or faults. A memory fault longjmps out of here,
+// so the pc and instruction count live in *cpu and *stats rather than in
+// locals. Other faults return with the reason in *stats. Always inlined
+// into execute, where tools and op_counts are NULL and all measuring
+// compiles away, into execute_counted, where only the event counts are
+// left, and into execute_measured. Executed operations are counted in
+// op_counts unless it is NULL.
+static inline __attribute__((always_inline)) void run(struct memory *mem, struct cpu_state *cpu, uint32_t stop_pc, const struct decode_cache *predecoded, struct sim_tools *tools, long *op_counts, struct Stat *stats, FILE *log_file, struct symbols* symbols) {
+    int32_t *registers = cpu->regs;
+    uint32_t pc = cpu->pc;     // Program counter
+    uint32_t prev_pc = pc;     // Previous PC for jump detection
+    char disasm_buf[100];      // Buffer for disassembly
+
+    // Main simulation loop
+    while (1) {
+        cpu->pc = pc;
+        if (pc == stop_pc) {
+            return;
+        }
+
+        // Check if we jumped to this instruction
+        if (pc != prev_pc + 4 && log_file) {
+            log_jump_target(log_file);
+        }
+
+        // Fetch instruction
+        uint32_t instruction = memory_rd_w(mem, pc);
+        
+        // Log the instruction if logging is enabled
+        if (log_file) {
+            disassemble(pc, instruction, disasm_buf, sizeof(disasm_buf), symbols);
+            fprintf(log_file, "%8ld %8x : %08X     %-30s", 
+                    stats->insns, pc, instruction, disasm_buf);
+        }
+
+        // Increment instruction count
+        stats->insns++;
+        if (tools && tools->profile) {
+            profile_count(tools->profile, pc);
+        }
+        if (tools && tools->sample_interval && --tools->sample_countdown <= 0) {
+            callgraph_sample(tools->callgraph, pc);
+            tools->sample_countdown = tools->sample_interval;
+        }
+
+        // Keep x0 as zero
+        zero = 0;
+
+        // Decode into operation and operands, predecoded if possible
+        struct decoded d;
+        if (predecoded == NULL || !decode_cache_get(predecoded, pc, instruction, &d)) {
+            decode(instruction, &d);
+        }
+        if (op_counts) {
+            op_counts[d.op]++;
+        }
+        // What the cache and timing models see of the instruction
+        struct retired retired = { pc, 0, registers[d.rs1] + d.imm, d.op, d.rd, d.rs1, d.rs2,
+                                   CACHE_SERVED_L1, CACHE_SERVED_L1, 0 };
+        if (tools && tools->caches) {
+            const struct insn_desc *desc = &decode_table[d.op];
+            retired.fetch_served = caches_fetch(tools->caches, pc);
+            if (desc->cls == CLASS_LOAD || desc->cls == CLASS_STORE) {
+                retired.data_served = caches_data(tools->caches, retired.addr, desc->size, desc->cls == CLASS_STORE);
+            }
+        }
+        if (tools && tools->fetch_distances) {
+            const struct insn_desc *desc = &decode_table[d.op];
+            stackdist_access(tools->fetch_distances, pc, 4);
+            if (desc->cls == CLASS_LOAD || desc->cls == CLASS_STORE) {
+                stackdist_access(tools->data_distances, retired.addr, desc->size);
+            }
+        }
+        uint32_t rd = d.rd;
+        uint32_t rs1 = d.rs1;
+        uint32_t rs2 = d.rs2;
+        int32_t imm = d.imm;
+
+        // Default next PC is next instruction
+        uint32_t next_pc = pc + 4;
+        prev_pc = pc;  // Save current PC
+
+        // Execute instruction
+        switch (d.op) {
+            case OP_LUI:
+                registers[rd] = imm;
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+
+            case OP_AUIPC:
+                registers[rd] = pc + imm;
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+
+            case OP_JAL:
+                registers[rd] = pc + 4;
+                next_pc = pc + imm;
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+
+            case OP_JALR:
+                {
+                    uint32_t temp = pc + 4;
+                    next_pc = (registers[rs1] + imm) & ~1;
+                    registers[rd] = temp;
+                    log_register_change(log_file, rd, registers[rd]);
+                }
+                break;
+
+            // Branch instructions
+            case OP_BEQ:
+            case OP_BNE:
+            case OP_BLT:
+            case OP_BGE:
+            case OP_BLTU:
+            case OP_BGEU:
+                {
+                    bool take_branch;
+                    switch (d.op) {
+                        case OP_BEQ:
+                            take_branch = (registers[rs1] == registers[rs2]);
+                            break;
+                        case OP_BNE:
+                            take_branch = (registers[rs1] != registers[rs2]);
+                            break;
+                        case OP_BLT:
+                            take_branch = (registers[rs1] < registers[rs2]);
+                            break;
+                        case OP_BGE:
+                            take_branch = (registers[rs1] >= registers[rs2]);
+                            break;
+                        case OP_BLTU:
+                            take_branch = ((uint32_t)registers[rs1] < (uint32_t)registers[rs2]);
+                            break;
+                        default: // BGEU
+                            take_branch = ((uint32_t)registers[rs1] >= (uint32_t)registers[rs2]);
+                            break;
+                    }
+                    if (take_branch) {
+                        next_pc = pc + imm;
+                        log_branch_taken(log_file);
+                        if (op_counts) {
+                            stats->branches_taken++;
+                        }
+                    }
+                    if (tools && tools->bpred) {
+                        retired.mispredicted = bpred_branch(tools->bpred, pc, pc + imm, take_branch);
+                    }
+                }
+                break;
+
+            // Load instructions
+            case OP_LB:
+                registers[rd] = sign_extend(memory_rd_b(mem, registers[rs1] + imm), 8);
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_LH:
+                registers[rd] = sign_extend(memory_rd_h(mem, registers[rs1] + imm), 16);
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_LW:
+                registers[rd] = memory_rd_w(mem, registers[rs1] + imm);
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_LBU:
+                registers[rd] = memory_rd_b(mem, registers[rs1] + imm) & 0xFF;
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_LHU:
+                registers[rd] = memory_rd_h(mem, registers[rs1] + imm) & 0xFFFF;
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+
+            // Store instructions
+            case OP_SB:
+                memory_wr_b(mem, registers[rs1] + imm, registers[rs2]);
+                log_memory_write(log_file, registers[rs1] + imm, registers[rs2] & 0xFF, 1);
+                break;
+            case OP_SH:
+                memory_wr_h(mem, registers[rs1] + imm, registers[rs2]);
+                log_memory_write(log_file, registers[rs1] + imm, registers[rs2] & 0xFFFF, 2);
+                break;
+            case OP_SW:
+                memory_wr_w(mem, registers[rs1] + imm, registers[rs2]);
+                log_memory_write(log_file, registers[rs1] + imm, registers[rs2], 4);
+                break;
+
+            // Immediate arithmetic
+            case OP_ADDI:
+                registers[rd] = registers[rs1] + imm;
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_SLTI:
+                registers[rd] = (registers[rs1] < imm) ? 1 : 0;
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_SLTIU:
+                registers[rd] = ((uint32_t)registers[rs1] < (uint32_t)imm) ? 1 : 0;
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_XORI:
+                registers[rd] = registers[rs1] ^ imm;
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_ORI:
+                registers[rd] = registers[rs1] | imm;
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_ANDI:
+                registers[rd] = registers[rs1] & imm;
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_SLLI:
+                registers[rd] = (uint32_t)registers[rs1] << imm;
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_SRLI:
+                registers[rd] = (uint32_t)registers[rs1] >> imm;
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_SRAI:
+                registers[rd] = registers[rs1] >> imm;
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+
+            // Register arithmetic
+            case OP_ADD:
+                registers[rd] = (uint32_t)registers[rs1] + (uint32_t)registers[rs2];
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_SUB:
+                registers[rd] = (uint32_t)registers[rs1] - (uint32_t)registers[rs2];
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_SLL:
+                registers[rd] = (uint32_t)registers[rs1] << (registers[rs2] & 0x1F);
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_SLT:
+                registers[rd] = (registers[rs1] < registers[rs2]) ? 1 : 0;
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_SLTU:
+                registers[rd] = ((uint32_t)registers[rs1] < (uint32_t)registers[rs2]) ? 1 : 0;
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_XOR:
+                registers[rd] = registers[rs1] ^ registers[rs2];
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_SRL:
+                registers[rd] = (uint32_t)registers[rs1] >> (registers[rs2] & 0x1F);
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_SRA:
+                registers[rd] = registers[rs1] >> (registers[rs2] & 0x1F);
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_OR:
+                registers[rd] = registers[rs1] | registers[rs2];
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_AND:
+                registers[rd] = registers[rs1] & registers[rs2];
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+
+            // Multiply and divide
+            case OP_MUL:
+                registers[rd] = (uint32_t)registers[rs1] * (uint32_t)registers[rs2];
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_MULH:
+                registers[rd] = ((int64_t)registers[rs1] * (int64_t)registers[rs2]) >> 32;
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_MULHSU:
+                registers[rd] = ((int64_t)registers[rs1] * (int64_t)(uint32_t)registers[rs2]) >> 32;
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_MULHU:
+                registers[rd] = ((uint64_t)(uint32_t)registers[rs1] * (uint32_t)registers[rs2]) >> 32;
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_DIV:
+                if (registers[rs2] == 0) {
+                    registers[rd] = -1;
+                } else if (registers[rs2] == -1 && registers[rs1] == INT32_MIN) {
+                    registers[rd] = INT32_MIN;  // overflow
+                } else {
+                    registers[rd] = registers[rs1] / registers[rs2];
+                }
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_DIVU:
+                if (registers[rs2] != 0) {
+                    registers[rd] = (int32_t)((uint32_t)registers[rs1] / (uint32_t)registers[rs2]);
+                } else {
+                    registers[rd] = -1;
+                }
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_REM:
+                if (registers[rs2] == 0) {
+                    registers[rd] = registers[rs1];
+                } else if (registers[rs2] == -1) {
+                    registers[rd] = 0;  // also covers the INT32_MIN overflow
+                } else {
+                    registers[rd] = registers[rs1] % registers[rs2];
+                }
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+            case OP_REMU:
+                if (registers[rs2] != 0) {
+                    registers[rd] = (int32_t)((uint32_t)registers[rs1] % (uint32_t)registers[rs2]);
+                } else {
+                    registers[rd] = registers[rs1];
+                }
+                log_register_change(log_file, rd, registers[rd]);
+                break;
+
+            case OP_ECALL:
+                if (op_counts) {
+                    stats->syscalls[(uint32_t)a7 < SIM_SYSCALL_SLOTS ? a7 : SIM_SYSCALL_SLOTS - 1]++;
+                }
+                switch (a7) {
+                    case 1: // getchar
+                        a0 = getchar();
+                        if (log_file) fprintf(log_file, "getchar() -> %c\n", a0);
+                        log_register_change(log_file, 10, a0);
+                        break;
+                    case 2: // putchar
+                        putchar(a0);
+                        if (log_file) fprintf(log_file, "putchar(%c)\n", a0);
+                        break;
+                    case 3: case 93: // exit
+                        if (log_file) fprintf(log_file, "exit()\n");
+                        return;
+                    default:
+                        stop(stats, SIM_FAULT_UNKNOWN_SYSCALL, pc, instruction);
+                        return;
+                }
+                break;
+
+            default:
+                stop(stats, SIM_FAULT_ILLEGAL_INSTRUCTION, pc, instruction);
+                return;
+        }
+
+        // Calls write ra, returns jump through it
+        if (tools && tools->callgraph) {
+            if ((d.op == OP_JAL || d.op == OP_JALR) && rd == 1) {
+                callgraph_call(tools->callgraph, pc, next_pc, stats->insns);
+            } else if (d.op == OP_JALR && rd == 0 && rs1 == 1) {
+                callgraph_return(tools->callgraph, next_pc, stats->insns);
+            }
+        }
+
+        if (tools && tools->bpred && (d.op == OP_JAL || d.op == OP_JALR)) {
+            retired.mispredicted = bpred_jump(tools->bpred, pc, next_pc, rd, rs1, d.op == OP_JALR);
+        }
+        if (tools && (tools->pipeline || tools->ooo || tools->ilp)) {
+            retired.next_pc = next_pc;
+            if (tools->pipeline) {
+                pipeline_retire(tools->pipeline, &retired);
+            }
+            if (tools->ooo) {
+                ooo_retire(tools->ooo, &retired);
+            }
+            if (tools->ilp) {
+                ilp_retire(tools->ilp, &retired);
+            }
+        }
+
+        // Add newline to log if needed
+        if (log_file) {
+            fprintf(log_file, "\n");
+        }
+
+        // Update PC
+        pc = next_pc;
+    }
+}
+
+static void execute(struct memory *mem, struct cpu_state *cpu, uint32_t stop_pc, const struct decode_cache *predecoded, struct Stat *stats, FILE *log_file, struct symbols* symbols) {
+    run(mem, cpu, stop_pc, predecoded, NULL, NULL, stats, log_file, symbols);
+}
+
+// Only the event counts, straight into stats like every other count, so
+// they are whole when a memory fault longjmps out of run
+static void execute_counted(struct memory *mem, struct cpu_state *cpu, uint32_t stop_pc, const struct decode_cache *predecoded, struct Stat *stats, FILE *log_file, struct symbols* symbols) {
+    run(mem, cpu, stop_pc, predecoded, NULL, stats->op_counts, stats, log_file, symbols);
+}
+
+static void execute_measured(struct memory *mem, struct cpu_state *cpu, uint32_t stop_pc, const struct decode_cache *predecoded, struct sim_tools *tools, struct Stat *stats, FILE *log_file, struct symbols* symbols) {
+    run(mem, cpu, stop_pc, predecoded, tools, tools->count_events ? stats->op_counts : NULL, stats, log_file, symbols);
+}
+
+// Tools other than the event counts need execute_measured
+static int only_counting(const struct sim_tools *tools) {
+    return tools->count_events && !tools->profile && !tools->callgraph && !tools->sample_interval && !tools->caches
+           && !tools->fetch_distances && !tools->bpred && !tools->pipeline && !tools->ooo && !tools->ilp;
+}
+
+// Where a watchpoint hit happened, for report_watch
+struct watch_context {
+    struct cpu_state *cpu;
+    struct Stat *stats;
+};
+
+static void report_watch(void *ctx, unsigned addr, int size, unsigned old_value, unsigned new_value) {
+    struct watch_context *where = ctx;
+    fprintf(stderr, "Watchpoint: pc %x, instruction %ld: M[%x] %x -> %x (%d bytes)\n",
+            where->cpu->pc, where->stats->insns - 1, addr, old_value, new_value, size);
+}
+
+struct Stat simulate(struct memory *mem, struct cpu_state *cpu, const struct decode_cache *predecoded, struct sim_tools *tools, FILE *log_file, struct symbols* symbols) {
+    return simulate_to(mem, cpu, SIMULATE_NO_STOP, predecoded, tools, log_file, symbols);
+}
+
+struct Stat simulate_to(struct memory *mem, struct cpu_state *cpu, uint32_t stop_pc, const struct decode_cache *predecoded, struct sim_tools *tools, FILE *log_file, struct symbols* symbols) {
+    struct Stat stats = {0};  // Initialize statistics
+    struct watch_context where = { cpu, &stats };
+    memory_set_watch_handler(mem, report_watch, &where);
+    long misaligned = memory_misaligned_count(mem);
+    jmp_buf trap;
+    memory_set_trap(mem, &trap);
+    if (tools && tools->callgraph) {
+        callgraph_start(tools->callgraph, cpu->pc, 0);
+    }
+    if (setjmp(trap) == 0) {
+        if (tools && only_counting(tools)) {
+            execute_counted(mem, cpu, stop_pc, predecoded, &stats, log_file, symbols);
+        } else if (tools) {
+            execute_measured(mem, cpu, stop_pc, predecoded, tools, &stats, log_file, symbols);
+        } else {
+            execute(mem, cpu, stop_pc, predecoded, &stats, log_file, symbols);
+        }
+    } else {
+        enum sim_fault fault = SIM_FAULT_HOST_MEMORY;
+        switch (memory_get_fault(mem, &stats.fault_addr)) {
+            case MEM_FAULT_LIMIT:
+                fault = SIM_FAULT_MEMORY_LIMIT;
+                break;
+            case MEM_FAULT_MISALIGNED:
+                fault = SIM_FAULT_MISALIGNED;
+                break;
+            default:
+                break;
+        }
+        stop(&stats, fault, cpu->pc, 0);
+    }
+    memory_set_trap(mem, NULL);
+    if (tools && tools->callgraph) {
+        callgraph_stop(tools->callgraph, stats.insns);
+    }
+    if (stats.fault == SIM_FAULT_ILLEGAL_INSTRUCTION || stats.fault == SIM_FAULT_UNKNOWN_SYSCALL) {
+        if (log_file) {
+            fprintf(log_file, "\nfault at %x: %08x\n", stats.fault_pc, stats.fault_insn);
+        }
+    } else if (stats.fault != SIM_OK) {
+        // without the trap a fault here reads as 0 instead of jumping back
+        stats.fault_insn = memory_rd_w(mem, stats.fault_pc);
+        if (log_file) {
+            fprintf(log_file, "\nfault at %x accessing %x\n", stats.fault_pc, stats.fault_addr);
+        }
+    }
+    if (tools && tools->count_events) {
+        for (int op = 0; op < NUM_OPS; op++) {
+            long bytes = stats.op_counts[op] * decode_table[op].size;
+            if (decode_table[op].cls == CLASS_LOAD) {
+                stats.bytes_loaded += bytes;
+            } else if (decode_table[op].cls == CLASS_STORE) {
+                stats.bytes_stored += bytes;
+            }
+        }
+    }
+    stats.misaligned = memory_misaligned_count(mem) - misaligned;
+    memory_set_watch_handler(mem, NULL, NULL);
+    return stats;
+}
@@ -3,11 +3,92 @@
 
 #include "memory.h"
 #include "read_elf.h"
+#include "decode.h"
+#include "profile.h"
+#include "callgraph.h"
+#include "cache.h"
+#include "stackdist.h"
+#include "bpred.h"
+#include "pipeline.h"
+#include "ooo.h"
+#include "ilp.h"
 #include <stdio.h>
+#include <stdint.h>
 
-// Simuler RISC-V program i givet lager og fra given start adresse
-struct Stat { long int insns; };
+// Registerfil og programtæller for den simulerede processor
+struct cpu_state { int32_t regs[32]; uint32_t pc; };
 
-struct Stat simulate(struct memory *mem, int start_addr, FILE *log_file, struct symbols* symbols);
+// Nulstil registre og sæt start adresse
+void cpu_init(struct cpu_state *cpu, uint32_t start_addr);
+
+// Grund til at simuleringen stoppede uden at programmet selv afsluttede
+enum sim_fault
+{
+  SIM_OK,
+  SIM_FAULT_MEMORY_LIMIT,    // programmet brugte flere sider end tilladt
+  SIM_FAULT_MISALIGNED,      // ujusteret adgang i strict mode
+  SIM_FAULT_HOST_MEMORY,     // værten løb tør for lager
+  SIM_FAULT_ILLEGAL_INSTRUCTION,
+  SIM_FAULT_UNKNOWN_SYSCALL  // ukendt nummer i a7 ved ecall
+};
+
+#define SIM_SYSCALL_SLOTS 128   // ecall numre der tælles hver for sig, større i den sidste
+
+struct Stat
+{
+  long int insns;
+  long int misaligned;   // ujusterede lageradgange
+  enum sim_fault fault;
+  uint32_t fault_pc;     // instruktionen der fejlede
+  uint32_t fault_insn;   // og dens instruktionsord
+  uint32_t fault_addr;   // adressen den tilgik (kun lagerfejl)
+  // resten tælles kun når værktøjerne har count_events sat
+  long int op_counts[NUM_OPS];    // udførte instruktioner pr. enum rv_op
+  long int branches_taken;
+  long int syscalls[SIM_SYSCALL_SLOTS]; // ecall pr. nummer i a7
+  long int bytes_loaded;
+  long int bytes_stored;
+};
+
+// Værktøjer der måler på en kørsel; felter der er NULL bruges ikke.
+// Uden værktøjer kører simulate uden nogen ekstra arbejde pr. instruktion.
+struct sim_tools
+{
+  struct profile *profile;   // udførelser pr. instruktion
+  struct callgraph *callgraph; // kald og retur mellem funktioner
+  long sample_interval;      // tag en stikprøve af kaldstakken for hver så mange instruktioner
+  long sample_countdown;     // instruktioner til næste stikprøve
+  int count_events;          // tæl instruktioner, hop og systemkald i Stat
+  struct caches *caches;     // cachehierarki der fodres med hentninger og lageradgange
+  struct stackdist *fetch_distances; // stakafstande for hentninger af instruktioner
+  struct stackdist *data_distances;  // og for lageradgange (begge eller ingen)
+  struct bpred *bpred;       // forudsigelse af hop og spring
+  struct pipeline *pipeline; // cyklusser i en simpel 5-trins pipeline
+  struct ooo *ooo;           // og i en out-of-order kerne
+  struct ilp *ilp;           // parallelitet begrænset kun af afhængigheder
+};
+
+// Simuler RISC-V program i givet lager fra tilstanden i cpu.
+// Ved afslutning indeholder cpu den endelige tilstand. Fejl i programmet
+// afslutter ikke processen; simulate returnerer med grunden i fault.
+// predecoded er tekstsegmentet afkodet på forhånd og tools de værktøjer
+// der måler på kørslen (begge kan være NULL).
+
+struct Stat simulate(struct memory *mem, struct cpu_state *cpu, const struct decode_cache *predecoded, struct sim_tools *tools, FILE *log_file, struct symbols* symbols);
+
+// Som simulate, men stop også lige før instruktionen ved stop_pc udføres
+// (så er cpu->pc == stop_pc). SIMULATE_NO_STOP kan aldrig være en pc.
+#define SIMULATE_NO_STOP 0xFFFFFFFFu
+struct Stat simulate_to(struct memory *mem, struct cpu_state *cpu, uint32_t stop_pc, const struct decode_cache *predecoded, struct sim_tools *tools, FILE *log_file, struct symbols* symbols);
+
+// Afkod instruktionerne i [start,end) på én gang til brug for simulate;
+// NULL hvis værten mangler lager
+struct decode_cache *simulate_predecode(struct memory *mem, uint32_t start, uint32_t end);
+
+// Gem lager og registre som basis for senere kørsler; -1 hvis værten
+// mangler lager til basis
+int simulate_snapshot(struct memory *mem, const struct cpu_state *cpu, struct cpu_state *baseline);
+// Gendan registre og de sider der er skrevet siden basis; returnerer antal sider
+long simulate_reset(struct memory *mem, struct cpu_state *cpu, const struct cpu_state *baseline);
 
 #endif
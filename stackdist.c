@@ -0,0 +1,265 @@
+#include "stackdist.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_WAYS 16         // depth of the per set stacks
+#define MIN_SET_BITS 4      // set associative caches of 16..4096 sets
+#define MAX_SET_BITS 12
+#define NUM_SET_COUNTS (MAX_SET_BITS - MIN_SET_BITS + 1)
+#define NUM_BINS 33         // bin 0 is distance 0, bin i is [2^(i-1), 2^i)
+#define FIRST_CAPACITY (1u << 16)
+
+// Time of the last use of a line, open addressing
+struct line_slot {
+    uint32_t line;      // line number + 1, 0 marks a free slot
+    uint32_t time;
+};
+
+struct stackdist {
+    unsigned line_bits;
+    struct line_slot* slots;
+    unsigned size_bits;     // the table has 2^size_bits slots
+    unsigned used;          // distinct lines seen
+    // Fenwick tree over time with a 1 at the last use of every line, so
+    // the lines used after time t are used minus the prefix sum up to t
+    uint32_t* tree;
+    uint32_t* line_at;      // line number + 1 used at each time
+    uint32_t capacity;
+    uint32_t now;
+    long accesses;
+    long cold;              // first use of a line
+    long untracked;         // accesses counted as cold because the host ran out of memory
+    long bins[NUM_BINS];
+    uint32_t* recent[NUM_SET_COUNTS];   // most recent lines of every set, most recent first
+    long way_hits[NUM_SET_COUNTS][MAX_WAYS];    // hits at each depth of the set stacks
+};
+
+struct stackdist* stackdist_create(unsigned line_size) {
+    struct stackdist* dist = calloc(1, sizeof(struct stackdist));
+    if (dist == NULL) {
+        return NULL;
+    }
+    while ((1u << dist->line_bits) < line_size) {
+        dist->line_bits++;
+    }
+    dist->size_bits = 10;
+    dist->slots = calloc(1u << dist->size_bits, sizeof(struct line_slot));
+    dist->capacity = FIRST_CAPACITY;
+    dist->tree = calloc(dist->capacity + 1, sizeof(uint32_t));
+    dist->line_at = calloc(dist->capacity + 1, sizeof(uint32_t));
+    int failed = dist->slots == NULL || dist->tree == NULL || dist->line_at == NULL;
+    for (int k = 0; k < NUM_SET_COUNTS; k++) {
+        dist->recent[k] = calloc((size_t)MAX_WAYS << (MIN_SET_BITS + k), sizeof(uint32_t));
+        failed |= dist->recent[k] == NULL;
+    }
+    if (failed) {
+        stackdist_delete(dist);
+        return NULL;
+    }
+    return dist;
+}
+
+void stackdist_delete(struct stackdist* dist) {
+    free(dist->slots);
+    free(dist->tree);
+    free(dist->line_at);
+    for (int k = 0; k < NUM_SET_COUNTS; k++) {
+        free(dist->recent[k]);
+    }
+    free(dist);
+}
+
+static struct line_slot* line_slot(struct line_slot* slots, unsigned size_bits, uint32_t key) {
+    unsigned mask = (1u << size_bits) - 1;
+    unsigned at = (key * 2654435761u) >> (32 - size_bits);
+    while (slots[at].line && slots[at].line != key) {
+        at = (at + 1) & mask;
+    }
+    return &slots[at];
+}
+
+// slot of a line, a free slot for it if it is new (NULL if out of host memory)
+static struct line_slot* find_line(struct stackdist* dist, uint32_t key) {
+    if (2 * (dist->used + 1) > (1u << dist->size_bits)) {
+        // keep the table at most half full
+        unsigned size_bits = dist->size_bits + 1;
+        struct line_slot* slots = calloc(1u << size_bits, sizeof(struct line_slot));
+        if (slots == NULL) {
+            return NULL;
+        }
+        for (unsigned i = 0; i < (1u << dist->size_bits); i++) {
+            if (dist->slots[i].line) {
+                *line_slot(slots, size_bits, dist->slots[i].line) = dist->slots[i];
+            }
+        }
+        free(dist->slots);
+        dist->slots = slots;
+        dist->size_bits = size_bits;
+    }
+    return line_slot(dist->slots, dist->size_bits, key);
+}
+
+static void tree_add(struct stackdist* dist, uint32_t time, int delta) {
+    for (; time <= dist->capacity; time += time & -time) {
+        dist->tree[time] += delta;
+    }
+}
+
+static uint32_t tree_prefix(const struct stackdist* dist, uint32_t time) {
+    uint32_t sum = 0;
+    for (; time; time -= time & -time) {
+        sum += dist->tree[time];
+    }
+    return sum;
+}
+
+// When time runs out, number the last uses 1..used in their order again,
+// growing the tree if that leaves it more than half full
+static int compact(struct stackdist* dist) {
+    uint32_t capacity = dist->capacity;
+    if (2 * (uint64_t)dist->used > capacity) {
+        capacity *= 2;
+        uint32_t* tree = realloc(dist->tree, (capacity + 1) * sizeof(uint32_t));
+        if (tree == NULL) {
+            return -1;
+        }
+        dist->tree = tree;
+        uint32_t* line_at = realloc(dist->line_at, (capacity + 1) * sizeof(uint32_t));
+        if (line_at == NULL) {
+            return -1;
+        }
+        dist->line_at = line_at;
+    }
+    uint32_t live = 0;
+    for (uint32_t time = 1; time <= dist->capacity; time++) {
+        uint32_t key = dist->line_at[time];
+        if (key) {
+            struct line_slot* slot = line_slot(dist->slots, dist->size_bits, key);
+            if (slot->time == time) {
+                slot->time = ++live;
+                dist->line_at[live] = key;
+            }
+        }
+    }
+    memset(&dist->line_at[live + 1], 0, (capacity - live) * sizeof(uint32_t));
+    // build the tree bottom up
+    memset(dist->tree, 0, (capacity + 1) * sizeof(uint32_t));
+    for (uint32_t time = 1; time <= capacity; time++) {
+        dist->tree[time] += time <= live;
+        uint32_t parent = time + (time & -time);
+        if (parent <= capacity) {
+            dist->tree[parent] += dist->tree[time];
+        }
+    }
+    dist->capacity = capacity;
+    dist->now = live;
+    return 0;
+}
+
+static int bin_of(uint32_t distance) {
+    return distance ? 32 - __builtin_clz(distance) : 0;
+}
+
+static void access_line(struct stackdist* dist, uint32_t line) {
+    uint32_t key = line + 1;
+    dist->accesses++;
+
+    // set stacks, where the depth of a hit is its distance within the set
+    for (int k = 0; k < NUM_SET_COUNTS; k++) {
+        uint32_t* recent = &dist->recent[k][(line & ((1u << (MIN_SET_BITS + k)) - 1)) * MAX_WAYS];
+        int depth = 0;
+        while (depth < MAX_WAYS - 1 && recent[depth] != key) {
+            depth++;
+        }
+        if (recent[depth] == key) {
+            dist->way_hits[k][depth]++;
+        }
+        memmove(&recent[1], &recent[0], depth * sizeof(uint32_t));
+        recent[0] = key;
+    }
+
+    if (dist->now == dist->capacity && compact(dist)) {
+        dist->untracked++;
+        dist->cold++;
+        return;
+    }
+    struct line_slot* slot = find_line(dist, key);
+    if (slot == NULL) {
+        dist->untracked++;
+        dist->cold++;
+        return;
+    }
+    if (slot->line) {
+        dist->bins[bin_of(dist->used - tree_prefix(dist, slot->time))]++;
+        tree_add(dist, slot->time, -1);
+    } else {
+        slot->line = key;
+        dist->used++;
+        dist->cold++;
+    }
+    slot->time = ++dist->now;
+    dist->line_at[dist->now] = key;
+    tree_add(dist, dist->now, 1);
+}
+
+void stackdist_access(struct stackdist* dist, uint32_t addr, int size) {
+    uint32_t first = addr >> dist->line_bits;
+    uint32_t last = (addr + size - 1) >> dist->line_bits;
+    for (uint32_t line = first; ; line++) {
+        access_line(dist, line);
+        if (line == last) {
+            break;
+        }
+    }
+}
+
+static const char* format_size(char* buf, size_t size, uint64_t bytes) {
+    if (bytes >= (1u << 20) && bytes % (1u << 20) == 0) {
+        snprintf(buf, size, "%luM", (unsigned long)(bytes >> 20));
+    } else if (bytes >= 1024 && bytes % 1024 == 0) {
+        snprintf(buf, size, "%luK", (unsigned long)(bytes >> 10));
+    } else {
+        snprintf(buf, size, "%lu", (unsigned long)bytes);
+    }
+    return buf;
+}
+
+void stackdist_report(struct stackdist* dist, const char* name, FILE* out) {
+    char size[16];
+    double total = dist->accesses ? dist->accesses : 1;
+    fprintf(out, "Miss ratio curves for %s (%u byte lines): %ld accesses, %u distinct lines\n", name,
+            1u << dist->line_bits, dist->accesses, dist->used);
+    if (dist->untracked) {
+        fprintf(out, "  (out of host memory: %ld accesses counted as misses)\n", dist->untracked);
+    }
+
+    // a cache of 2^k lines misses the accesses with a distance of 2^k or more
+    fprintf(out, "  Fully associative LRU:\n  %10s %10s %13s %7s\n", "size", "lines", "misses", "miss%");
+    long misses = dist->accesses;
+    for (int k = 0; k < 32; k++) {
+        misses -= dist->bins[k];
+        fprintf(out, "  %10s %10u %13ld %7.2f\n", format_size(size, sizeof(size), (uint64_t)1 << (k + dist->line_bits)),
+                1u << k, misses, 100.0 * misses / total);
+        if ((1u << k) >= dist->used) {
+            break;
+        }
+    }
+
+    fprintf(out, "  Set associative LRU, miss%% by ways (size = sets * ways * line):\n  %10s %10s", "sets", "way size");
+    for (int ways = 1; ways <= MAX_WAYS; ways *= 2) {
+        fprintf(out, " %7d", ways);
+    }
+    fprintf(out, "\n");
+    for (int k = 0; k < NUM_SET_COUNTS; k++) {
+        unsigned sets = 1u << (MIN_SET_BITS + k);
+        fprintf(out, "  %10u %10s", sets, format_size(size, sizeof(size), (uint64_t)sets << dist->line_bits));
+        long hits = 0;
+        for (int depth = 0; depth < MAX_WAYS; depth++) {
+            hits += dist->way_hits[k][depth];
+            if (((depth + 1) & depth) == 0) {
+                fprintf(out, " %7.2f", 100.0 * (dist->accesses - hits) / total);
+            }
+        }
+        fprintf(out, "\n");
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef __STACKDIST_H__
+#define __STACKDIST_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+// LRU stack distances of one stream of accesses (fetches or data), from
+// which the miss ratio of many LRU caches follows in a single run. The
+// stack distance of an access is the number of distinct lines used since
+// the previous access to its line; it hits in every fully associative LRU
+// cache with more lines than that. Set associative caches are covered by
+// keeping the 16 most recent lines of each set for a range of set counts.
+struct stackdist;
+
+// distances for lines of line_size bytes, a power of two of at least 4
+// (return NULL if out of host memory)
+struct stackdist* stackdist_create(unsigned line_size);
+
+void stackdist_delete(struct stackdist* dist);
+
+// access of size bytes at addr
+void stackdist_access(struct stackdist* dist, uint32_t addr, int size);
+
+// write miss ratio curves for fully associative caches of every power of
+// two lines and for the set associative configurations
+void stackdist_report(struct stackdist* dist, const char* name, FILE* out);
+
+#endif
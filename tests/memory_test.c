@@ -0,0 +1,173 @@
+// Checks of guest memory: sharing between a template and its clones,
+// and watchpoints.
+// Build and run with "make test".
+#include "../memory.h"
+#include <stdio.h>
+
+static int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do                                                                  \
+  {                                                                   \
+    if (!(cond))                                                      \
+    {                                                                 \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++;                                                     \
+    }                                                                 \
+  } while (0)
+
+// A store to the template after its snapshot, then a clone, then a reset
+// of the template: the clone keeps what it saw when it was made.
+static void test_reset_after_clone()
+{
+  struct memory *template = memory_create();
+  memory_wr_w(template, 0x10000, 1);      // non-zero at the snapshot
+  memory_wr_w(template, 0x20000, 0);      // zero at the snapshot
+  CHECK(memory_snapshot(template) == 0);
+  memory_wr_w(template, 0x10000, 2);
+  memory_wr_w(template, 0x20000, 3);
+  struct memory *clone = memory_clone(template);
+  CHECK(clone != NULL);
+  CHECK(memory_reset(template) == 2);
+
+  CHECK(memory_rd_w(template, 0x10000) == 1);
+  CHECK(memory_rd_w(template, 0x20000) == 0);
+  CHECK(memory_rd_w(clone, 0x10000) == 2);
+  CHECK(memory_rd_w(clone, 0x20000) == 3);
+
+  // both go on independently, in either order of deletion
+  memory_wr_w(template, 0x20000, 4);
+  memory_wr_w(clone, 0x20000, 5);
+  CHECK(memory_rd_w(template, 0x20000) == 4);
+  CHECK(memory_rd_w(clone, 0x20000) == 5);
+  memory_delete(template);
+  CHECK(memory_rd_w(clone, 0x10000) == 2);
+  memory_wr_w(clone, 0x10000, 6);
+  CHECK(memory_rd_w(clone, 0x10000) == 6);
+  memory_delete(clone);
+}
+
+// A clone that outlives its template is charged for the pages it takes
+// over, and its limit applies to them
+static void test_clone_takes_over()
+{
+  struct memory *template = memory_create();
+  memory_wr_w(template, 0x10000, 1);
+  memory_wr_w(template, 0x20000, 2);
+  struct memory *clone = memory_clone(template);
+  memory_delete(template);
+  memory_set_limit(clone, 1);
+
+  struct memory_usage usage;
+  memory_get_usage(clone, &usage);
+  CHECK(usage.resident_pages == 0);
+  memory_wr_w(clone, 0x10000, 3);
+  memory_get_usage(clone, &usage);
+  CHECK(usage.resident_pages == 1);
+  CHECK(usage.pages == 2);
+  CHECK(memory_get_fault(clone, NULL) == MEM_FAULT_NONE);
+
+  memory_wr_w(clone, 0x20000, 4);
+  CHECK(memory_get_fault(clone, NULL) == MEM_FAULT_LIMIT);
+  CHECK(memory_rd_w(clone, 0x20000) == 2);
+  memory_delete(clone);
+}
+
+// The template pays for its private copy only once it lets go of the
+// contents it shares
+static void test_template_unshares()
+{
+  struct memory *template = memory_create();
+  memory_wr_w(template, 0x10000, 1);
+  memory_set_limit(template, 1);
+  struct memory *clone = memory_clone(template);
+  memory_wr_w(template, 0x10000, 2);
+  CHECK(memory_get_fault(template, NULL) == MEM_FAULT_NONE);
+
+  struct memory_usage usage;
+  memory_get_usage(template, &usage);
+  CHECK(usage.resident_pages == 1);
+  memory_wr_w(clone, 0x10000, 3);
+  memory_get_usage(clone, &usage);
+  CHECK(usage.resident_pages == 1);
+  CHECK(memory_rd_w(template, 0x10000) == 2);
+  CHECK(memory_rd_w(clone, 0x10000) == 3);
+  memory_delete(clone);
+  memory_delete(template);
+}
+
+struct watch_report
+{
+  int count;
+  unsigned addr;
+  int size;
+  unsigned old_value;
+  unsigned new_value;
+};
+
+static void record_watch(void *ctx, unsigned addr, int size, unsigned old_value, unsigned new_value)
+{
+  struct watch_report *report = ctx;
+  report->count++;
+  report->addr = addr;
+  report->size = size;
+  report->old_value = old_value;
+  report->new_value = new_value;
+}
+
+// A misaligned store to a watched word, here also across a page boundary,
+// is one report with the whole old and new value
+static void test_misaligned_watch()
+{
+  struct memory *mem = memory_create();
+  struct watch_report report = {0};
+  memory_wr_w(mem, 0x1ffc, 0x44332211);
+  memory_wr_w(mem, 0x2000, 0x88776655);
+  memory_add_watchpoint(mem, 0x2000, 1);
+  memory_set_watch_handler(mem, record_watch, &report);
+  memory_wr_w(mem, 0x1ffe, 0xddccbbaa);
+  CHECK(report.count == 1);
+  CHECK(report.addr == 0x1ffe && report.size == 4);
+  CHECK(report.old_value == 0x66554433);
+  CHECK(report.new_value == 0xddccbbaa);
+  CHECK(memory_rd_w(mem, 0x2000) == (int)0x8877ddcc);
+  CHECK(memory_misaligned_count(mem) == 1);
+
+  // stores that miss the watched byte are not reported
+  memory_wr_h(mem, 0x1ffd, 0x1234);
+  CHECK(report.count == 1);
+  memory_delete(mem);
+}
+
+// A bulk write over a watched range is one report for the part it covers
+static void test_bulk_write_watch()
+{
+  struct memory *mem = memory_create();
+  struct watch_report report = {0};
+  unsigned char bytes[0x2000];
+  for (unsigned i = 0; i < sizeof(bytes); ++i)
+    bytes[i] = i;
+  memory_wr_w(mem, 0x2ffc, 0x44332211);
+  memory_add_watchpoint(mem, 0x2ffc, 0x10);
+  memory_set_watch_handler(mem, record_watch, &report);
+  memory_write_bytes(mem, 0x1ffe, bytes, sizeof(bytes));
+  CHECK(report.count == 1);
+  CHECK(report.addr == 0x2ffc && report.size == 0x10);
+  CHECK(report.old_value == 0x44332211);
+  CHECK(report.new_value == 0x0100fffe);
+  CHECK(memory_rd_w(mem, 0x3000) == 0x05040302);
+  memory_delete(mem);
+}
+
+int main()
+{
+  test_reset_after_clone();
+  test_clone_takes_over();
+  test_template_unshares();
+  test_misaligned_watch();
+  test_bulk_write_watch();
+  if (failures)
+    return 1;
+  printf("memory tests passed\n");
+  return 0;
+}
@@ -0,0 +1,45 @@
+#include "timing.h"
+#include "cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+void timing_default_latencies(struct timing_latencies* latencies) {
+    latencies->mul = 3;
+    latencies->div = 20;
+    latencies->l2 = 12;
+    latencies->memory = 100;
+    latencies->branch = 2;
+}
+
+int timing_parse_latencies(const char* text, struct timing_latencies* latencies) {
+    static const char* names[] = { "mul", "div", "l2", "mem", "branch" };
+    unsigned* fields[] = { &latencies->mul, &latencies->div, &latencies->l2, &latencies->memory, &latencies->branch };
+    while (*text) {
+        size_t length = strcspn(text, "=");
+        int field = -1;
+        for (int i = 0; i < 5; i++) {
+            if (strlen(names[i]) == length && !strncmp(text, names[i], length)) {
+                field = i;
+            }
+        }
+        if (field < 0 || text[length] != '=') {
+            return -1;
+        }
+        char* end;
+        unsigned long cycles = strtoul(text + length + 1, &end, 0);
+        if (end == text + length + 1 || cycles > 100000 || (*end != ',' && *end != 0)) {
+            return -1;
+        }
+        *fields[field] = cycles;
+        text = *end ? end + 1 : end;
+    }
+    // mul and div produce their result at the earliest the cycle after
+    if (latencies->mul < 1 || latencies->div < 1) {
+        return -1;
+    }
+    return 0;
+}
+
+unsigned timing_served_latency(const struct timing_latencies* latencies, int level) {
+    return level == CACHE_SERVED_L2 ? latencies->l2 : level == CACHE_SERVED_MEMORY ? latencies->memory : 0;
+}
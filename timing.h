@@ -0,0 +1,56 @@
+#ifndef __TIMING_H__
+#define __TIMING_H__
+
+#include "decode.h"
+#include <stdint.h>
+
+// One executed instruction as the timing models see it, with what the
+// cache and branch predictor models made of it
+struct retired {
+    uint32_t pc;
+    uint32_t next_pc;
+    uint32_t addr;          // loads and stores: the address accessed
+    uint8_t op;             // as decoded
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    uint8_t fetch_served;   // enum cache_served of the fetch, L1 without caches
+    uint8_t data_served;    // and of the load or store
+    uint8_t mispredicted;   // by the branch predictor model, 0 without one
+};
+
+// Latencies in cycles shared by the timing models
+struct timing_latencies {
+    unsigned mul;
+    unsigned div;           // also rem; div units are not pipelined
+    unsigned l2;            // extra cycles of an access served by L2
+    unsigned memory;        // and by memory
+    unsigned branch;        // fetch bubbles after a branch or jalr is mispredicted
+};
+
+void timing_default_latencies(struct timing_latencies* latencies);
+
+// set latencies from "name=cycles,..." with names mul, div, l2, mem and
+// branch (return -1 if invalid)
+int timing_parse_latencies(const char* text, struct timing_latencies* latencies);
+
+// extra cycles of an access served at level (enum cache_served)
+unsigned timing_served_latency(const struct timing_latencies* latencies, int level);
+
+// Registers an instruction reads (src) and writes (dst), 0 for none.
+// ecall reads a7 and a0 and writes a0.
+static inline void timing_registers(const struct retired* r, int* src1, int* src2, int* dst) {
+    enum rv_format format = decode_table[r->op].format;
+    if (r->op == OP_ECALL) {
+        *src1 = 17;
+        *src2 = 10;
+        *dst = 10;
+        return;
+    }
+    *src1 = format == FMT_R || format == FMT_I || format == FMT_SHIFT || format == FMT_LOAD || format == FMT_S
+            || format == FMT_B ? r->rs1 : 0;
+    *src2 = format == FMT_R || format == FMT_S || format == FMT_B ? r->rs2 : 0;
+    *dst = format == FMT_S || format == FMT_B || format == FMT_NONE ? 0 : r->rd;
+}
+
+#endif